@@ -3,104 +3,1104 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
 #include <unistd.h>
 #include <sys/wait.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <stdint.h>
+#include <limits.h>
+#include <termios.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
 #include <fcntl.h>
+#include <stdarg.h>
+#include <signal.h>
+#include <pthread.h>
 #include <errno.h>
+#include <spawn.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/signalfd.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <time.h>
+#include <sys/syscall.h>
+#include <sys/inotify.h>
+#include <sys/ioctl.h>
+#include <sched.h>
 #include <readline/readline.h>
-#include <readline/history.h>
-#define MAX_INPUT_SIZE 1024
-
-#define MAX_INPUT 4096
-#define MAX_TOKENS 256
-#define MAX_COMMANDS 64
 #define HISTORY_FILE ".myshell_history"
-#define MAX_HISTORY 1000
+#define MAX_HISTORY 100000
+#define HISTORY_RESERVE (64UL << 20)   // address space reserved for new history records
+#define HASH_BUCKETS 256
+#define ARENA_CHUNK (64 * 1024)
+#define JOB_PID_BUCKETS 1024
+#define TRACE_RING 65536                // events kept, a power of two
+#define TRACE_NAMES 64                  // command names with histograms of their own
+#define TRACE_BUCKETS 192               // 4 per power of two of nanoseconds
+#define GLOB_CACHE_BUCKETS 1024
+#define GLOB_CACHE_DIRS 4096            // directories the glob cache keeps at most
+#define GLOB_CACHE_BYTES (64UL << 20)   // and bytes of entries
+#define GLOB_THREADS 4                  // walkers of a ** subtree, at most
+#define COMPLETE_ASK 100                // candidates listed without asking first
+
+extern char **environ;
 
 /* ---------------- Global history ---------------- */
-char *history[MAX_HISTORY];
+/* All history text lives in one contiguous log buffer: the history file is
+   mmap'd MAP_PRIVATE at the start of a larger anonymous reservation and new
+   commands are appended right behind it, each record ending in '\n'.
+   history_ring[] holds (offset, length) pairs into that buffer. */
+struct hist_entry {
+    uint32_t off;
+    uint32_t len;
+};
+
+char *hist_buf = NULL;
+size_t hist_len = 0;            // bytes of log in hist_buf
+size_t hist_cap = 0;            // bytes reserved at hist_buf
+size_t hist_last_off = 0, hist_last_len = 0;   // newest record, for dedup
+int hist_have_last = 0;
+struct hist_entry history_ring[MAX_HISTORY];
+int history_head = 0;           // ring slot of the oldest entry
 int history_count = 0;
+unsigned long history_evicted = 0; // entries evicted from the ring so far
+size_t hist_live_bytes = 0;     // log bytes referenced by the ring
+int history_indexed = 0;        // ring built from the log yet?
+char history_path[4096];
+
+/* Trigram index over the ring for history search, built on first search
+   and then fed by history_index(). Each trigram maps to the ascending list
+   of history sequence numbers (history_evicted + ring index) containing
+   it; numbers below history_evicted are stale and skipped or pruned. */
+struct tri_list {
+    uint32_t key;               // 3 bytes + 1, 0 marks an empty slot
+    uint32_t start, len, cap;
+    uint32_t *seqs;
+};
+
+struct tri_list *tri_table = NULL;
+size_t tri_size = 0, tri_used = 0;
+int tri_ready = 0;
+
+char prompt_buf[1200];
+char *shell_cwd = NULL;         // the working directory, kept by cwd_update()
+unsigned cwd_gen = 0;           // bumped whenever it changes
+uint64_t last_command_ns = 0;   // how long the last line ran, for \D in $PS1
+int interactive = 0;            // terminal session: banner, prompts, line editor
+int history_enabled = 1;        // off for -c and script files
+FILE *script_in = NULL;         // script file being run, else commands come from stdin
+
+/* ---------------- Line arena ---------------- */
+/* Everything the parse/execute path allocates for one input line comes
+   from this bump allocator and is released in one step when the line has
+   run. Chunks are kept across lines, so once the arena has grown to fit
+   the usual line the command path does not call malloc at all. */
+struct arena_chunk {
+    struct arena_chunk *next;
+    size_t size, used;
+    char data[];
+};
+
+struct arena_chunk *arena_head = NULL, *arena_cur = NULL;
+
+/* Buffers too big to be worth keeping as a chunk (command substitution
+   output and the argv split from it) are malloc'd on their own and handed
+   to the arena, which frees them with the line. */
+struct arena_block {
+    struct arena_block *next;
+    void *p;
+};
+
+struct arena_block *arena_blocks = NULL;
+
+/* A malloc'd string that doubles as it grows */
+struct strbuf {
+    char *s;
+    size_t len, cap;
+};
+
+/* allocation counters, shown by the memstats builtin */
+unsigned long arena_chunks = 0;      // chunks ever malloc'd
+size_t arena_reserved = 0;           // bytes held in chunks
+size_t arena_line_bytes = 0;         // bytes handed out for the current line
+size_t arena_last_bytes = 0, arena_peak_bytes = 0;
+unsigned long arena_lines = 0;
+
+#ifdef MYSHELL_COUNT_MALLOC
+/* Debug build (-DMYSHELL_COUNT_MALLOC): count every malloc in the process,
+   libc's own included, so memstats can show calls per command line. */
+extern void *__libc_malloc(size_t);
+extern void *__libc_calloc(size_t, size_t);
+extern void *__libc_realloc(void *, size_t);
+unsigned long malloc_calls = 0;
+void *malloc(size_t n) { malloc_calls++; return __libc_malloc(n); }
+void *calloc(size_t n, size_t m) { malloc_calls++; return __libc_calloc(n, m); }
+void *realloc(void *p, size_t n) { malloc_calls++; return __libc_realloc(p, n); }
+#endif
+unsigned long line_malloc_start = 0, line_malloc_calls = 0;
+
+/* ---------------- Command AST ---------------- */
+/* parse_line() turns a whole input line into this tree in one pass:
+   list of and-or lists (split by ';', '&' or newline), each a chain of
+   pipelines joined by '&&'/'||', each pipeline a vector of commands.
+   Words are kept raw (quotes included) and are expanded just before the
+   command runs. Every node lives in the line arena. */
+enum redir_type { REDIR_IN, REDIR_OUT, REDIR_APPEND, REDIR_HEREDOC, REDIR_HERESTRING };
+enum connector { CONN_END, CONN_AND, CONN_OR };
+enum { HERE_QUOTED = 1, HERE_STRIP = 2 };      // redirect.here: <<'EOF', <<-
+
+struct redirect {
+    int type;
+    char *target;               // raw word; a here-document's delimiter, unquoted
+    const char *body;           // a here-document's lines, pointing into the parsed text
+    size_t blen;
+    int here;                   // HERE_* flags
+    struct redirect *next;
+    struct redirect *here_next; // here-documents whose body is still to come
+};
+
+struct command {
+    int argc;
+    char **argv;                // raw words, NULL-terminated
+    struct redirect *redirs;
+};
+
+struct pipeline {
+    int ncmds;
+    struct command *cmds;
+    int connector;              // how the next pipeline in the and-or list runs
+    struct pipeline *next;
+};
+
+struct and_or {
+    struct pipeline *first;
+    int background;             // terminated by '&'
+    struct and_or *next;
+};
+
+struct cmd_list {
+    struct and_or *first;
+};
+
+int last_status = 0;            // exit status of the last pipeline
+int spawn_status = 127;         // status of a command that failed to launch, see spawn_failed()
+int subst_depth = 0;            // command substitutions running, see command_subst()
+long opt_pipesize = 0;          // set -o pipesize: capacity of new pipes, 0 = kernel default
+int launcher_fd = -1;           // set -o launcher: socket to the launcher process
+pid_t launcher_pid = 0;
+
+/* ---------------- Job table ---------------- */
+/* Every pipeline the shell launches is a job. With job control (an
+   interactive terminal) its processes share a process group of their own,
+   so the terminal and fg/bg signals go to the whole pipeline. Children are
+   reaped from the SIGCHLD self-pipe; job_pids[] maps a reaped pid to its
+   proc in O(1). Jobs sit in job_table[id - 1]; freed jobs and procs go on
+   free lists, so a plain foreground command does not malloc. */
+enum proc_state { PROC_RUNNING, PROC_STOPPED, PROC_DONE };
+
+/* One stage of the last foreground pipeline: its exit status for
+   PIPESTATUS and, under "time", what it cost. Filled from wait4() for a
+   process and from RUSAGE_THREAD for a builtin run by the shell. */
+struct stage_stat {
+    int status;                 // as in $?
+    int ran;                    // end and ru are valid
+    struct timespec end;
+    struct rusage ru;
+};
+
+struct stage_stat *pipe_stats = NULL;
+int pipe_nstats = 0, pipe_stats_cap = 0;
+int *pipestatus = NULL;         // PIPESTATUS: the statuses of the last one to finish
+int pipestatus_n = 0;
+int pipe_timed = 0;             // the running pipeline has a "time" prefix
+struct timespec pipe_start;
+
+struct proc {
+    pid_t pid;
+    int state;
+    int status;                 // raw wait status once stopped or done
+    struct stage_stat *stat;    // foreground stage to fill in, else NULL
+    int trace;                  // trace name for a PH_WAIT event, 0: none
+    uint64_t trace_start;
+    struct job *job;
+    struct proc *next;          // next stage of the same job
+    struct proc *hash_next;
+};
+
+struct job {
+    int id;
+    pid_t pgid;
+    struct proc *procs, *last;  // in pipeline order
+    int nrunning, nstopped;
+    int background;
+    int notified;               // "Stopped" already reported
+    int queued;                 // on job_changed, waiting for job_notify
+    struct pipeline *pl;        // source while the line runs, see job_render
+    int chain;                  // pl is a whole && / || chain
+    char *text;
+    struct termios tmodes;      // terminal modes saved when it stopped
+    int have_tmodes;
+    struct job *next;           // job_changed / free list
+};
+
+struct job **job_table = NULL;
+int job_cap = 0, job_top = 0;   // job_top: highest id in use
+int job_current = 0;            // %+, the job fg/bg act on by default
+struct job *job_changed = NULL; // background jobs that finished or stopped
+struct job *job_free_list = NULL;
+struct proc *proc_free_list = NULL;
+struct proc *job_pids[JOB_PID_BUCKETS];
+int job_control = 0;
+pid_t shell_pgid = 0;
+struct termios shell_tmodes;
+int sigchld_pipe[2] = {-1, -1};
+volatile sig_atomic_t sigchld_pending = 0, sigint_pending = 0;
+
+/* ---------------- Trace ---------------- */
+/* set -o trace: every phase a command goes through is an event in a
+   fixed ring, stamped with CLOCK_MONOTONIC, and counted in a latency
+   histogram for its phase and command name. The latency is the time since
+   the line was read (since the prompt for PH_READ). Off, it costs the
+   trace_on test. */
+enum trace_phase { PH_READ, PH_PARSE, PH_FORK, PH_EXEC, PH_OUTPUT, PH_WAIT, PH_COUNT };
+
+struct trace_event {
+    uint64_t ts;                // CLOCK_MONOTONIC, ns
+    uint64_t latency;           // ns
+    int32_t pid;
+    uint16_t phase, name;       // name: index into trace_names, 0 is the line itself
+};
+
+struct trace_hist {
+    uint64_t count, sum, max;
+    uint32_t buckets[TRACE_BUCKETS];
+};
+
+int trace_on = 0;
+struct trace_event *trace_ring = NULL;
+uint64_t trace_next = 0;        // events ever recorded; the ring holds the last TRACE_RING
+struct trace_hist *trace_hists = NULL;     // [name][phase]
+char *trace_names[TRACE_NAMES];
+int trace_nnames = 0;
+uint64_t trace_line_start = 0;
+
+/* ---------------- Builtin output ---------------- */
+/* Builtins write through one of these instead of stdio, so they can run
+   on any fd from any thread without touching the shell's stdout. */
+struct outbuf {
+    int fd;
+    int failed;                 // write error (EPIPE etc.), drop the rest
+    int trace;                  // trace name while the first write is still to be traced, 0: none
+    size_t len;
+    char buf[4096];
+};
 
 /* ---------------- Function declarations ---------------- */
 void load_history();
-void save_history();
-void add_history(const char *line);
+void persist_history(const char *line);
+void compact_history();
+int add_history(const char *line);
+void history_sync();
+const char *history_entry(int i, size_t *len);
+int history_search(const char *pat, size_t plen, int before);
+int builtin_history(char **args, struct outbuf *out);
 
 void print_prompt();
+unsigned prompt_render();
+int prompt_wake_fd();
+void cwd_update();
 char *read_input();
-char **tokenize(char *line, const char *delim);
+char *edit_line(const char *prompt);
+void *arena_alloc(size_t n);
+char *arena_strndup(const char *s, size_t n);
+char *arena_strdup(const char *s);
+void arena_own(void *p);
+void arena_reset();
+int builtin_memstats(char **args, struct outbuf *out);
+struct cmd_list *parse_line(const char *text, size_t len);
+char *expand_word(const char *raw);
+char **expand_argv(struct command *cmd);
+char *command_subst(const char *text, size_t n, size_t *len);
+int var_name_char(char c, int first);
+int glob_meta(const char *s, size_t n);
+size_t glob_expand(const char *pat, char ***paths);
+void complete_prompt();
+size_t complete_word(const char *word, size_t n, int command, struct strbuf *common,
+                     struct strbuf *names, size_t limit);
+void complete_line(struct strbuf *line, size_t *pos, int tabs);
+int builtin_compgen(char **args, struct outbuf *out);
+const char *var_getn(const char *name, size_t n, size_t *vlen);
+size_t var_ref(const char *p, const char **val, size_t *vlen);
+const char *var_get(const char *name);
+void var_set(const char *name, const char *value, int export);
+void var_unset(const char *name);
+char **var_envp();
+size_t assignment_name(const char *word);
+int assignment_words(struct command *cmd);
+void var_assign(char **words, int n, int export, char **saved);
+void var_restore(char **saved, int n);
+size_t var_scope_begin();
+void var_scope_end(size_t mark);
+int builtin_export(char **args, struct outbuf *out);
+int builtin_unset(char **args);
+void ob_init(struct outbuf *ob, int fd);
+void ob_write(struct outbuf *ob, const char *s, size_t n);
+void ob_printf(struct outbuf *ob, const char *fmt, ...);
+void ob_flush(struct outbuf *ob);
+
+uint64_t trace_now();
+int trace_name(const char *cmd);
+void trace_event(int phase, int name, pid_t pid, uint64_t start);
+int builtin_stats(char **args, struct outbuf *out);
+
 int is_builtin(const char *cmd);
-int handle_builtin_parent(char **args);    // run builtin in parent (no fork)
-int handle_builtin_child(char **args);     // run builtin inside child (for pipelines)
-void free_tokens(char **tokens);
+int runs_as_builtin(char **args);
+int builtin_needs_child(const char *cmd);
+int run_builtin(char **args, int in_fd, int out_fd);   // in-process, any thread
+
+const char *hash_lookup(const char *name);
+void hash_forget(const char *name);
+void hash_clear();
+struct hash_entry;
+void hash_scope_begin(struct hash_entry **saved);
+void hash_scope_end(struct hash_entry **saved);
+int builtin_hash(char **args, struct outbuf *out);
+
+pid_t spawn_command(char **args, int in_fd, int out_fd, pid_t pgid);
+int run_stage(char **args, int in_fd, int out_fd);
+pid_t fork_builtin(char **args, int in_fd, int out_fd, pid_t pgid, const int *close_fds, int nclose, int tty);
+int copy_fd(int in_fd, int out_fd);
+int launcher_start();
+void launcher_stop();
+void launcher_collect();
+pid_t launch_command(char **args, int in_fd, int out_fd, pid_t pgid);
+long parse_size(const char *s);
+int builtin_set(char **args, struct outbuf *out);
+int builtin_cat(char **args, int in_fd, struct outbuf *out);
+int builtin_cp(char **args);
+
+void job_init();
+void job_child_setup(pid_t pgid);
+struct job *job_new(struct pipeline *pl, int chain, int background);
+void job_add_proc(struct job *j, pid_t pid);
+void job_launched(struct job *j);
+int job_wait(struct job *j, int foreground);
+void job_reap();
+void job_notify();
+int builtin_jobs(char **args, struct outbuf *out);
+int builtin_fg(char **args, struct outbuf *out);
+int builtin_bg(char **args, struct outbuf *out);
+int builtin_wait(char **args, struct outbuf *out);
+int builtin_parallel(char **args, int in_fd, struct outbuf *out);
 
 int execute_line(char *line);
-int execute_simple_command(char **args, int in_fd, int out_fd, int is_background);
-int execute_pipeline(char *line, int is_background);
+int execute_list(struct cmd_list *list);
+int execute_and_or(struct and_or *ao);
+int execute_simple_command(struct pipeline *pl, char **args, int in_fd, int out_fd, int is_background);
+int execute_pipeline(struct pipeline *pl, int is_background);
 
 void trim(char *s);
+void child_exit(int status);
+int main_loop();
+int run_command_string(const char *text);
+int run_script(const char *path);
 
 /* ---------------- Implementation ---------------- */
 
+/* The history file is an append-only log shared by every session: each
+   command is one O_APPEND write, so concurrent shells interleave their
+   records instead of overwriting each other's file. Loading the log
+   therefore merges what other sessions ran, in the order they ran it.
+   Loading is just an mmap; the ring is built lazily by history_sync(). */
 void load_history() {
-    FILE *f = fopen(HISTORY_FILE, "r");
-    if (!f) return;
-    char *line = NULL;
-    size_t n = 0;
-    while (getline(&line, &n, f) != -1) {
-        line[strcspn(line, "\n")] = 0;
-        if (history_count < MAX_HISTORY) history[history_count++] = strdup(line);
+    // remember an absolute path so a later cd does not move the file
+    if (HISTORY_FILE[0] != '/' && getcwd(history_path, sizeof(history_path) - sizeof(HISTORY_FILE) - 1)) {
+        strcat(history_path, "/" HISTORY_FILE);
+    } else {
+        snprintf(history_path, sizeof(history_path), "%s", HISTORY_FILE);
+    }
+
+    struct stat st;
+    int fd = open(history_path, O_RDONLY | O_CLOEXEC);
+    size_t size = (fd >= 0 && fstat(fd, &st) == 0) ? (size_t)st.st_size : 0;
+
+    hist_cap = size + HISTORY_RESERVE;
+    hist_buf = mmap(NULL, hist_cap, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (hist_buf == MAP_FAILED) { perror("history"); exit(EXIT_FAILURE); }
+    if (size > 0 && mmap(hist_buf, size, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_FIXED, fd, 0) != MAP_FAILED) {
+        hist_len = size;
+        // the tail of the last file page is private and writable
+        if (hist_buf[hist_len - 1] != '\n') hist_buf[hist_len++] = '\n';
+        char *nl = hist_len > 1 ? memrchr(hist_buf, '\n', hist_len - 1) : NULL;
+        hist_last_off = nl ? (size_t)(nl - hist_buf) + 1 : 0;
+        hist_last_len = hist_len - 1 - hist_last_off;
+        hist_have_last = 1;
     }
-    free(line);
-    fclose(f);
+    if (fd >= 0) close(fd);
 }
 
-void save_history() {
-    FILE *f = fopen(HISTORY_FILE, "w");
-    if (!f) return;
-    for (int i = 0; i < history_count; ++i) {
-        fprintf(f, "%s\n", history[i]);
+/* Append one record. The shared lock only excludes compact_history(), which
+   takes it exclusively; if a compaction renamed a new file into place while
+   we waited, reopen so the record is not written to the unlinked inode. */
+void persist_history(const char *line) {
+    if (!line || line[0] == '\0' || history_path[0] == '\0') return;
+    struct iovec rec[2] = {
+        { (void *)line, strlen(line) },
+        { "\n", 1 },
+    };
+
+    for (int attempt = 0; attempt < 3; ++attempt) {
+        int fd = open(history_path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+        if (fd < 0) break;
+        flock(fd, LOCK_SH);
+        struct stat fst, pst;
+        if (fstat(fd, &fst) == 0 && stat(history_path, &pst) == 0 &&
+            (fst.st_ino != pst.st_ino || fst.st_dev != pst.st_dev)) {
+            close(fd);
+            continue;
+        }
+        if (writev(fd, rec, 2) < 0) perror("history");
+        close(fd);
+        break;
+    }
+
+}
+
+static int history_compacting;     // a compact_thread() is running
+
+/* The compaction thread: map the log under an exclusive lock, find where
+   its newest MAX_HISTORY records start by walking back from the end, and
+   rename a copy of that tail into place. Plain I/O only, so it shares
+   nothing with the shell but the path. */
+static void *compact_thread(void *arg) {
+    (void)arg;
+    int fd = open(history_path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd >= 0 && flock(fd, LOCK_EX) == 0 && fstat(fd, &st) == 0 && st.st_size > 0) {
+        size_t size = (size_t)st.st_size;
+        char *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED) {
+            size_t start = size;
+            int found = 0;
+            while (start > 0 && found < MAX_HISTORY) {
+                char *nl = start > 1 ? memrchr(map, '\n', start - 1) : NULL;
+                size_t rec = nl ? (size_t)(nl - map) + 1 : 0;
+                if (start - 1 > rec) found++;
+                start = rec;
+            }
+            char tmp[sizeof(history_path) + 16];
+            snprintf(tmp, sizeof(tmp), "%s.%d", history_path, (int)getpid());
+            int out = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+            if (out >= 0) {
+                struct outbuf ob;
+                ob_init(&ob, out);
+                ob_write(&ob, map + start, size - start);
+                ob_flush(&ob);
+                if (close(out) != 0 || ob.failed || rename(tmp, history_path) != 0) unlink(tmp);
+            }
+            munmap(map, size);
+        }
     }
-    fclose(f);
+    if (fd >= 0) close(fd);
+    __atomic_store_n(&history_compacting, 0, __ATOMIC_RELEASE);
+    return NULL;
 }
 
-void add_history(const char *line) {
-    if (!line || line[0] == '\0') return;
-    if (history_count >= MAX_HISTORY) {
-        free(history[0]);
-        memmove(&history[0], &history[1], sizeof(char*) * (MAX_HISTORY - 1));
-        history_count--;
+/* Trim the log back to the last MAX_HISTORY records on a detached thread,
+   so the prompt never waits on it. One compaction at a time. */
+void compact_history() {
+    if (__atomic_exchange_n(&history_compacting, 1, __ATOMIC_ACQUIRE)) return;
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, compact_thread, NULL) != 0) {
+        __atomic_store_n(&history_compacting, 0, __ATOMIC_RELEASE);
+        return;
     }
-    history[history_count++] = strdup(line);
+    pthread_detach(tid);
 }
 
-/* Print prompt */
-void print_prompt() {
-    char cwd[1024];
-    if (getcwd(cwd, sizeof(cwd)) != NULL) {
-        printf("myshell:%s> ", cwd);
+/* ---------------- History search index ---------------- */
+
+static inline uint32_t tri_key(const char *p) {
+    return (((uint32_t)(unsigned char)p[0] << 16) |
+            ((uint32_t)(unsigned char)p[1] << 8) |
+            (uint32_t)(unsigned char)p[2]) + 1;
+}
+
+static struct tri_list *tri_find(uint32_t key, int create) {
+    if (!tri_table) {
+        if (!create) return NULL;
+        tri_size = 4096;
+        tri_table = calloc(tri_size, sizeof(struct tri_list));
+    }
+    size_t mask = tri_size - 1;
+    size_t h = (key * 2654435761u) & mask;
+    while (tri_table[h].key && tri_table[h].key != key) h = (h + 1) & mask;
+    if (tri_table[h].key || !create) return tri_table[h].key ? &tri_table[h] : NULL;
+
+    if ((tri_used + 1) * 10 > tri_size * 7) {
+        // grow and rehash, then retry the insert
+        struct tri_list *old = tri_table;
+        size_t old_size = tri_size;
+        tri_size *= 2;
+        tri_table = calloc(tri_size, sizeof(struct tri_list));
+        mask = tri_size - 1;
+        for (size_t k = 0; k < old_size; ++k) {
+            if (!old[k].key) continue;
+            size_t n = (old[k].key * 2654435761u) & mask;
+            while (tri_table[n].key) n = (n + 1) & mask;
+            tri_table[n] = old[k];
+        }
+        free(old);
+        return tri_find(key, create);
+    }
+    tri_used++;
+    tri_table[h].key = key;
+    return &tri_table[h];
+}
+
+static void tri_push(struct tri_list *l, uint32_t seq) {
+    // entries are indexed in order, so a repeat within one entry is the tail
+    if (l->len > l->start && l->seqs[l->len - 1] == seq) return;
+    // drop evicted entries once they make up half the list
+    while (l->start < l->len && l->seqs[l->start] < (uint32_t)history_evicted) l->start++;
+    if (l->start > 0 && l->start * 2 >= l->len) {
+        memmove(l->seqs, l->seqs + l->start, (l->len - l->start) * sizeof(uint32_t));
+        l->len -= l->start;
+        l->start = 0;
+    }
+    if (l->len == l->cap) {
+        l->cap = l->cap ? l->cap * 2 : 4;
+        l->seqs = realloc(l->seqs, l->cap * sizeof(uint32_t));
+    }
+    l->seqs[l->len++] = seq;
+}
+
+static void tri_add(unsigned long seq, const char *text, size_t len) {
+    for (size_t j = 0; j + 3 <= len; ++j)
+        tri_push(tri_find(tri_key(text + j), 1), (uint32_t)seq);
+}
+
+/* Newest entry with ring index < before whose text contains pat, or -1.
+   Patterns of three bytes or more go through the shortest posting list of
+   their trigrams; shorter ones match so often that a backward scan wins. */
+int history_search(const char *pat, size_t plen, int before) {
+    history_sync();
+    if (before > history_count) before = history_count;
+    if (plen == 0) return -1;
+
+    if (plen < 3) {
+        for (int i = before - 1; i >= 0; --i) {
+            size_t len;
+            const char *h = history_entry(i, &len);
+            if (memmem(h, len, pat, plen)) return i;
+        }
+        return -1;
+    }
+
+    if (!tri_ready) {
+        tri_ready = 1;
+        for (int i = 0; i < history_count; ++i) {
+            size_t len;
+            const char *h = history_entry(i, &len);
+            tri_add(history_evicted + i, h, len);
+        }
+    }
+
+    struct tri_list *best = NULL;
+    for (size_t j = 0; j + 3 <= plen; ++j) {
+        struct tri_list *l = tri_find(tri_key(pat + j), 0);
+        if (!l) return -1;
+        if (!best || l->len - l->start < best->len - best->start) best = l;
+    }
+
+    // last position in the list with seq < history_evicted + before
+    uint32_t limit = (uint32_t)(history_evicted + before);
+    uint32_t lo = best->start, hi = best->len;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (best->seqs[mid] < limit) lo = mid + 1; else hi = mid;
+    }
+    while (lo-- > best->start) {
+        uint32_t seq = best->seqs[lo];
+        if (seq < (uint32_t)history_evicted) break;
+        size_t len;
+        const char *h = history_entry(seq - history_evicted, &len);
+        if (memmem(h, len, pat, plen)) return seq - history_evicted;
+    }
+    return -1;
+}
+
+/* history          list every entry
+   history -s pat   list the entries containing pat */
+int builtin_history(char **args, struct outbuf *out) {
+    history_sync();
+    if (args[1] && strcmp(args[1], "-s") == 0) {
+        if (!args[2]) { fprintf(stderr, "history: -s: pattern required\n"); return 1; }
+        size_t plen = strlen(args[2]);
+        int n = 0;
+        int *hits = arena_alloc(history_count * sizeof(int));
+        for (int i = history_search(args[2], plen, history_count); i >= 0;
+             i = history_search(args[2], plen, i)) {
+            hits[n++] = i;
+        }
+        while (n-- > 0) {
+            size_t len;
+            const char *h = history_entry(hits[n], &len);
+            ob_printf(out, "%d %.*s\n", hits[n] + 1, (int)len, h);
+        }
+        return 0;
+    }
+    for (int i = 0; i < history_count; ++i) {
+        size_t len;
+        const char *h = history_entry(i, &len);
+        ob_printf(out, "%d %.*s\n", i+1, (int)len, h);
+    }
+    return 0;
+}
+
+/* Put the record at off into the ring, evicting the oldest entry when full */
+static void history_index(size_t off, size_t len) {
+    int slot;
+    if (history_count == MAX_HISTORY) {
+        slot = history_head;
+        hist_live_bytes -= history_ring[slot].len + 1;
+        history_head = (history_head + 1) % MAX_HISTORY;
+        history_evicted++;
     } else {
-        printf("myshell?> ");
+        slot = (history_head + history_count++) % MAX_HISTORY;
     }
-    fflush(stdout);
+    history_ring[slot].off = off;
+    history_ring[slot].len = len;
+    hist_live_bytes += len + 1;
+    if (tri_ready) tri_add(history_evicted + history_count - 1, hist_buf + off, len);
+}
+
+/* Copy the live records into a fresh reservation so the dead prefix left
+   by evicted entries is dropped. Offsets restart at 0. */
+static void history_repack(size_t extra) {
+    size_t cap = 2 * (hist_live_bytes + extra);
+    if (cap < HISTORY_RESERVE) cap = HISTORY_RESERVE;
+    char *nbuf = mmap(NULL, cap, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (nbuf == MAP_FAILED) { perror("history"); return; }
+    size_t len = 0;
+    for (int i = 0; i < history_count; ++i) {
+        struct hist_entry *e = &history_ring[(history_head + i) % MAX_HISTORY];
+        memcpy(nbuf + len, hist_buf + e->off, e->len + 1);
+        e->off = len;
+        len += e->len + 1;
+    }
+    if (hist_have_last && history_count > 0) {
+        hist_last_off = history_ring[(history_head + history_count - 1) % MAX_HISTORY].off;
+    }
+    munmap(hist_buf, hist_cap);
+    hist_buf = nbuf;
+    hist_cap = cap;
+    hist_len = len;
 }
 
-/* Read a line from stdin */
+/* Once evicted records outweigh live ones, trim the file in the background
+   and drop the same dead prefix from the buffer. Amortized O(1): it takes
+   at least another MAX_HISTORY insertions to get here again. */
+static void history_maybe_compact() {
+    if (history_count < MAX_HISTORY) return;
+    if (history_ring[history_head].off < hist_live_bytes) return;
+    compact_history();
+    history_repack(0);
+}
 
-char *read_input() {
-    static char buffer[MAX_INPUT_SIZE];
+/* Build the ring from the log on first use. Only the newest MAX_HISTORY
+   records are ever looked at, found by walking back from the end. */
+void history_sync() {
+    if (history_indexed) return;
+    history_indexed = 1;
+    size_t start = hist_len;
+    int found = 0;
+    while (start > 0 && found < MAX_HISTORY) {
+        char *nl = start > 1 ? memrchr(hist_buf, '\n', start - 1) : NULL;
+        size_t rec = nl ? (size_t)(nl - hist_buf) + 1 : 0;
+        if (start - 1 > rec) found++;
+        start = rec;
+    }
+    while (start < hist_len) {
+        char *nl = memchr(hist_buf + start, '\n', hist_len - start);
+        size_t len = (size_t)(nl - (hist_buf + start));
+        if (len > 0) history_index(start, len);
+        start += len + 1;
+    }
+    history_maybe_compact();
+}
 
-    printf("myshell> ");
-    if (fgets(buffer, MAX_INPUT_SIZE, stdin) == NULL) {
-        printf("\n");
-        return NULL;
+/* Entry i (0 = oldest); the text is not NUL-terminated */
+const char *history_entry(int i, size_t *len) {
+    struct hist_entry *e = &history_ring[(history_head + i) % MAX_HISTORY];
+    *len = e->len;
+    return hist_buf + e->off;
+}
+
+/* Append a command to the log; O(1). Returns 0 if it was skipped as empty
+   or as a repeat of the previous command. */
+int add_history(const char *line) {
+    if (!line || line[0] == '\0' || !hist_buf) return 0;
+    size_t len = strlen(line);
+    if (hist_have_last && hist_last_len == len &&
+        memcmp(hist_buf + hist_last_off, line, len) == 0) return 0;
+
+    if (hist_len + len + 1 > hist_cap) {
+        history_sync();
+        history_repack(len + 1);
     }
+    memcpy(hist_buf + hist_len, line, len);
+    hist_buf[hist_len + len] = '\n';
+    hist_last_off = hist_len;
+    hist_last_len = len;
+    hist_have_last = 1;
+    hist_len += len + 1;
+
+    if (history_indexed) {
+        history_index(hist_last_off, len);
+        history_maybe_compact();
+    }
+    return 1;
+}
+
+/* Read a line from stdin; terminals get the line editor */
+
+char *read_input() {
+    static char *buffer = NULL;
+    static size_t cap = 0;
+
+    if (interactive) return edit_line(prompt_buf);
+
+    // the buffer keeps the size of the longest line read so far
+    ssize_t n = getline(&buffer, &cap, script_in ? script_in : stdin);
+    if (n < 0) return NULL;
 
     // Remove trailing newline, if present
-    buffer[strcspn(buffer, "\n")] = '\0';
+    if (n > 0 && buffer[n - 1] == '\n') buffer[n - 1] = '\0';
     return buffer;
 }
 
+/* ---------------- Line editor ---------------- */
+
+/* Minimal raw-mode editor: cursor movement, history recall with the
+   arrow keys, Ctrl-R reverse incremental search and Tab completion. The terminal is only
+   raw while a line is being read, so children always see cooked mode. */
+
+#define CTRL_KEY(c) ((c) & 0x1f)
+
+static char *sb_room(struct strbuf *sb, size_t n);
+static void sb_add(struct strbuf *sb, const char *s, size_t n);
+
+static void editor_puts(const char *s, size_t n) {
+    while (n > 0) {
+        ssize_t w = write(STDOUT_FILENO, s, n);
+        if (w <= 0) return;
+        s += w; n -= w;
+    }
+}
+
+static void editor_refresh(const char *prompt, const char *buf, size_t len, size_t pos) {
+    char seq[32];
+    editor_puts("\r", 1);
+    editor_puts(prompt, strlen(prompt));
+    editor_puts(buf, len);
+    editor_puts("\x1b[K", 3);
+    if (len > pos) editor_puts(seq, snprintf(seq, sizeof(seq), "\x1b[%zuD", len - pos));
+}
+
+/* Wait for a key; returns 0 instead if wake_fd (-1 for none) becomes
+   readable first. Background jobs that end while we sit here are reaped
+   right away; they are reported at the next prompt. */
+static int editor_wait(int wake_fd) {
+    struct pollfd pfd[3] = { { STDIN_FILENO, POLLIN, 0 }, { sigchld_pipe[0], POLLIN, 0 },
+                             { wake_fd, POLLIN, 0 } };
+    while (poll(pfd, 3, -1) < 0 || !pfd[0].revents) {
+        if (pfd[1].revents) { sigchld_pending = 1; job_reap(); }
+        if (pfd[2].revents) return 0;
+    }
+    return 1;
+}
+
+static int editor_getc() {
+    unsigned char c;
+    ssize_t r;
+    editor_wait(-1);
+    do r = read(STDIN_FILENO, &c, 1); while (r < 0 && errno == EINTR);
+    return r == 1 ? c : -1;
+}
+
+/* Ctrl-R mode. Returns the key that ended the search (Enter, or an editing
+   key to fall through to) and leaves the accepted entry in line; Ctrl-G
+   and Ctrl-C put the original line back and return 0. */
+static int editor_search(struct strbuf *line, size_t *pos) {
+    char pat[256];
+    size_t plen = 0;
+    int match = -1;
+    size_t saved_len = line->len;
+    char *saved = malloc(saved_len + 1);
+    if (!saved) { perror("malloc"); exit(EXIT_FAILURE); }
+    memcpy(saved, line->s, saved_len);
+
+    while (1) {
+        char prompt[320];
+        snprintf(prompt, sizeof(prompt), "(reverse-i-search)`%.*s': ", (int)plen, pat);
+        editor_refresh(prompt, line->s, line->len, *pos);
+
+        int c = editor_getc();
+        if (c == CTRL_KEY('r')) {
+            // next older match for the same pattern
+            int m = history_search(pat, plen, match >= 0 ? match : history_count);
+            if (m >= 0) match = m;
+        } else if (c == 127 || c == CTRL_KEY('h')) {
+            if (plen > 0) plen--;
+            match = history_search(pat, plen, history_count);
+        } else if (c == CTRL_KEY('g') || c == CTRL_KEY('c')) {
+            line->len = 0;
+            sb_add(line, saved, saved_len);
+            *pos = saved_len;
+            free(saved);
+            return 0;
+        } else if (c >= 32 && c < 127) {
+            if (plen < sizeof(pat)) pat[plen++] = c;
+            int m = history_search(pat, plen, match >= 0 ? match + 1 : history_count);
+            match = m;
+        } else {
+            free(saved);
+            return c;
+        }
+
+        if (match >= 0) {
+            size_t hlen;
+            const char *h = history_entry(match, &hlen);
+            line->len = 0;
+            sb_add(line, h, hlen);
+            const char *at = memmem(h, hlen, pat, plen);
+            *pos = at ? (size_t)(at - h) : hlen;
+        } else if (plen == 0) {
+            line->len = *pos = 0;
+        }
+    }
+}
+
+/* Up/Down: replace the line with the previous/next history entry */
+static void editor_history_move(struct strbuf *line, size_t *pos, int *nav, int dir) {
+    int next = *nav + dir;
+    if (next < 0 || next > history_count) return;
+    *nav = next;
+    line->len = *pos = 0;
+    if (next == history_count) return;
+    size_t hlen;
+    const char *h = history_entry(next, &hlen);
+    sb_add(line, h, hlen);
+    *pos = hlen;
+}
+
+/* Read one line in raw mode. Returns a static buffer that grows with the
+   line, or NULL on EOF. */
+char *edit_line(const char *prompt) {
+    static struct strbuf line = { NULL, 0, 0 };
+    struct termios orig, raw;
+    if (tcgetattr(STDIN_FILENO, &orig) < 0) return NULL;
+    raw = orig;
+    raw.c_iflag &= ~(ICRNL | IXON | BRKINT | ISTRIP | INPCK);
+    raw.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);
+    raw.c_cc[VMIN] = 1;
+    raw.c_cc[VTIME] = 0;
+    tcsetattr(STDIN_FILENO, TCSADRAIN, &raw);
+
+    history_sync();
+    size_t pos = 0;
+    int nav = history_count;            // history entry shown by Up/Down
+    int tabs = 0;                       // Tabs in a row
+    int eof = 0;
+    line.len = 0;
+    sb_room(&line, 0);
+
+    editor_refresh(prompt, line.s, line.len, pos);
+    complete_prompt();
+    while (1) {
+        if (!editor_wait(prompt == prompt_buf ? prompt_wake_fd() : -1)) {
+            // a slow prompt segment came in
+            prompt_render();
+            editor_refresh(prompt, line.s, line.len, pos);
+            continue;
+        }
+        int c = editor_getc();
+        tabs = c == '\t' ? tabs + 1 : 0;
+        if (c == CTRL_KEY('r')) {
+            c = editor_search(&line, &pos);
+            editor_refresh(prompt, line.s, line.len, pos);
+            if (c == 0) continue;
+        }
+
+        char *buf = line.s;
+        size_t len = line.len;
+        if (c == '\r' || c == '\n') {
+            break;
+        } else if (c == -1 || (c == CTRL_KEY('d') && len == 0)) {
+            eof = 1;
+            break;
+        } else if (c == CTRL_KEY('c')) {
+            line.len = pos = 0;
+            editor_puts("^C\r\n", 4);
+        } else if (c == 127 || c == CTRL_KEY('h')) {
+            if (pos > 0) {
+                memmove(buf + pos - 1, buf + pos, len - pos);
+                pos--; line.len--;
+            }
+        } else if (c == CTRL_KEY('d')) {
+            if (pos < len) { memmove(buf + pos, buf + pos + 1, len - pos - 1); line.len--; }
+        } else if (c == CTRL_KEY('a')) {
+            pos = 0;
+        } else if (c == CTRL_KEY('e')) {
+            pos = len;
+        } else if (c == CTRL_KEY('u')) {
+            memmove(buf, buf + pos, len - pos);
+            line.len -= pos; pos = 0;
+        } else if (c == CTRL_KEY('k')) {
+            line.len = pos;
+        } else if (c == CTRL_KEY('b')) {
+            if (pos > 0) pos--;
+        } else if (c == CTRL_KEY('f')) {
+            if (pos < len) pos++;
+        } else if (c == '\t') {
+            complete_line(&line, &pos, tabs);
+        } else if (c == CTRL_KEY('p') || c == CTRL_KEY('n')) {
+            editor_history_move(&line, &pos, &nav, c == CTRL_KEY('p') ? -1 : 1);
+        } else if (c == 27) {
+            if (editor_getc() != '[') continue;
+            c = editor_getc();
+            if (c >= '0' && c <= '9') {
+                // ESC [ n ~ : only Delete (3) is handled
+                if (editor_getc() == '~' && c == '3' && pos < len) {
+                    memmove(buf + pos, buf + pos + 1, len - pos - 1); line.len--;
+                }
+            } else if (c == 'A' || c == 'B') {
+                editor_history_move(&line, &pos, &nav, c == 'A' ? -1 : 1);
+            } else if (c == 'C') {
+                if (pos < len) pos++;
+            } else if (c == 'D') {
+                if (pos > 0) pos--;
+            } else if (c == 'H') {
+                pos = 0;
+            } else if (c == 'F') {
+                pos = len;
+            }
+        } else if (c >= 32) {
+            sb_room(&line, 1);
+            buf = line.s;
+            memmove(buf + pos + 1, buf + pos, len - pos);
+            buf[pos++] = c;
+            line.len++;
+        }
+        editor_refresh(prompt, line.s, line.len, pos);
+    }
+
+    line.s[line.len] = '\0';
+    editor_puts("\r\n", 2);
+    tcsetattr(STDIN_FILENO, TCSADRAIN, &orig);
+    return eof ? NULL : line.s;
+}
+
+/* ---------------- Line arena ---------------- */
+
+void *arena_alloc(size_t n) {
+    n = (n + 15) & ~(size_t)15;
+    // first chunk with room; reset() rewinds to the head of the list
+    while (arena_cur && arena_cur->used + n > arena_cur->size) arena_cur = arena_cur->next;
+    if (!arena_cur) {
+        size_t size = n > ARENA_CHUNK ? n : ARENA_CHUNK;
+        struct arena_chunk *c = malloc(sizeof(*c) + size);
+        if (!c) { perror("malloc"); exit(EXIT_FAILURE); }
+        c->size = size;
+        c->used = 0;
+        c->next = NULL;
+        // append, so chunks stay in the order reset() walks them
+        struct arena_chunk **pp = &arena_head;
+        while (*pp) pp = &(*pp)->next;
+        *pp = c;
+        arena_cur = c;
+        arena_chunks++;
+        arena_reserved += size;
+    }
+    void *p = arena_cur->data + arena_cur->used;
+    arena_cur->used += n;
+    arena_line_bytes += n;
+    return p;
+}
+
+char *arena_strndup(const char *s, size_t n) {
+    char *p = arena_alloc(n + 1);
+    memcpy(p, s, n);
+    p[n] = '\0';
+    return p;
+}
+
+char *arena_strdup(const char *s) {
+    return arena_strndup(s, strlen(s));
+}
+
+/* Free p, a malloc'd block, together with the line */
+void arena_own(void *p) {
+    struct arena_block *b = arena_alloc(sizeof(*b));
+    b->p = p;
+    b->next = arena_blocks;
+    arena_blocks = b;
+}
+
+/* Release everything allocated for the current line */
+void arena_reset() {
+    for (struct arena_block *b = arena_blocks; b; b = b->next) free(b->p);
+    arena_blocks = NULL;
+    // chunks past arena_cur have not been touched since the last reset
+    for (struct arena_chunk *c = arena_head; c; c = c->next) {
+        c->used = 0;
+        if (c == arena_cur) break;
+    }
+    arena_cur = arena_head;
+    arena_last_bytes = arena_line_bytes;
+    if (arena_line_bytes > arena_peak_bytes) arena_peak_bytes = arena_line_bytes;
+    arena_line_bytes = 0;
+    arena_lines++;
+}
+
+/* Room for n more bytes and a NUL; returns where they go */
+static char *sb_room(struct strbuf *sb, size_t n) {
+    if (sb->len + n + 1 > sb->cap) {
+        while (sb->len + n + 1 > sb->cap) sb->cap = sb->cap ? sb->cap * 2 : 256;
+        sb->s = realloc(sb->s, sb->cap);
+        if (!sb->s) { perror("malloc"); exit(EXIT_FAILURE); }
+    }
+    return sb->s + sb->len;
+}
+
+static void sb_add(struct strbuf *sb, const char *s, size_t n) {
+    memcpy(sb_room(sb, n), s, n);
+    sb->len += n;
+    sb->s[sb->len] = '\0';
+}
+
+int builtin_memstats(char **args, struct outbuf *out) {
+    (void)args;
+    ob_printf(out, "lines run:        %lu\n", arena_lines);
+    ob_printf(out, "arena chunks:     %lu (%zu bytes reserved)\n", arena_chunks, arena_reserved);
+    ob_printf(out, "arena last line:  %zu bytes\n", arena_last_bytes);
+    ob_printf(out, "arena peak line:  %zu bytes\n", arena_peak_bytes);
+#ifdef MYSHELL_COUNT_MALLOC
+    ob_printf(out, "malloc last line: %lu calls\n", line_malloc_calls);
+    ob_printf(out, "malloc total:     %lu calls\n", malloc_calls);
+#else
+    ob_printf(out, "malloc counting:  off (build with -DMYSHELL_COUNT_MALLOC)\n");
+#endif
+    return 0;
+}
+
 /* Trim leading/trailing spaces */
 void trim(char *s) {
     // leading
@@ -112,151 +1112,4499 @@ void trim(char *s) {
     while (L > 0 && (s[L - 1] == ' ' || s[L - 1] == '\t')) s[--L] = 0;
 }
 
-/* Tokenize a string (destructive to line) */
-char **tokenize(char *line, const char *delim) {
-    char **tokens = calloc(MAX_TOKENS, sizeof(char*));
-    char *tok;
-    int pos = 0;
-    tok = strtok(line, delim);
-    while (tok != NULL && pos < MAX_TOKENS - 1) {
-        tokens[pos++] = strdup(tok);
-        tok = strtok(NULL, delim);
+/* ---------------- Lexer and parser ---------------- */
+
+enum tok_type {
+    T_WORD, T_PIPE, T_OR, T_AMP, T_AND, T_SEMI, T_NEWLINE,
+    T_LESS, T_GREAT, T_DGREAT, T_DLESS, T_DLESSDASH, T_TLESS, T_END, T_ERROR
+};
+
+struct lexer {
+    const char *p, *end;
+    int type;                   // current token
+    const char *start;          // its text
+    size_t len;
+    const char *error;          // what is wrong with a T_ERROR word
+    struct redirect *here;      // here-documents whose body follows the next newline
+};
+
+/* Set while a script is compiled ahead of running it (see run_script()):
+   a line the parser complains about is kept as text and parsed again
+   when its turn comes, so the message appears where it always did. */
+static int parse_quiet = 0;
+static int parse_complaints = 0;
+
+static int is_meta(char c) {
+    return c == '|' || c == '&' || c == ';' || c == '<' || c == '>' ||
+           c == ' ' || c == '\t' || c == '\n';
+}
+
+static const char *skip_subst(const char *p, const char *end);
+
+/* p at '`': just past the closing backquote, NULL if there is none */
+static const char *skip_backquote(const char *p, const char *end) {
+    for (p++; p < end; ++p) {
+        if (*p == '\\') p++;
+        else if (*p == '`') return p + 1;
+    }
+    return NULL;
+}
+
+/* p at '"': just past the closing quote, NULL if there is none. A
+   substitution inside may hold quotes of its own. */
+static const char *skip_dquote(const char *p, const char *end) {
+    for (p++; p && p < end; ) {
+        if (*p == '"') return p + 1;
+        if (*p == '\\') p += 2;
+        else if (*p == '$' && p + 1 < end && p[1] == '(') p = skip_subst(p, end);
+        else if (*p == '`') p = skip_backquote(p, end);
+        else p++;
+    }
+    return NULL;
+}
+
+/* p at "$(": just past the matching ')', NULL if there is none. Quotes,
+   backslashes and parentheses inside are balanced as the lexer would. */
+static const char *skip_subst(const char *p, const char *end) {
+    int depth = 0;
+    for (p++; p && p < end; ) {
+        if (*p == '\\') {
+            p += 2;
+        } else if (*p == '\'') {
+            p = memchr(p + 1, '\'', end - p - 1);
+            if (p) p++;
+        } else if (*p == '"') {
+            p = skip_dquote(p, end);
+        } else if (*p == '`') {
+            p = skip_backquote(p, end);
+        } else {
+            if (*p == '(') depth++;
+            else if (*p == ')' && --depth == 0) return p + 1;
+            p++;
+        }
+    }
+    return NULL;
+}
+
+/* A here-document delimiter with its quotes removed into out, which has
+   room for raw; returns whether there were any, which turns expansion of
+   the body off */
+static int here_delim(const char *raw, char *out) {
+    int quoted = 0;
+    char q = 0;
+    for (const char *p = raw; *p; ++p) {
+        if (q ? *p == q : *p == '\'' || *p == '"') {
+            q = q ? 0 : *p;
+            quoted = 1;
+            continue;
+        }
+        if (!q && *p == '\\' && p[1]) {
+            p++;
+            quoted = 1;
+        }
+        *out++ = *p;
+    }
+    *out = '\0';
+    return quoted;
+}
+
+/* Where the line holding just delim starts in p..end, p starting a
+   line: NULL if there is none. What is searched for is the delimiter's
+   first character, rare in most bodies, not the newline that starts
+   every line. */
+static const char *find_delim_line(const char *p, const char *end, const char *delim, size_t dlen) {
+    if (!dlen) {
+        // an empty delimiter: the first empty line
+        if (p >= end) return NULL;
+        if (*p == '\n') return p;
+        const char *q = memmem(p, end - p, "\n\n", 2);
+        if (q) return q + 1;
+        return end > p && end[-1] == '\n' ? end : NULL;
+    }
+    for (const char *q = p; (q = memchr(q, delim[0], end - q)); ++q) {
+        if ((q == p || q[-1] == '\n') && (size_t)(end - q) >= dlen && memcmp(q, delim, dlen) == 0 &&
+            (q + dlen == end || q[dlen] == '\n'))
+            return q;
+    }
+    return NULL;
+}
+
+/* p just past a newline, or at the end: the bodies of the here-documents
+   waiting for it come next, each up to a line holding just its
+   delimiter. The bodies are left where they are in the text. Returns
+   where the line after the last one starts. */
+static const char *lex_heredocs(struct lexer *lx, const char *p) {
+    for (struct redirect *r = lx->here; r; r = r->here_next) {
+        size_t dlen = strlen(r->target);
+        const char *body = p;
+        int found = 0;
+        if (!(r->here & HERE_STRIP)) {
+            // one search for the delimiter instead of a look at every line
+            const char *line = find_delim_line(p, lx->end, r->target, dlen);
+            found = line != NULL;
+            if (!line) line = lx->end;
+            r->blen = line - body;
+            p = line + (found ? dlen : 0);
+            if (p < lx->end) p++;
+        }
+        while (p < lx->end && !found) {
+            const char *eol = memchr(p, '\n', lx->end - p);
+            if (!eol) eol = lx->end;
+            const char *s = p;
+            if (r->here & HERE_STRIP) while (s < eol && *s == '\t') s++;
+            found = (size_t)(eol - s) == dlen && memcmp(s, r->target, dlen) == 0;
+            if (!found) r->blen = eol - body + (eol < lx->end);
+            p = eol < lx->end ? eol + 1 : eol;
+        }
+        r->body = body;
+        if (found) continue;
+        if (parse_quiet) parse_complaints++;
+        else fprintf(stderr, "myshell: warning: here-document ended by end of input (wanted `%s')\n", r->target);
+    }
+    lx->here = NULL;
+    return p;
+}
+
+/* Advance to the next token. Words are delimited honouring quotes and
+   backslashes but kept raw; quote removal happens in expand_word(). */
+static void lex_next(struct lexer *lx) {
+    const char *p = lx->p, *end = lx->end;
+    while (p < end && (*p == ' ' || *p == '\t' || (*p == '\\' && p + 1 < end && p[1] == '\n'))) {
+        p += (*p == '\\') ? 2 : 1;
+    }
+    if (p < end && *p == '#') {
+        while (p < end && *p != '\n') p++;
+    }
+    if (p >= end && lx->here) p = lex_heredocs(lx, p);
+    lx->start = p;
+    if (p >= end) { lx->type = T_END; lx->len = 0; lx->p = p; return; }
+
+    char c = *p;
+    int two = (p + 1 < end && p[1] == c);
+    switch (c) {
+    case '\n':
+        lx->type = T_NEWLINE;
+        p++;
+        if (lx->here) p = lex_heredocs(lx, p);
+        break;
+    case ';':  lx->type = T_SEMI; p++; break;
+    case '|':  lx->type = two ? T_OR : T_PIPE; p += two ? 2 : 1; break;
+    case '&':  lx->type = two ? T_AND : T_AMP; p += two ? 2 : 1; break;
+    case '<':
+        // <, <<, <<- and <<<
+        lx->type = !two ? T_LESS : p + 2 >= end ? T_DLESS : p[2] == '<' ? T_TLESS :
+                   p[2] == '-' ? T_DLESSDASH : T_DLESS;
+        p += lx->type == T_LESS ? 1 : lx->type == T_DLESS ? 2 : 3;
+        break;
+    case '>':  lx->type = two ? T_DGREAT : T_GREAT; p += two ? 2 : 1; break;
+    default:
+        lx->type = T_WORD;
+        while (p < end && !is_meta(*p)) {
+            if (*p == '\\') {
+                p += (p + 1 < end) ? 2 : 1;
+            } else if (*p == '\'') {
+                const char *q = memchr(p + 1, '\'', end - p - 1);
+                if (!q) { lx->type = T_ERROR; lx->error = "unterminated quote"; p = end; break; }
+                p = q + 1;
+            } else if (*p == '"' || *p == '`' || (*p == '$' && p + 1 < end && p[1] == '(')) {
+                const char *q = *p == '"' ? skip_dquote(p, end) :
+                                *p == '`' ? skip_backquote(p, end) : skip_subst(p, end);
+                if (!q) {
+                    lx->type = T_ERROR;
+                    lx->error = *p == '"' ? "unterminated quote" : "unterminated command substitution";
+                    p = end;
+                    break;
+                }
+                p = q;
+            } else {
+                p++;
+            }
+        }
+    }
+    lx->len = p - lx->start;
+    lx->p = p;
+}
+
+static void syntax_error(struct lexer *lx) {
+    if (parse_quiet) {
+        parse_complaints++;
+        return;
+    }
+    if (lx->type == T_ERROR)
+        fprintf(stderr, "myshell: syntax error: %s\n", lx->error);
+    else if (lx->type == T_END || lx->type == T_NEWLINE)
+        fprintf(stderr, "myshell: syntax error: unexpected end of line\n");
+    else
+        fprintf(stderr, "myshell: syntax error near unexpected token `%.*s'\n", (int)lx->len, lx->start);
+}
+
+static void skip_newlines(struct lexer *lx) {
+    while (lx->type == T_NEWLINE) lex_next(lx);
+}
+
+/* command := (WORD | redirect)+ ; returns 0 on success. The words go in
+   a vector that doubles in the arena, one slot ahead for the NULL. */
+static int parse_command(struct lexer *lx, struct command *cmd) {
+    char *small[16];
+    char **words = small;
+    int argc = 0, cap = 16;
+    struct redirect **rtail = &cmd->redirs;
+    cmd->redirs = NULL;
+
+    while (1) {
+        if (lx->type == T_WORD) {
+            if (argc + 1 >= cap) {
+                char **v = arena_alloc(2 * cap * sizeof(char*));
+                memcpy(v, words, argc * sizeof(char*));
+                words = v;
+                cap *= 2;
+            }
+            words[argc++] = arena_strndup(lx->start, lx->len);
+            lex_next(lx);
+        } else if (lx->type == T_LESS || lx->type == T_GREAT || lx->type == T_DGREAT) {
+            struct redirect *r = arena_alloc(sizeof(*r));
+            r->type = lx->type == T_LESS ? REDIR_IN : lx->type == T_GREAT ? REDIR_OUT : REDIR_APPEND;
+            lex_next(lx);
+            if (lx->type != T_WORD) { syntax_error(lx); return -1; }
+            r->target = arena_strndup(lx->start, lx->len);
+            r->body = NULL;
+            r->blen = 0;
+            r->here = 0;
+            r->next = r->here_next = NULL;
+            *rtail = r;
+            rtail = &r->next;
+            lex_next(lx);
+        } else if (lx->type == T_DLESS || lx->type == T_DLESSDASH || lx->type == T_TLESS) {
+            struct redirect *r = arena_alloc(sizeof(*r));
+            int op = lx->type;
+            lex_next(lx);
+            if (lx->type != T_WORD) { syntax_error(lx); return -1; }
+            r->type = op == T_TLESS ? REDIR_HERESTRING : REDIR_HEREDOC;
+            r->target = arena_strndup(lx->start, lx->len);
+            r->body = NULL;
+            r->blen = 0;
+            r->here = op == T_DLESSDASH ? HERE_STRIP : 0;
+            r->next = r->here_next = NULL;
+            if (op != T_TLESS) {
+                if (here_delim(r->target, r->target)) r->here |= HERE_QUOTED;
+                // queued before the lexer can reach the newline it waits for
+                struct redirect **pp = &lx->here;
+                while (*pp) pp = &(*pp)->here_next;
+                *pp = r;
+            }
+            *rtail = r;
+            rtail = &r->next;
+            lex_next(lx);
+        } else {
+            break;
+        }
+    }
+    if (argc == 0 && !cmd->redirs) { syntax_error(lx); return -1; }
+
+    cmd->argc = argc;
+    if (words == small) {
+        words = arena_alloc((argc + 1) * sizeof(char*));
+        memcpy(words, small, argc * sizeof(char*));
+    }
+    cmd->argv = words;
+    cmd->argv[argc] = NULL;
+    return 0;
+}
+
+/* pipeline := command ('|' linebreak command)* ; stages grow like words */
+static struct pipeline *parse_pipeline(struct lexer *lx) {
+    struct command small[8];
+    struct command *cmds = small;
+    int n = 0, cap = 8;
+    while (1) {
+        if (n == cap) {
+            struct command *v = arena_alloc(2 * cap * sizeof(struct command));
+            memcpy(v, cmds, n * sizeof(struct command));
+            cmds = v;
+            cap *= 2;
+        }
+        if (parse_command(lx, &cmds[n++]) < 0) return NULL;
+        if (lx->type != T_PIPE) break;
+        lex_next(lx);
+        skip_newlines(lx);
+    }
+    struct pipeline *pl = arena_alloc(sizeof(*pl));
+    pl->ncmds = n;
+    if (cmds == small) {
+        cmds = arena_alloc(n * sizeof(struct command));
+        memcpy(cmds, small, n * sizeof(struct command));
+    }
+    pl->cmds = cmds;
+    pl->connector = CONN_END;
+    pl->next = NULL;
+    return pl;
+}
+
+/* and_or := pipeline (('&&' | '||') linebreak pipeline)* */
+static struct and_or *parse_and_or(struct lexer *lx) {
+    struct and_or *ao = arena_alloc(sizeof(*ao));
+    ao->background = 0;
+    ao->next = NULL;
+    ao->first = parse_pipeline(lx);
+    if (!ao->first) return NULL;
+    struct pipeline *last = ao->first;
+    while (lx->type == T_AND || lx->type == T_OR) {
+        last->connector = lx->type == T_AND ? CONN_AND : CONN_OR;
+        lex_next(lx);
+        skip_newlines(lx);
+        last->next = parse_pipeline(lx);
+        if (!last->next) return NULL;
+        last = last->next;
+    }
+    return ao;
+}
+
+/* list := and_or ((';' | '&' | newline) and_or?)*
+   Parses the whole text; returns NULL after reporting a syntax error. */
+struct cmd_list *parse_line(const char *text, size_t len) {
+    struct lexer lx = { text, text + len, T_END, text, 0, NULL, NULL };
+    struct cmd_list *list = arena_alloc(sizeof(*list));
+    struct and_or **tail = &list->first;
+    list->first = NULL;
+
+    lex_next(&lx);
+    skip_newlines(&lx);
+    while (lx.type != T_END) {
+        struct and_or *ao = parse_and_or(&lx);
+        if (!ao) return NULL;
+        *tail = ao;
+        tail = &ao->next;
+        if (lx.type == T_AMP) {
+            ao->background = 1;
+        } else if (lx.type != T_SEMI && lx.type != T_NEWLINE) {
+            if (lx.type == T_END) break;
+            syntax_error(&lx);
+            return NULL;
+        }
+        lex_next(&lx);
+        skip_newlines(&lx);
+    }
+    return list;
+}
+
+/* The delimiters of the here-documents text opens into out, each led by
+   '-' for <<- or a blank for << and NUL-terminated. Returns how many. */
+static int here_delims(const char *text, size_t len, struct strbuf *out) {
+    struct lexer lx = { text, text + len, T_END, text, 0, NULL, NULL };
+    int n = 0;
+    for (lex_next(&lx); lx.type != T_END && lx.type != T_ERROR; lex_next(&lx)) {
+        if (lx.type != T_DLESS && lx.type != T_DLESSDASH) continue;
+        int strip = lx.type == T_DLESSDASH;
+        lex_next(&lx);
+        if (lx.type != T_WORD) break;
+        char *delim = arena_strndup(lx.start, lx.len);
+        here_delim(delim, delim);
+        sb_add(out, strip ? "-" : " ", 1);
+        sb_add(out, delim, strlen(delim) + 1);
+        n++;
+    }
+    return n;
+}
+
+/* Room expand_param() may need for the parameter at p */
+static size_t param_room(const char *p) {
+    const char *val;
+    size_t vlen = 0, room = 4 * pipestatus_n + 4;
+    var_ref(p, &val, &vlen);
+    return vlen > room ? vlen : room;
+}
+
+/* The parameters: $?, PIPESTATUS and shell variables. $PIPESTATUS and
+   ${PIPESTATUS[n]} are one stage's status, ${PIPESTATUS[@]} (or [*]) all
+   of them. Writes the value at *o and returns how many characters of p it
+   used; 0 if p is no parameter, and the '$' stays as it is. */
+static size_t expand_param(const char *p, char **o) {
+    if (p[1] == '?') {
+        *o += sprintf(*o, "%d", last_status);
+        return 2;
+    }
+    if (strncmp(p + 1, "PIPESTATUS", 10) == 0 && !isalnum((unsigned char)p[11]) && p[11] != '_') {
+        if (pipestatus_n > 0) *o += sprintf(*o, "%d", pipestatus[0]);
+        return 11;
+    }
+    if (strncmp(p + 1, "{PIPESTATUS[", 12) != 0) {
+        const char *val;
+        size_t vlen, k = var_ref(p, &val, &vlen);
+        if (val) {
+            memcpy(*o, val, vlen);
+            *o += vlen;
+        }
+        return k;
+    }
+    const char *q = p + 13;
+    if ((*q == '@' || *q == '*') && strncmp(q + 1, "]}", 2) == 0) {
+        for (int i = 0; i < pipestatus_n; ++i)
+            *o += sprintf(*o, i ? " %d" : "%d", pipestatus[i]);
+        return q + 3 - p;
+    }
+    char *end;
+    long i = strtol(q, &end, 10);
+    if (end == q || strncmp(end, "]}", 2) != 0) return 0;
+    if (i >= 0 && i < pipestatus_n) *o += sprintf(*o, "%d", pipestatus[i]);
+    return end + 2 - p;
+}
+
+/* Words with a command substitution expand through a struct fields: the
+   output can be any size and, unquoted, splits into any number of words. */
+static int has_subst(const char *raw) {
+    return strchr(raw, '`') || strstr(raw, "$(");
+}
+
+/* Whether an unquoted $NAME in raw is empty or has blanks in its value:
+   then the word splits (or goes away) like a substitution's output. */
+static int var_splits(const char *raw) {
+    int dq = 0;
+    for (const char *p = strchr(raw, '$') ? raw : ""; *p; ++p) {
+        if (*p == '\\' && p[1]) {
+            p++;
+        } else if (*p == '\'' && !dq) {
+            p = strchr(p + 1, '\'');
+            if (!p) return 0;
+        } else if (*p == '"') {
+            dq = !dq;
+        } else if (*p == '$' && !dq) {
+            const char *val;
+            size_t vlen;
+            if (var_ref(p, &val, &vlen) && (!vlen || strpbrk(val, " \t\n"))) return 1;
+        }
+    }
+    return 0;
+}
+
+/* The fields the words of a command expand to. cur is the one being
+   built; open says it is a field even while empty (after "" or ''). For
+   a word with a glob in it, cur is a pattern: quoted text goes in with
+   its *, ?, [ and \\ escaped. */
+struct fields {
+    char **v;
+    int n, cap;
+    struct strbuf cur;
+    int open;
+    int glob;
+};
+
+/* Whether raw has a *, ? or [...] outside quotes */
+static int glob_word(const char *raw) {
+    if (!strpbrk(raw, "*?[")) return 0;
+    for (const char *p = raw; *p; ++p) {
+        if (*p == '\\' && p[1]) {
+            p++;
+        } else if (*p == '\'' || *p == '"') {
+            const char *q = strchr(p + 1, *p);
+            if (!q) return 0;
+            p = q;
+        } else if (*p == '$' && (p[1] == '?' || p[1] == '{')) {
+            // $? and ${...} are parameters, not patterns
+            const char *q = p[1] == '{' ? strchr(p, '}') : p + 1;
+            if (!q) return 0;
+            p = q;
+        } else if (*p == '*' || *p == '?' || (*p == '[' && strchr(p, ']'))) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Text that is never a pattern: escaped if cur is one */
+static void fields_lit(struct fields *f, const char *s, size_t n) {
+    if (!f->glob) {
+        sb_add(&f->cur, s, n);
+        return;
+    }
+    for (size_t i = 0; i < n; ++i) {
+        if (s[i] == '*' || s[i] == '?' || s[i] == '[' || s[i] == '\\') sb_add(&f->cur, "\\", 1);
+        sb_add(&f->cur, s + i, 1);
+    }
+}
+
+static void fields_push(struct fields *f, char *s) {
+    if (f->n >= f->cap) {
+        f->cap = f->cap ? f->cap * 2 : 16;
+        f->v = realloc(f->v, f->cap * sizeof(char *));
+        if (!f->v) { perror("malloc"); exit(EXIT_FAILURE); }
+    }
+    f->v[f->n++] = s;
+}
+
+/* cur is complete: a small field is copied to the arena, a big one is
+   handed over as it is */
+static void fields_end(struct fields *f) {
+    if (!f->cur.len && !f->open) return;
+    if (f->glob && f->cur.len) {
+        char **paths;
+        size_t n = glob_meta(f->cur.s, f->cur.len) ? glob_expand(f->cur.s, &paths) : 0;
+        if (n) {
+            arena_own(paths);
+            for (size_t i = 0; i < n; ++i) fields_push(f, paths[i]);
+            f->cur.len = 0;
+            f->open = 0;
+            return;
+        }
+        // no match: the word stays, without the escapes
+        size_t k = 0;
+        for (size_t i = 0; i < f->cur.len; ++i) {
+            if (f->cur.s[i] == '\\' && i + 1 < f->cur.len) i++;
+            f->cur.s[k++] = f->cur.s[i];
+        }
+        f->cur.len = k;
+        f->cur.s[k] = '\0';
+    }
+    if (f->cur.len < ARENA_CHUNK / 4) {
+        fields_push(f, arena_strndup(f->cur.len ? f->cur.s : "", f->cur.len));
+        f->cur.len = 0;
+    } else {
+        arena_own(f->cur.s);
+        fields_push(f, f->cur.s);
+        f->cur = (struct strbuf){ NULL, 0, 0 };
+    }
+    f->open = 0;
+}
+
+static int is_ifs(char c) {
+    return c == ' ' || c == '\t' || c == '\n';
+}
+
+/* Substitution output s[0..n), a buffer of the line's, split on blanks
+   and newlines. A piece that is a whole field on its own is cut out of s
+   in place; only pieces that join text of the word around them are
+   copied. */
+static void fields_split(struct fields *f, char *s, size_t n) {
+    size_t i = 0;
+    while (i < n) {
+        size_t j = i;
+        while (j < n && !is_ifs(s[j])) j++;
+        if (j == n) {               // may run on into the rest of the word
+            fields_lit(f, s + i, j - i);
+            break;
+        }
+        if (f->cur.len || f->open) {
+            fields_lit(f, s + i, j - i);
+            fields_end(f);
+        } else if (j > i) {
+            s[j] = '\0';
+            fields_push(f, s + i);
+        }
+        for (j++; j < n && is_ifs(s[j]); ) j++;
+        i = j;
+    }
+}
+
+static size_t fields_param(const char *p, struct fields *f) {
+    if (f->glob) {
+        char *tmp = arena_alloc(param_room(p) + 1), *o = tmp;
+        size_t k = expand_param(p, &o);
+        fields_lit(f, tmp, o - tmp);
+        return k;
+    }
+    char *o = sb_room(&f->cur, param_room(p)), *start = o;
+    size_t k = expand_param(p, &o);
+    f->cur.len += o - start;
+    return k;
+}
+
+/* $(...) or `...` at p: run it and add its output, trailing newlines
+   removed, to cur; split into fields if split is set. Returns the end of
+   the substitution. */
+static const char *fields_subst(const char *p, struct fields *f, int split) {
+    const char *end = p + strlen(p);
+    const char *q = (*p == '`') ? skip_backquote(p, end) : skip_subst(p, end);
+    if (!q) {
+        sb_add(&f->cur, p, end - p);
+        return end;
+    }
+    char *text;
+    size_t n = 0;
+    if (*p == '`') {
+        // \$ \` and \\ lose the backslash, as in sh
+        text = arena_alloc(q - p);
+        for (const char *s = p + 1; s < q - 1; ++s) {
+            if (*s == '\\' && s + 1 < q - 1 && strchr("$`\\", s[1])) s++;
+            text[n++] = *s;
+        }
+    } else {
+        text = (char *)p + 2;
+        n = q - p - 3;
+    }
+    size_t len;
+    char *out = command_subst(text, n, &len);
+    if (split) fields_split(f, out, len);
+    else fields_lit(f, out, len);
+    return q;
+}
+
+/* expand_word() for one word into f */
+static void expand_fields(const char *raw, struct fields *f, int split) {
+    const char *p = raw;
+    size_t k;
+    while (*p) {
+        const char *val;
+        size_t vlen;
+        if ((*p == '$' && p[1] == '(') || *p == '`') {
+            p = fields_subst(p, f, split);
+        } else if (*p == '$' && split && (k = var_ref(p, &val, &vlen))) {
+            if (vlen) fields_split(f, arena_strndup(val, vlen), vlen);
+            p += k;
+        } else if (*p == '$' && (k = fields_param(p, f))) {
+            p += k;
+        } else if (*p == '\\') {
+            if (p[1] == '\n') { p += 2; continue; }
+            if (p[1]) p++;
+            fields_lit(f, p++, 1);
+        } else if (*p == '\'') {
+            const char *q = strchr(p + 1, '\'');
+            size_t k = q ? (size_t)(q - p - 1) : strlen(p + 1);
+            fields_lit(f, p + 1, k);
+            f->open = 1;
+            p += k + 1 + (q != NULL);
+        } else if (*p == '"') {
+            p++;
+            f->open = 1;
+            while (*p && *p != '"') {
+                if ((*p == '$' && p[1] == '(') || *p == '`') {
+                    p = fields_subst(p, f, 0);
+                    continue;
+                }
+                if (*p == '$' && (k = fields_param(p, f))) {
+                    p += k;
+                    continue;
+                }
+                if (*p == '\\' && p[1] && strchr("$`\"\\\n", p[1])) {
+                    if (p[1] == '\n') { p += 2; continue; }
+                    p++;
+                }
+                fields_lit(f, p++, 1);
+            }
+            if (*p) p++;
+        } else {
+            size_t k = strcspn(p, "$`\\'\"");
+            if (!k) k = 1;          // a '$' that is no parameter
+            sb_add(&f->cur, p, k);
+            p += k;
+        }
+    }
+}
+
+/* Quote removal and parameter expansion: returns raw itself when there
+   is nothing to do, otherwise an arena copy. Inside double quotes a
+   backslash only escapes $ ` " \\ and newline, as in sh. A command
+   substitution is not split here: the word stays one. */
+char *expand_word(const char *raw) {
+    if (!strpbrk(raw, "'\"\\$`")) return (char *)raw;
+    if (has_subst(raw)) {
+        struct fields f = { NULL, 0, 0, { NULL, 0, 0 }, 1, 0 };
+        expand_fields(raw, &f, 0);
+        f.open = 1;
+        fields_end(&f);
+        char *word = f.v[0];
+        free(f.v);
+        free(f.cur.s);
+        return word;
+    }
+    size_t n = strlen(raw), room = n + 1;
+    // a parameter is a variable's value or at most every stage's status,
+    // up to 3 digits and a space each
+    for (const char *d = strchr(raw, '$'); d; d = strchr(d + 1, '$')) room += param_room(d);
+    char *out = arena_alloc(room), *o = out;
+    const char *p = raw;
+    size_t k;
+    while (*p) {
+        if (*p == '$' && (k = expand_param(p, &o))) {
+            p += k;
+        } else if (*p == '\\') {
+            if (p[1] == '\n') { p += 2; continue; }
+            if (p[1]) p++;
+            *o++ = *p++;
+        } else if (*p == '\'') {
+            const char *q = strchr(p + 1, '\'');
+            size_t k = q ? (size_t)(q - p - 1) : strlen(p + 1);
+            memcpy(o, p + 1, k);
+            o += k;
+            p += k + 1 + (q != NULL);
+        } else if (*p == '"') {
+            p++;
+            while (*p && *p != '"') {
+                if (*p == '$' && (k = expand_param(p, &o))) {
+                    p += k;
+                    continue;
+                }
+                if (*p == '\\' && p[1] && strchr("$`\"\\\n", p[1])) {
+                    if (p[1] == '\n') { p += 2; continue; }
+                    p++;
+                }
+                *o++ = *p++;
+            }
+            if (*p) p++;
+        } else {
+            *o++ = *p++;
+        }
+    }
+    *o = '\0';
+    return out;
+}
+
+/* A here-document body whose delimiter was not quoted: parameters and
+   command substitutions are expanded and a backslash only escapes $ `
+   \\ and newline; quotes are plain text. The result is in the arena. */
+static char *expand_heredoc(const char *body, size_t n, size_t *len) {
+    struct fields f = { NULL, 0, 0, { NULL, 0, 0 }, 0, 0 };
+    const char *p = arena_strndup(body, n);
+    size_t k;
+    while (*p) {
+        if ((*p == '$' && p[1] == '(') || *p == '`') {
+            p = fields_subst(p, &f, 0);
+        } else if (*p == '$' && (k = fields_param(p, &f))) {
+            p += k;
+        } else if (*p == '\\' && p[1] && strchr("$`\\\n", p[1])) {
+            if (p[1] != '\n') sb_add(&f.cur, p + 1, 1);
+            p += 2;
+        } else {
+            k = strcspn(p + 1, "$`\\") + 1;
+            sb_add(&f.cur, p, k);
+            p += k;
+        }
+    }
+    *len = f.cur.len;
+    if (!f.cur.s) return "";
+    arena_own(f.cur.s);
+    return f.cur.s;
+}
+
+/* argv ready for exec: every word expanded, in the line arena */
+char **expand_argv(struct command *cmd) {
+    int split = 0;
+    for (int i = 0; i < cmd->argc && !split; ++i)
+        split = has_subst(cmd->argv[i]) || var_splits(cmd->argv[i]) || glob_word(cmd->argv[i]);
+    if (split) {
+        // a substitution's output or a glob's matches can be any number of words
+        struct fields f = { NULL, 0, 0, { NULL, 0, 0 }, 0, 0 };
+        for (int i = 0; i < cmd->argc; ++i) {
+            f.glob = glob_word(cmd->argv[i]);
+            expand_fields(cmd->argv[i], &f, 1);
+            fields_end(&f);
+        }
+        fields_push(&f, NULL);
+        free(f.cur.s);
+        arena_own(f.v);
+        return f.v;
+    }
+    char **argv = arena_alloc((cmd->argc + 1) * sizeof(char*));
+    for (int i = 0; i < cmd->argc; ++i) argv[i] = expand_word(cmd->argv[i]);
+    argv[cmd->argc] = NULL;
+    return argv;
+}
+
+/* ---------------- Command substitution ---------------- */
+/* $(list) and `list` run in the shell itself, with fd 1 pointed at a
+   pipe while the list executes: builtins write into it without a fork
+   and only external commands are spawned. A reader thread drains the pipe
+   meanwhile into a buffer that doubles as it fills, so output of any size
+   is copied once and a writer never blocks on a full pipe. As in a
+   subshell, the list can't move the shell's cwd, change its variables,
+   set -o options, command hash or PIPESTATUS, and it runs without job
+   control. */
+struct capture {
+    int fd;
+    char *buf;
+    size_t len, cap;
+};
+
+static void *capture_thread(void *arg) {
+    struct capture *c = arg;
+    // signals are for the thread running the list
+    sigset_t all;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, NULL);
+    while (1) {
+        if (c->cap - c->len < 4096) {
+            c->cap = c->cap ? c->cap * 2 : 16384;
+            c->buf = realloc(c->buf, c->cap);
+            if (!c->buf) { perror("malloc"); exit(EXIT_FAILURE); }
+        }
+        ssize_t r = read(c->fd, c->buf + c->len, c->cap - c->len - 1);
+        if (r > 0) c->len += r;
+        else if (r == 0 || errno != EINTR) break;
+    }
+    return NULL;
+}
+
+/* Run text[0..n) and return what it wrote to stdout, NUL-terminated and
+   owned by the line; *len excludes trailing newlines. */
+char *command_subst(const char *text, size_t n, size_t *len) {
+    struct capture c = { -1, NULL, 0, 0 };
+    int p[2];
+    pthread_t reader;
+    *len = 0;
+    if (pipe2(p, O_CLOEXEC) < 0) {
+        perror("pipe");
+        return "";
+    }
+    c.fd = p[0];
+    if (pthread_create(&reader, NULL, capture_thread, &c) != 0) {
+        fprintf(stderr, "command substitution: no reader thread\n");
+        close(p[0]);
+        close(p[1]);
+        return "";
+    }
+    fflush(stdout);
+    int saved_out = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 3);
+    int cwd = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+    unsigned gen = cwd_gen;
+    dup2(p[1], STDOUT_FILENO);
+    close(p[1]);
+
+    // the pipeline being expanded keeps its stage records
+    struct stage_stat *stats = pipe_stats;
+    int nstats = pipe_nstats, stats_cap = pipe_stats_cap, timed = pipe_timed;
+    int *ps = pipestatus, ps_n = pipestatus_n;
+    struct timespec start = pipe_start;
+    int jc = job_control;
+    pipe_stats = NULL;
+    pipe_stats_cap = 0;
+    pipestatus = NULL;
+    pipestatus_n = 0;
+    job_control = 0;
+    subst_depth++;
+    // and its variables, set -o options and command hash
+    size_t vars = var_scope_begin();
+    struct hash_entry *hashed[HASH_BUCKETS];
+    hash_scope_begin(hashed);
+    long pipesize = opt_pipesize;
+    int tracing = trace_on, launcher = launcher_fd != -1;
+
+    struct cmd_list *list = parse_line(text, n);
+    if (list) execute_list(list);       // an exit only ends the list
+    else last_status = 2;
+
+    subst_depth--;
+    var_scope_end(vars);
+    hash_scope_end(hashed);
+    opt_pipesize = pipesize;
+    trace_on = tracing;
+    if (launcher && launcher_fd == -1) launcher_start();
+    else if (!launcher && launcher_fd != -1 && job_top == 0) launcher_stop();
+    fflush(stdout);
+    dup2(saved_out, STDOUT_FILENO);
+    close(saved_out);
+    free(pipe_stats);
+    free(pipestatus);
+    pipe_stats = stats;
+    pipe_nstats = nstats;
+    pipe_stats_cap = stats_cap;
+    pipe_timed = timed;
+    pipestatus = ps;
+    pipestatus_n = ps_n;
+    pipe_start = start;
+    job_control = jc;
+    if (cwd >= 0) {
+        if (fchdir(cwd) < 0) perror("cd");
+        close(cwd);
+        // a cd in there moved the cached directory along
+        if (cwd_gen != gen) cwd_update();
+    }
+
+    // EOF once the last writer, background ones included, is gone
+    pthread_join(reader, NULL);
+    close(c.fd);
+    if (!c.buf) return "";
+    while (c.len > 0 && c.buf[c.len - 1] == '\n') c.len--;
+    c.buf[c.len] = '\0';
+    arena_own(c.buf);
+    *len = c.len;
+    return c.buf;
+}
+
+/* ---------------- Builtin output ---------------- */
+
+void ob_init(struct outbuf *ob, int fd) {
+    ob->fd = fd;
+    ob->failed = 0;
+    ob->trace = 0;
+    ob->len = 0;
+}
+
+void ob_flush(struct outbuf *ob) {
+    if (ob->trace && ob->len) {
+        trace_event(PH_OUTPUT, ob->trace, 0, trace_line_start);
+        ob->trace = 0;
+    }
+    size_t off = 0;
+    while (off < ob->len && !ob->failed) {
+        ssize_t w = write(ob->fd, ob->buf + off, ob->len - off);
+        if (w < 0 && errno == EINTR) continue;
+        if (w <= 0) { ob->failed = 1; break; }
+        off += w;
+    }
+    ob->len = 0;
+}
+
+void ob_write(struct outbuf *ob, const char *s, size_t n) {
+    if (ob->failed) return;
+    if (ob->len + n > sizeof(ob->buf)) {
+        ob_flush(ob);
+        if (n > sizeof(ob->buf)) {
+            // big chunk: hand it to write() directly
+            while (n > 0 && !ob->failed) {
+                ssize_t w = write(ob->fd, s, n);
+                if (w < 0 && errno == EINTR) continue;
+                if (w <= 0) { ob->failed = 1; break; }
+                s += w; n -= w;
+            }
+            return;
+        }
+    }
+    memcpy(ob->buf + ob->len, s, n);
+    ob->len += n;
+}
+
+void ob_printf(struct outbuf *ob, const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    int room = sizeof(ob->buf) - ob->len;
+    int n = vsnprintf(ob->buf + ob->len, room, fmt, ap);
+    va_end(ap);
+    if (n < 0) return;
+    if (n < room) { ob->len += n; return; }
+
+    // did not fit: flush and format again, or go through a temporary
+    ob_flush(ob);
+    va_start(ap, fmt);
+    if (n < (int)sizeof(ob->buf)) {
+        ob->len = vsnprintf(ob->buf, sizeof(ob->buf), fmt, ap);
+    } else {
+        // not the arena: builtins on helper threads print through here
+        char *tmp = malloc(n + 1);
+        if (!tmp) { perror("malloc"); exit(EXIT_FAILURE); }
+        vsnprintf(tmp, n + 1, fmt, ap);
+        ob_write(ob, tmp, n);
+        free(tmp);
+    }
+    va_end(ap);
+}
+
+/* Builtin detection; the names are also what Tab completes */
+const char *const builtin_names[] = {
+    "cd", "pwd", "echo", "exit", "history", "hash", "memstats", "jobs", "fg", "bg",
+    "wait", "parallel", "set", "cat", "cp", "stats", "export", "unset", "compgen", NULL
+};
+
+int is_builtin(const char *cmd) {
+    if (!cmd) return 0;
+    for (const char *const *b = builtin_names; *b; ++b)
+        if (strcmp(cmd, *b) == 0) return 1;
+    return 0;
+}
+
+/* Whether this command runs as a builtin: cat and cp only do the plain,
+   flag-less forms and leave every other use to the real binaries. */
+int runs_as_builtin(char **args) {
+    if (!is_builtin(args[0])) return 0;
+    if (strcmp(args[0], "cat") == 0 || strcmp(args[0], "cp") == 0) {
+        for (int i = 1; args[i]; ++i)
+            if (args[i][0] == '-' && args[i][1]) return 0;
+    }
+    return 1;
+}
+
+/* Builtins that change shell state must not do so from inside a pipeline
+   ("cd /tmp | cat" leaves the shell where it was), so they keep running in
+   a forked child there. So do the job builtins and parallel: the job
+   table and waitpid() belong to the main thread; and hash and history,
+   whose tables and line arena only the main thread may touch. Everything
+   else runs in the shell process, on a helper thread in a pipeline, and
+   must not use the arena. */
+int builtin_needs_child(const char *cmd) {
+    return strcmp(cmd, "cd") == 0 || strcmp(cmd, "exit") == 0 ||
+           strcmp(cmd, "jobs") == 0 || strcmp(cmd, "fg") == 0 ||
+           strcmp(cmd, "bg") == 0 || strcmp(cmd, "wait") == 0 ||
+           strcmp(cmd, "parallel") == 0 || strcmp(cmd, "set") == 0 ||
+           strcmp(cmd, "export") == 0 || strcmp(cmd, "unset") == 0 ||
+           strcmp(cmd, "hash") == 0 || strcmp(cmd, "history") == 0;
+}
+
+/* Run a builtin in the calling process with stdout on out_fd and return its
+   exit status. It never touches stdio's stdout, so it is safe on a
+   pipeline helper thread. */
+int run_builtin(char **args, int in_fd, int out_fd) {
+    if (!args[0]) return 0;
+    struct outbuf out;
+    ob_init(&out, out_fd);
+    if (trace_on) out.trace = trace_name(args[0]);
+    int status = 0;
+
+    if (strcmp(args[0], "cd") == 0) {
+        char *target_dir = args[1];
+        if (!target_dir || strcmp(target_dir, "~") == 0) {
+            target_dir = (char *)var_get("HOME");
+            if (!target_dir) target_dir = "/";
+        }
+        if (chdir(target_dir) != 0) { perror("cd"); status = 1; }
+        else cwd_update();
+    } else if (strcmp(args[0], "pwd") == 0) {
+        if (!shell_cwd) cwd_update();
+        if (shell_cwd) ob_printf(&out, "%s\n", shell_cwd);
+        else { perror("pwd"); status = 1; }
+    } else if (strcmp(args[0], "echo") == 0) {
+        for (int i = 1; args[i]; ++i) {
+            ob_write(&out, args[i], strlen(args[i]));
+            if (args[i+1]) ob_write(&out, " ", 1);
+        }
+        ob_write(&out, "\n", 1);
+    } else if (strcmp(args[0], "history") == 0) {
+        status = builtin_history(args, &out);
+    } else if (strcmp(args[0], "hash") == 0) {
+        status = builtin_hash(args, &out);
+    } else if (strcmp(args[0], "memstats") == 0) {
+        status = builtin_memstats(args, &out);
+    } else if (strcmp(args[0], "jobs") == 0) {
+        status = builtin_jobs(args, &out);
+    } else if (strcmp(args[0], "fg") == 0) {
+        status = builtin_fg(args, &out);
+    } else if (strcmp(args[0], "bg") == 0) {
+        status = builtin_bg(args, &out);
+    } else if (strcmp(args[0], "wait") == 0) {
+        status = builtin_wait(args, &out);
+    } else if (strcmp(args[0], "parallel") == 0) {
+        status = builtin_parallel(args, in_fd, &out);
+    } else if (strcmp(args[0], "set") == 0) {
+        status = builtin_set(args, &out);
+    } else if (strcmp(args[0], "cat") == 0) {
+        status = builtin_cat(args, in_fd, &out);
+    } else if (strcmp(args[0], "cp") == 0) {
+        status = builtin_cp(args);
+    } else if (strcmp(args[0], "stats") == 0) {
+        status = builtin_stats(args, &out);
+    } else if (strcmp(args[0], "export") == 0) {
+        status = builtin_export(args, &out);
+    } else if (strcmp(args[0], "unset") == 0) {
+        status = builtin_unset(args);
+    } else if (strcmp(args[0], "compgen") == 0) {
+        status = builtin_compgen(args, &out);
+    } else if (strcmp(args[0], "exit") == 0) {
+        status = args[1] ? atoi(args[1]) : last_status;
+    }
+
+    ob_flush(&out);
+    return status;
+}
+
+/* Leave a forked child without exit(): that would also sync the shared
+   stdin offset back to where the shell's stdio buffer says it is, making
+   the shell re-read script input. */
+void child_exit(int status) {
+    fflush(stdout);
+    fflush(stderr);
+    _exit(status);
+}
+
+/* ---------------- Trace ---------------- */
+
+static const char *trace_phase_names[PH_COUNT] = { "read", "parse", "fork", "exec", "output", "wait" };
+static pthread_mutex_t trace_names_lock = PTHREAD_MUTEX_INITIALIZER;
+
+uint64_t trace_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+/* Four buckets per power of two: the two bits below the leading one */
+static int trace_bucket(uint64_t ns) {
+    if (ns < 8) return ns;
+    int lg = 63 - __builtin_clzll(ns);
+    int b = lg * 4 + ((ns >> (lg - 2)) & 3);
+    return b < TRACE_BUCKETS ? b : TRACE_BUCKETS - 1;
+}
+
+static uint64_t trace_bucket_low(int b) {
+    return b < 12 ? (uint64_t)b : (uint64_t)(4 + b % 4) << (b / 4 - 2);
+}
+
+/* Turn tracing on; the ring and histograms are allocated the first time
+   and kept when it is turned off, for stats. */
+static int trace_start() {
+    if (!trace_ring) {
+        trace_ring = calloc(TRACE_RING, sizeof(*trace_ring));
+        trace_hists = calloc(TRACE_NAMES * PH_COUNT, sizeof(*trace_hists));
+        if (!trace_ring || !trace_hists) {
+            free(trace_ring);
+            free(trace_hists);
+            trace_ring = NULL;
+            trace_hists = NULL;
+            perror("trace");
+            return -1;
+        }
+        trace_names[0] = "-";
+        trace_names[TRACE_NAMES - 1] = "(other)";
+        trace_nnames = 1;
+    }
+    trace_line_start = trace_now();
+    trace_on = 1;
+    return 0;
+}
+
+/* Name index for a command (its basename), once per command rather than
+   per event. Past TRACE_NAMES - 2 names the rest share "(other)". */
+int trace_name(const char *cmd) {
+    const char *base = strrchr(cmd, '/');
+    base = base ? base + 1 : cmd;
+    pthread_mutex_lock(&trace_names_lock);
+    int i = 1;
+    while (i < trace_nnames && strcmp(trace_names[i], base) != 0) i++;
+    if (i == trace_nnames) {
+        if (trace_nnames < TRACE_NAMES - 1) trace_names[trace_nnames++] = strdup(base);
+        else i = TRACE_NAMES - 1;
+    }
+    pthread_mutex_unlock(&trace_names_lock);
+    return i;
+}
+
+/* Relaxed load and store, no locked instruction: a builtin stage's thread
+   recording at the same instant as the main thread may lose a count or
+   share a ring slot, which a trace can afford at this price. */
+#define trace_add(p, v) __atomic_store_n((p), __atomic_load_n((p), __ATOMIC_RELAXED) + (v), __ATOMIC_RELAXED)
+
+/* Record one event, latency measured from start. Any thread may call it. */
+void trace_event(int phase, int name, pid_t pid, uint64_t start) {
+    if (!trace_on) return;
+    uint64_t now = trace_now();
+    uint64_t latency = now > start ? now - start : 0;
+    uint64_t i = __atomic_load_n(&trace_next, __ATOMIC_RELAXED);
+    __atomic_store_n(&trace_next, i + 1, __ATOMIC_RELAXED);
+    struct trace_event *e = &trace_ring[i & (TRACE_RING - 1)];
+    e->ts = now;
+    e->latency = latency;
+    e->pid = pid;
+    e->phase = phase;
+    e->name = name;
+    struct trace_hist *h = &trace_hists[name * PH_COUNT + phase];
+    trace_add(&h->count, 1);
+    trace_add(&h->sum, latency);
+    trace_add(&h->buckets[trace_bucket(latency)], 1);
+    if (latency > h->max) h->max = latency;
+}
+
+/* A process is running: PH_EXEC now, and PH_WAIT when it is reaped */
+static void trace_launched(struct proc *p, int name) {
+    trace_event(PH_EXEC, name, p->pid, trace_line_start);
+    p->trace = name;
+    p->trace_start = trace_line_start;
+}
+
+static const char *fmt_ns(char *buf, size_t n, uint64_t ns) {
+    if (ns < 1000) snprintf(buf, n, "%lluns", (unsigned long long)ns);
+    else if (ns < 1000000) snprintf(buf, n, "%.1fus", ns / 1e3);
+    else if (ns < 1000000000) snprintf(buf, n, "%.2fms", ns / 1e6);
+    else snprintf(buf, n, "%.2fs", ns / 1e9);
+    return buf;
+}
+
+/* q-quantile of a histogram: the top of the bucket it falls in */
+static uint64_t trace_quantile(const struct trace_hist *h, double q) {
+    uint64_t want = (uint64_t)(q * h->count + 0.5), seen = 0;
+    if (want < 1) want = 1;
+    for (int b = 0; b < TRACE_BUCKETS; ++b) {
+        seen += h->buckets[b];
+        if (seen >= want) {
+            uint64_t top = b + 1 < TRACE_BUCKETS ? trace_bucket_low(b + 1) : h->max;
+            return top < h->max ? top : h->max;
+        }
+    }
+    return h->max;
+}
+
+static int trace_write(const char *path, int binary) {
+    FILE *f = fopen(path, "we");
+    if (!f) { fprintf(stderr, "stats: %s: %s\n", path, strerror(errno)); return 1; }
+    uint64_t first = trace_next > TRACE_RING ? trace_next - TRACE_RING : 0;
+    if (binary) {
+        // "MYSHTRC1", u32 names, u32 events, the names NUL-terminated,
+        // then the events as struct trace_event
+        uint32_t hdr[2] = { TRACE_NAMES, (uint32_t)(trace_next - first) };
+        fwrite("MYSHTRC1", 1, 8, f);
+        fwrite(hdr, sizeof(hdr), 1, f);
+        for (int i = 0; i < TRACE_NAMES; ++i) {
+            const char *name = trace_names[i] ? trace_names[i] : "";
+            fwrite(name, 1, strlen(name) + 1, f);
+        }
+        for (uint64_t i = first; i < trace_next; ++i)
+            fwrite(&trace_ring[i & (TRACE_RING - 1)], sizeof(struct trace_event), 1, f);
+    } else {
+        for (uint64_t i = first; i < trace_next; ++i) {
+            struct trace_event *e = &trace_ring[i & (TRACE_RING - 1)];
+            fprintf(f, "{\"ts\": %llu, \"phase\": \"%s\", \"cmd\": \"%s\", \"pid\": %d, \"latency_ns\": %llu}\n",
+                    (unsigned long long)e->ts, trace_phase_names[e->phase], trace_names[e->name],
+                    e->pid, (unsigned long long)e->latency);
+        }
+    }
+    if (fclose(f) != 0) { fprintf(stderr, "stats: %s: %s\n", path, strerror(errno)); return 1; }
+    return 0;
+}
+
+/* stats             count, mean, p50/p90/p99 and max per phase and command
+   stats PHASE       that phase's latency histogram, all commands together
+   stats -j FILE     write the ring as JSON lines
+   stats -b FILE     write the ring in binary
+   stats -c          clear the ring and the histograms */
+int builtin_stats(char **args, struct outbuf *out) {
+    if (!trace_ring) {
+        fprintf(stderr, "stats: nothing traced (set -o trace)\n");
+        return 1;
+    }
+    if (args[1] && (strcmp(args[1], "-j") == 0 || strcmp(args[1], "-b") == 0)) {
+        if (!args[2]) { fprintf(stderr, "stats: %s: file name expected\n", args[1]); return 2; }
+        return trace_write(args[2], args[1][1] == 'b');
+    }
+    if (args[1] && strcmp(args[1], "-c") == 0) {
+        trace_next = 0;
+        memset(trace_hists, 0, TRACE_NAMES * PH_COUNT * sizeof(*trace_hists));
+        return 0;
+    }
+
+    char b[5][16];
+    if (args[1]) {
+        int ph = 0;
+        while (ph < PH_COUNT && strcmp(trace_phase_names[ph], args[1]) != 0) ph++;
+        if (ph == PH_COUNT) { fprintf(stderr, "stats: %s: no such phase\n", args[1]); return 2; }
+        struct trace_hist sum;
+        memset(&sum, 0, sizeof(sum));
+        for (int n = 0; n < TRACE_NAMES; ++n) {
+            struct trace_hist *h = &trace_hists[n * PH_COUNT + ph];
+            sum.count += h->count;
+            for (int k = 0; k < TRACE_BUCKETS; ++k) sum.buckets[k] += h->buckets[k];
+        }
+        uint32_t top = 1;
+        for (int k = 0; k < TRACE_BUCKETS; ++k) if (sum.buckets[k] > top) top = sum.buckets[k];
+        for (int k = 0; k < TRACE_BUCKETS; ++k) {
+            if (!sum.buckets[k]) continue;
+            int bar = (int)(40.0 * sum.buckets[k] / top + 0.5);
+            ob_printf(out, "%9s .. %-9s %8u ", fmt_ns(b[0], 16, trace_bucket_low(k)),
+                      fmt_ns(b[1], 16, trace_bucket_low(k + 1)), sum.buckets[k]);
+            for (int i = 0; i < bar; ++i) ob_write(out, "#", 1);
+            ob_write(out, "\n", 1);
+        }
+        return 0;
+    }
+
+    ob_printf(out, "%-7s %-16s %7s %9s %9s %9s %9s %9s\n",
+              "phase", "command", "count", "mean", "p50", "p90", "p99", "max");
+    for (int ph = 0; ph < PH_COUNT; ++ph) {
+        for (int n = 0; n < TRACE_NAMES; ++n) {
+            struct trace_hist *h = &trace_hists[n * PH_COUNT + ph];
+            if (!h->count) continue;
+            ob_printf(out, "%-7s %-16s %7llu %9s %9s %9s %9s %9s\n",
+                      trace_phase_names[ph], trace_names[n], (unsigned long long)h->count,
+                      fmt_ns(b[0], 16, h->sum / h->count), fmt_ns(b[1], 16, trace_quantile(h, 0.5)),
+                      fmt_ns(b[2], 16, trace_quantile(h, 0.9)), fmt_ns(b[3], 16, trace_quantile(h, 0.99)),
+                      fmt_ns(b[4], 16, h->max));
+        }
+    }
+    uint64_t kept = trace_next < TRACE_RING ? trace_next : TRACE_RING;
+    ob_printf(out, "%llu events, last %llu in the ring\n",
+              (unsigned long long)trace_next, (unsigned long long)kept);
+    return 0;
+}
+
+/* ---------------- Shell variables ---------------- */
+/* Variables live in an open-addressing table (linear probing, power of
+   two size, at most 3/4 full counting deleted slots). Each one is a single
+   "NAME=value" string, so an exported variable goes into the envp of a
+   child as it is. The envp array is rebuilt only when the set of exported
+   strings changes; an assignment that fits the old string is done in
+   place and changes nothing. Lookups hash the name where it stands in the
+   word, so expanding $NAME does not allocate. The table starts as a copy
+   of environ, every entry exported; environ itself is left alone. */
+#define VAR_EXPORT 1
+
+struct var {
+    char *str;                  // "NAME=value", NULL: never used, var_gone: deleted
+    uint32_t hash;
+    uint32_t nlen, vlen, cap;   // cap: bytes malloc'd at str
+    int flags;
+};
+
+static char var_gone[1];
+struct var *var_table = NULL;
+size_t var_size = 0, var_used = 0;      // slots, slots not NULL
+char **var_env = NULL;
+int var_env_dirty = 1;                  // exported strings changed since var_env was built
+static char **var_log = NULL;           // previous states, see var_scope_begin()
+static size_t var_log_len = 0, var_log_cap = 0;
+static int var_logging = 0;
+
+static uint32_t var_hash(const char *name, size_t n) {
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < n; ++i) h = (h ^ (unsigned char)name[i]) * 16777619u;
+    return h;
+}
+
+int var_name_char(char c, int first) {
+    return c == '_' || ((c | 0x20) >= 'a' && (c | 0x20) <= 'z') || (!first && c >= '0' && c <= '9');
+}
+
+static int var_valid_name(const char *s) {
+    if (!var_name_char(*s, 1)) return 0;
+    while (*++s) if (!var_name_char(*s, 0)) return 0;
+    return 1;
+}
+
+static void var_set_flags(const char *name, size_t n, const char *value, size_t vlen, int flags);
+
+static void var_init() {
+    int logging = var_logging;
+    var_logging = 0;            // importing environ is no change to undo
+    var_size = 256;
+    var_table = calloc(var_size, sizeof(struct var));
+    if (!var_table) { perror("malloc"); exit(EXIT_FAILURE); }
+    for (char **e = environ; *e; ++e) {
+        const char *eq = strchr(*e, '=');
+        if (eq && eq > *e) var_set_flags(*e, eq - *e, eq + 1, strlen(eq + 1), VAR_EXPORT);
+    }
+    var_logging = logging;
+}
+
+/* The slot for name[0..n): its entry, or with create the slot a new one
+   goes into. NULL if it is not there (and create is not set). */
+static struct var *var_slot(const char *name, size_t n, uint32_t h, int create) {
+    if (!var_table) var_init();
+    if (create && (var_used + 1) * 4 > var_size * 3) {
+        // grow (or just drop the deleted slots) and rehash
+        struct var *old = var_table;
+        size_t old_size = var_size, live = 0;
+        for (size_t i = 0; i < old_size; ++i) live += old[i].str && old[i].str != var_gone;
+        if ((live + 1) * 2 > var_size) var_size *= 2;
+        var_table = calloc(var_size, sizeof(struct var));
+        if (!var_table) { perror("malloc"); exit(EXIT_FAILURE); }
+        for (size_t i = 0; i < old_size; ++i) {
+            if (!old[i].str || old[i].str == var_gone) continue;
+            size_t j = old[i].hash & (var_size - 1);
+            while (var_table[j].str) j = (j + 1) & (var_size - 1);
+            var_table[j] = old[i];
+        }
+        var_used = live;
+        free(old);
+    }
+    struct var *tomb = NULL;
+    for (size_t i = h & (var_size - 1); ; i = (i + 1) & (var_size - 1)) {
+        struct var *v = &var_table[i];
+        if (!v->str) return create ? (tomb ? tomb : v) : NULL;
+        if (v->str == var_gone) {
+            if (!tomb) tomb = v;
+        } else if (v->hash == h && v->nlen == n && memcmp(v->str, name, n) == 0) {
+            return v;
+        }
+    }
+}
+
+/* Value of name[0..n), NULL if it is not set */
+const char *var_getn(const char *name, size_t n, size_t *vlen) {
+    struct var *v = var_slot(name, n, var_hash(name, n), 0);
+    if (!v) return NULL;
+    if (vlen) *vlen = v->vlen;
+    return v->str + v->nlen + 1;
+}
+
+const char *var_get(const char *name) {
+    return var_getn(name, strlen(name), NULL);
+}
+
+/* name[0..n)'s state in the line arena, for var_restore(): NAME=value
+   with the '=' turned into a flag byte, '+' exported, '-' not; just NAME
+   if it is not set */
+static char *var_save(const char *name, size_t n) {
+    struct var *v = var_slot(name, n, var_hash(name, n), 0);
+    if (!v) return arena_strndup(name, n);
+    char *s = arena_strdup(v->str);
+    s[n] = (v->flags & VAR_EXPORT) ? '+' : '-';
+    return s;
+}
+
+/* Inside a scope, note name[0..n)'s state before it changes */
+static void var_log_change(const char *name, size_t n) {
+    if (!var_logging) return;
+    if (var_log_len == var_log_cap) {
+        var_log_cap = var_log_cap ? var_log_cap * 2 : 16;
+        var_log = realloc(var_log, var_log_cap * sizeof(char *));
+        if (!var_log) { perror("malloc"); exit(EXIT_FAILURE); }
+    }
+    var_log[var_log_len++] = var_save(name, n);
+}
+
+static void var_set_flags(const char *name, size_t n, const char *value, size_t vlen, int flags) {
+    var_log_change(name, n);
+    uint32_t h = var_hash(name, n);
+    struct var *v = var_slot(name, n, h, 1);
+    if (!v->str || v->str == var_gone) {
+        if (!v->str) var_used++;
+        v->str = NULL;
+        v->cap = 0;
+        v->hash = h;
+        v->nlen = n;
+        v->flags = 0;
+    }
+    char *str = v->str;
+    if (n + vlen + 2 > v->cap) {
+        v->cap = n + vlen + 2 < 32 ? 32 : n + vlen + 2;
+        str = malloc(v->cap);
+        if (!str) { perror("malloc"); exit(EXIT_FAILURE); }
+        memcpy(str, name, n);
+        str[n] = '=';
+    }
+    // value may be the old value itself ("export NAME")
+    memmove(str + n + 1, value, vlen);
+    str[n + 1 + vlen] = '\0';
+    v->vlen = vlen;
+    if (str != v->str) {
+        // a new string: an exported one has to be swapped in the envp
+        free(v->str);
+        v->str = str;
+        if (v->flags & VAR_EXPORT) var_env_dirty = 1;
+    }
+    if ((v->flags ^ flags) & VAR_EXPORT) var_env_dirty = 1;
+    v->flags = flags;
+    if (n == 4 && memcmp(name, "PATH", 4) == 0) hash_clear();
+}
+
+/* name=value, keeping the variable's export flag */
+void var_set(const char *name, const char *value, int export) {
+    size_t n = strlen(name);
+    struct var *v = var_slot(name, n, var_hash(name, n), 0);
+    int flags = (v ? v->flags : 0) | (export ? VAR_EXPORT : 0);
+    var_set_flags(name, n, value, strlen(value), flags);
+}
+
+void var_unset(const char *name) {
+    size_t n = strlen(name);
+    struct var *v = var_slot(name, n, var_hash(name, n), 0);
+    if (!v) return;
+    var_log_change(name, n);
+    if (v->flags & VAR_EXPORT) var_env_dirty = 1;
+    free(v->str);
+    v->str = var_gone;
+    if (n == 4 && memcmp(name, "PATH", 4) == 0) hash_clear();
+}
+
+/* $NAME or ${NAME} at p: the value (NULL if unset) in *val and its
+   length in *vlen. Returns the characters used, 0 if p is neither. The
+   name is hashed as it is scanned. */
+size_t var_ref(const char *p, const char **val, size_t *vlen) {
+    int brace = p[1] == '{';
+    const char *name = p + 1 + brace, *q = name;
+    if (!var_name_char(*q, 1)) return 0;
+    uint32_t h = 2166136261u;
+    do h = (h ^ (unsigned char)*q++) * 16777619u; while (var_name_char(*q, 0));
+    size_t n = q - name;
+    if (n == 10 && memcmp(name, "PIPESTATUS", 10) == 0) return 0;   // not a variable
+    if (brace && *q++ != '}') return 0;
+    struct var *v = var_slot(name, n, h, 0);
+    *val = v ? v->str + v->nlen + 1 : NULL;
+    *vlen = v ? v->vlen : 0;
+    return q - p;
+}
+
+/* The environment for a child: the exported variables */
+char **var_envp() {
+    if (!var_env_dirty) return var_env;
+    if (!var_table) var_init();
+    size_t n = 0;
+    for (size_t i = 0; i < var_size; ++i)
+        n += var_table[i].str && var_table[i].str != var_gone && (var_table[i].flags & VAR_EXPORT);
+    var_env = realloc(var_env, (n + 1) * sizeof(char *));
+    if (!var_env) { perror("malloc"); exit(EXIT_FAILURE); }
+    n = 0;
+    for (size_t i = 0; i < var_size; ++i)
+        if (var_table[i].str && var_table[i].str != var_gone && (var_table[i].flags & VAR_EXPORT))
+            var_env[n++] = var_table[i].str;
+    var_env[n] = NULL;
+    var_env_dirty = 0;
+    return var_env;
+}
+
+/* Length of the NAME in a leading NAME=value word, 0 if it is not one */
+size_t assignment_name(const char *word) {
+    size_t n = 0;
+    while (var_name_char(word[n], n == 0)) n++;
+    return (n && word[n] == '=') ? n : 0;
+}
+
+/* How many of cmd's words are leading NAME=value assignments */
+int assignment_words(struct command *cmd) {
+    int n = 0;
+    while (n < cmd->argc && assignment_name(cmd->argv[n])) n++;
+    return n;
+}
+
+/* Run the raw NAME=value words: value is expanded as a word. With
+   export the variables are exported; a copy of each one's previous state
+   goes in saved (an arena array of n) when it is given. */
+void var_assign(char **words, int n, int export, char **saved) {
+    for (int i = 0; i < n; ++i) {
+        size_t k = assignment_name(words[i]);
+        char *name = arena_strndup(words[i], k);
+        if (saved) saved[i] = var_save(name, k);
+        var_set(name, expand_word(words[i] + k + 1), export);
+    }
+}
+
+/* Undo a var_assign() that saved the previous states */
+void var_restore(char **saved, int n) {
+    for (int i = n - 1; i >= 0; --i) {
+        char *flag = saved[i] + strcspn(saved[i], "+-");
+        if (!*flag) {
+            var_unset(saved[i]);
+            continue;
+        }
+        var_set_flags(saved[i], flag - saved[i], flag + 1, strlen(flag + 1),
+                      *flag == '+' ? VAR_EXPORT : 0);
+    }
+}
+
+/* Changes made from here on are logged, to be undone by var_scope_end()
+   with the mark returned: a command substitution's assignments, exports
+   and unsets stay in it, as in a subshell. Scopes nest. The log lives in
+   the line arena, as the substitution does. */
+size_t var_scope_begin() {
+    if (!var_table) var_init();
+    var_logging++;
+    return var_log_len;
+}
+
+/* Put back every variable changed since mark, newest change first. The
+   envp is marked for a rebuild as the restored strings require. */
+void var_scope_end(size_t mark) {
+    int logging = --var_logging;
+    var_logging = 0;
+    var_restore(var_log + mark, var_log_len - mark);
+    var_log_len = mark;
+    var_logging = logging;
+}
+
+static int cmp_str(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/* export                 list the exported variables
+   export NAME[=value]... mark them exported, assigning the value if given */
+int builtin_export(char **args, struct outbuf *out) {
+    if (!args[1]) {
+        char **env = var_envp();
+        size_t n = 0;
+        while (env[n]) n++;
+        char **sorted = malloc((n + 1) * sizeof(char *));
+        memcpy(sorted, env, n * sizeof(char *));
+        qsort(sorted, n, sizeof(char *), cmp_str);
+        for (size_t i = 0; i < n; ++i) {
+            const char *eq = strchr(sorted[i], '=');
+            ob_printf(out, "export %.*s='", (int)(eq - sorted[i]), sorted[i]);
+            for (const char *c = eq + 1; *c; ++c) {
+                if (*c == '\'') ob_write(out, "'\\''", 4);
+                else ob_write(out, c, 1);
+            }
+            ob_write(out, "'\n", 2);
+        }
+        free(sorted);
+        return 0;
+    }
+    int rc = 0;
+    for (int i = 1; args[i]; ++i) {
+        size_t k = assignment_name(args[i]);
+        if (k) {
+            args[i][k] = '\0';
+            var_set(args[i], args[i] + k + 1, 1);
+            args[i][k] = '=';
+        } else if (var_valid_name(args[i])) {
+            const char *value = var_get(args[i]);
+            var_set(args[i], value ? value : "", 1);
+        } else {
+            fprintf(stderr, "export: `%s': not a valid identifier\n", args[i]);
+            rc = 1;
+        }
+    }
+    return rc;
+}
+
+int builtin_unset(char **args) {
+    for (int i = 1; args[i]; ++i) var_unset(args[i]);
+    return 0;
+}
+
+/* ---------------- Command hash (PATH lookup cache) ---------------- */
+
+/* name -> absolute path, filled on first use so each command walks $PATH
+   once per session instead of once per launch. Assigning or unsetting
+   PATH drops everything (see var_set_flags). */
+struct hash_entry {
+    char *name;
+    char *path;
+    unsigned hits;
+    struct hash_entry *next;
+};
+
+struct hash_entry *cmd_hash[HASH_BUCKETS];
+
+static unsigned hash_string(const char *s) {
+    unsigned h = 5381;
+    while (*s) h = h * 33 + (unsigned char)*s++;
+    return h;
+}
+
+void hash_clear() {
+    for (int b = 0; b < HASH_BUCKETS; ++b) {
+        struct hash_entry *e = cmd_hash[b];
+        while (e) {
+            struct hash_entry *next = e->next;
+            free(e->name); free(e->path); free(e);
+            e = next;
+        }
+        cmd_hash[b] = NULL;
+    }
+}
+
+void hash_forget(const char *name) {
+    struct hash_entry **pp = &cmd_hash[hash_string(name) % HASH_BUCKETS];
+    while (*pp) {
+        if (strcmp((*pp)->name, name) == 0) {
+            struct hash_entry *e = *pp;
+            *pp = e->next;
+            free(e->name); free(e->path); free(e);
+            return;
+        }
+        pp = &(*pp)->next;
+    }
+}
+
+/* Give a command substitution a copy of the table: what it looks up,
+   forgets or clears stays in the copy. The shell's own buckets wait in
+   saved until hash_scope_end() drops the copy and puts them back. */
+void hash_scope_begin(struct hash_entry **saved) {
+    memcpy(saved, cmd_hash, sizeof(cmd_hash));
+    for (int b = 0; b < HASH_BUCKETS; ++b) {
+        struct hash_entry **tail = &cmd_hash[b];
+        for (struct hash_entry *e = saved[b]; e; e = e->next) {
+            struct hash_entry *copy = malloc(sizeof(*copy));
+            if (!copy) { perror("malloc"); exit(EXIT_FAILURE); }
+            *copy = *e;
+            copy->name = strdup(e->name);
+            copy->path = strdup(e->path);
+            *tail = copy;
+            tail = &copy->next;
+        }
+        *tail = NULL;
+    }
+}
+
+void hash_scope_end(struct hash_entry **saved) {
+    hash_clear();
+    memcpy(cmd_hash, saved, sizeof(cmd_hash));
+}
+
+/* Walk $PATH for name; returns a malloc'd absolute path or NULL */
+static char *search_path(const char *name) {
+    const char *path = var_get("PATH");
+    if (!path) path = "/usr/local/bin:/usr/bin:/bin";
+    size_t nlen = strlen(name);
+    char buf[4096];
+    const char *p = path;
+    while (1) {
+        const char *end = strchr(p, ':');
+        size_t dlen = end ? (size_t)(end - p) : strlen(p);
+        // an empty PATH entry means the current directory
+        const char *dir = dlen ? p : ".";
+        if (!dlen) dlen = 1;
+        if (dlen + nlen + 2 <= sizeof(buf)) {
+            memcpy(buf, dir, dlen);
+            buf[dlen] = '/';
+            memcpy(buf + dlen + 1, name, nlen + 1);
+            struct stat st;
+            if (stat(buf, &st) == 0 && S_ISREG(st.st_mode) && access(buf, X_OK) == 0)
+                return strdup(buf);
+        }
+        if (!end) break;
+        p = end + 1;
+    }
+    return NULL;
+}
+
+/* Find name in the table, searching PATH and remembering the result on a miss */
+static struct hash_entry *hash_find(const char *name) {
+    unsigned b = hash_string(name) % HASH_BUCKETS;
+    for (struct hash_entry *e = cmd_hash[b]; e; e = e->next) {
+        if (strcmp(e->name, name) == 0) return e;
+    }
+    char *full = search_path(name);
+    if (!full) return NULL;
+    struct hash_entry *e = malloc(sizeof(*e));
+    e->name = strdup(name);
+    e->path = full;
+    e->hits = 0;
+    e->next = cmd_hash[b];
+    cmd_hash[b] = e;
+    return e;
+}
+
+/* Resolve a command name to the path to execve. Names containing '/' are
+   used as-is. Returns NULL if the command is not on PATH. */
+const char *hash_lookup(const char *name) {
+    if (strchr(name, '/')) return name;
+    struct hash_entry *e = hash_find(name);
+    if (!e) return NULL;
+    e->hits++;
+    return e->path;
+}
+
+/* hash            list remembered commands
+   hash name...    look names up and remember them
+   hash -r         forget everything
+   hash -d name... forget the given names
+   Returns 0 on success, 1 if a name could not be found. */
+int builtin_hash(char **args, struct outbuf *out) {
+    if (!args[1]) {
+        int any = 0;
+        for (int b = 0; b < HASH_BUCKETS; ++b) {
+            for (struct hash_entry *e = cmd_hash[b]; e; e = e->next) {
+                if (!any) ob_printf(out, "hits\tcommand\n");
+                ob_printf(out, "%4u\t%s\n", e->hits, e->path);
+                any = 1;
+            }
+        }
+        if (!any) ob_printf(out, "hash: hash table empty\n");
+        return 0;
+    }
+    if (strcmp(args[1], "-r") == 0) {
+        hash_clear();
+        return 0;
+    }
+    int rc = 0;
+    int forget = strcmp(args[1], "-d") == 0;
+    for (int i = forget ? 2 : 1; args[i]; ++i) {
+        if (forget) {
+            hash_forget(args[i]);
+            continue;
+        }
+        if (strchr(args[i], '/')) continue;
+        // re-resolve so "hash name" refreshes a stale entry
+        hash_forget(args[i]);
+        if (!hash_find(args[i])) { fprintf(stderr, "hash: %s: not found\n", args[i]); rc = 1; }
+    }
+    return rc;
+}
+
+/* ---------------- Glob ---------------- */
+/* *, ?, [...] and ** in unquoted words are matched by the shell itself.
+   Directories are read with getdents64 into a cache keyed by path and
+   checked against the directory's inode and mtime, so globbing a big
+   directory again costs one stat instead of a read of every entry. A **
+   walk hands the subtrees below its first directory to a few threads.
+   Matches come back sorted in byte order. */
+struct linux_dirent64 {         // a getdents64 record
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;       // DIRENT_*
+    char d_name[];
+};
+
+enum { DIRENT_UNKNOWN = 0, DIRENT_DIR = 4, DIRENT_LNK = 10 };
+
+struct dir_cache {
+    char *path;                 // as given to open(), the key
+    struct timespec mtime;
+    ino_t ino;
+    size_t len;                 // bytes of records at ents
+    int refs;                   // the table's and every dir_read() caller's, under the lock
+    struct dir_cache *next;
+    char ents[];                // getdents64 records as the kernel wrote them
+};
+
+struct dir_cache *dir_cache_table[GLOB_CACHE_BUCKETS];
+size_t dir_cache_n = 0, dir_cache_bytes = 0;
+static pthread_mutex_t dir_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void dir_cache_flush() {
+    for (int b = 0; b < GLOB_CACHE_BUCKETS; ++b) {
+        while (dir_cache_table[b]) {
+            struct dir_cache *d = dir_cache_table[b];
+            dir_cache_table[b] = d->next;
+            if (--d->refs == 0) free(d);
+        }
+    }
+    dir_cache_n = dir_cache_bytes = 0;
+}
+
+static struct dir_cache *dir_load(const char *path, const struct stat *st) {
+    int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) return NULL;
+    size_t cap = 32768, len = 0, plen = strlen(path) + 1;
+    struct dir_cache *d = malloc(sizeof(*d) + cap);
+    while (d) {
+        if (cap - len < 8192) {
+            cap *= 2;
+            struct dir_cache *g = realloc(d, sizeof(*d) + cap);
+            if (!g) { free(d); d = NULL; break; }
+            d = g;
+        }
+        long r = syscall(SYS_getdents64, fd, d->ents + len, cap - len);
+        if (r <= 0) break;
+        len += r;
+    }
+    close(fd);
+    struct dir_cache *g = d ? realloc(d, sizeof(*d) + len + plen) : NULL;
+    if (!g) { free(d); return NULL; }
+    d = g;
+    d->path = d->ents + len;
+    memcpy(d->path, path, plen);
+    d->mtime = st->st_mtim;
+    d->ino = st->st_ino;
+    d->len = len;
+    d->refs = 1;
+    d->next = NULL;
+    return d;
+}
+
+/* The entries of directory path, from the cache while its mtime holds;
+   dir_release() them when done. Entries are counted: ** walkers that
+   reach one directory through different symlinks may both hold it while
+   one of them finds it stale, and it is freed by whoever lets go last. */
+static struct dir_cache *dir_read(const char *path) {
+    struct stat st;
+    if (stat(path, &st) < 0 || !S_ISDIR(st.st_mode)) return NULL;
+    unsigned b = hash_string(path) % GLOB_CACHE_BUCKETS;
+    pthread_mutex_lock(&dir_cache_lock);
+    struct dir_cache **pp = &dir_cache_table[b], *d;
+    while ((d = *pp) && strcmp(d->path, path) != 0) pp = &d->next;
+    if (d && d->ino == st.st_ino && d->mtime.tv_sec == st.st_mtim.tv_sec &&
+        d->mtime.tv_nsec == st.st_mtim.tv_nsec) {
+        d->refs++;
+        pthread_mutex_unlock(&dir_cache_lock);
+        return d;
+    }
+    if (d) {
+        *pp = d->next;
+        dir_cache_n--;
+        dir_cache_bytes -= d->len;
+        if (--d->refs == 0) free(d);
+    }
+    pthread_mutex_unlock(&dir_cache_lock);
+
+    d = dir_load(path, &st);
+    if (!d) return NULL;
+    // mtime moves in clock ticks: a directory changed in the last second
+    // could change again without its mtime doing so, so it is not kept
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    if (now.tv_sec - st.st_mtim.tv_sec < 2) return d;
+    pthread_mutex_lock(&dir_cache_lock);
+    // another walker may have cached it meanwhile (pp may be gone too)
+    struct dir_cache *e = dir_cache_table[b];
+    while (e && strcmp(e->path, path) != 0) e = e->next;
+    if (!e && dir_cache_n < GLOB_CACHE_DIRS && dir_cache_bytes + d->len <= GLOB_CACHE_BYTES) {
+        d->next = dir_cache_table[b];
+        dir_cache_table[b] = d;
+        dir_cache_n++;
+        dir_cache_bytes += d->len;
+        d->refs++;
+    }
+    pthread_mutex_unlock(&dir_cache_lock);
+    return d;
+}
+
+static void dir_release(struct dir_cache *d) {
+    pthread_mutex_lock(&dir_cache_lock);
+    int last = --d->refs == 0;
+    pthread_mutex_unlock(&dir_cache_lock);
+    if (last) free(d);
+}
+
+/* p at '[': just past the class, NULL if it has no ']'. *ok says
+   whether c is in it. */
+static const char *glob_class(const char *p, const char *end, unsigned char c, int *ok) {
+    const char *q = p + 1;
+    int neg = q < end && (*q == '!' || *q == '^');
+    int in = 0;
+    q += neg;
+    for (int first = 1; q < end && (*q != ']' || first); first = 0) {
+        unsigned char lo, hi;
+        if (*q == '\\' && q + 1 < end) q++;
+        lo = hi = *q++;
+        if (q + 1 < end && *q == '-' && q[1] != ']') {
+            q++;
+            if (*q == '\\' && q + 1 < end) q++;
+            hi = *q++;
+        }
+        if (lo <= c && c <= hi) in = 1;
+    }
+    if (q >= end) return NULL;
+    *ok = in != neg;
+    return q + 1;
+}
+
+/* Whether name matches the pattern component p[0..n). A '*' backtracks
+   to the last star only, so this is linear in practice. */
+static int glob_match(const char *p, size_t n, const char *name) {
+    const char *end = p + n, *star = NULL, *star_name = NULL;
+    while (*name) {
+        if (p < end && *p == '*') {
+            star = ++p;
+            star_name = name;
+            continue;
+        }
+        if (p < end) {
+            const char *next = NULL;
+            int ok = 0;
+            if (*p == '?') {
+                ok = 1;
+                next = p + 1;
+            } else if (*p != '[' || !(next = glob_class(p, end, *name, &ok))) {
+                if (*p == '\\' && p + 1 < end) p++;
+                ok = *p == *name;
+                next = p + 1;
+            }
+            if (ok) {
+                p = next;
+                name++;
+                continue;
+            }
+        }
+        if (!star) return 0;
+        p = star;
+        name = ++star_name;
+    }
+    while (p < end && *p == '*') p++;
+    return p == end;
+}
+
+/* Whether s[0..n) has a *, ? or [...] that is not escaped */
+int glob_meta(const char *s, size_t n) {
+    for (size_t i = 0; i < n; ++i) {
+        if (s[i] == '\\') i++;
+        else if (s[i] == '*' || s[i] == '?') return 1;
+        else if (s[i] == '[' && memchr(s + i + 1, ']', n - i - 1)) return 1;
+    }
+    return 0;
+}
+
+struct glob_comp {
+    const char *s;
+    size_t n;
+    int kind;                   // 0 literal, 1 pattern, 2 "**"
+};
+
+struct glob_walk {
+    struct glob_comp *comps;
+    int ncomps;
+    int dirs_only;              // the pattern ended in '/'
+    int threads;                // for the first **, 1: walk alone
+    struct strbuf names;        // matched paths, each ending in a NUL
+    size_t count;
+};
+
+static void glob_walk(struct glob_walk *w, struct strbuf *path, int i, int below);
+
+static void glob_add(struct glob_walk *w, const struct strbuf *path) {
+    sb_add(&w->names, path->s, path->len);
+    if (w->dirs_only) sb_add(&w->names, "/", 1);
+    sb_add(&w->names, "", 1);
+    w->count++;
+}
+
+/* path + name; with dir set, + '/' too */
+static void path_push(struct strbuf *path, const char *name, int dir) {
+    sb_add(path, name, strlen(name));
+    if (dir) sb_add(path, "/", 1);
+}
+
+static void path_pop(struct strbuf *path, size_t len) {
+    path->len = len;
+    path->s[len] = '\0';
+}
+
+/* A directory entry that is a directory. Symlinks are followed unless
+   nofollow is set, as a ** walk must not loop. */
+static int entry_is_dir(const struct linux_dirent64 *e, struct strbuf *path, int nofollow) {
+    if (e->d_type == DIRENT_DIR) return 1;
+    if (e->d_type != DIRENT_UNKNOWN && (e->d_type != DIRENT_LNK || nofollow)) return 0;
+    size_t base = path->len;
+    struct stat st;
+    path_push(path, e->d_name, 0);
+    int r = (nofollow ? lstat(path->s, &st) : stat(path->s, &st)) == 0 && S_ISDIR(st.st_mode);
+    path_pop(path, base);
+    return r;
+}
+
+/* The subtrees below one directory of a ** walk, shared by its threads */
+struct glob_share {
+    struct glob_walk *w;
+    const char *base;           // the directory's path
+    char **dirs;                // its subdirectories, with '/'
+    int ndirs, i;
+    int next;                   // next of dirs to take
+};
+
+static void *glob_worker(void *arg) {
+    struct glob_share *sh = arg;
+    struct glob_walk w = *sh->w;
+    struct strbuf path = { NULL, 0, 0 };
+    w.names = path;
+    w.count = 0;
+    w.threads = 1;
+    int k;
+    while ((k = __atomic_fetch_add(&sh->next, 1, __ATOMIC_RELAXED)) < sh->ndirs) {
+        path.len = 0;
+        sb_add(&path, sh->base, strlen(sh->base));
+        sb_add(&path, sh->dirs[k], strlen(sh->dirs[k]));
+        glob_walk(&w, &path, sh->i, 1);
+    }
+    free(path.s);
+    // hand the matches back through the share's walk struct
+    struct glob_walk *out = malloc(sizeof(*out));
+    *out = w;
+    return out;
+}
+
+/* Walk the subdirectories dirs of path with up to w->threads threads,
+   each taking the next subtree when it is done with one */
+static void glob_parallel(struct glob_walk *w, struct strbuf *path, int i, char **dirs, int ndirs) {
+    struct glob_share sh = { w, path->s, dirs, ndirs, i, 0 };
+    pthread_t tid[GLOB_THREADS];
+    int n = 0;
+    while (n < w->threads - 1 && n < ndirs - 1 && pthread_create(&tid[n], NULL, glob_worker, &sh) == 0) n++;
+    // whatever no thread took (all of it, if none started) is walked here
+    struct glob_walk *own = glob_worker(&sh);
+    for (int t = 0; t <= n; ++t) {
+        struct glob_walk *r = own;
+        if (t < n) pthread_join(tid[t], (void **)&r);
+        if (r) {
+            sb_add(&w->names, r->names.s ? r->names.s : "", r->names.len);
+            w->count += r->count;
+            free(r->names.s);
+            free(r);
+        }
+    }
+}
+
+/* Match comps[i..] below path, a directory prefix ending in '/' or "".
+   below: comps[i] is a ** that has already matched path's parent. */
+static void glob_walk(struct glob_walk *w, struct strbuf *path, int i, int below) {
+    struct glob_comp *c = &w->comps[i];
+    int last = i == w->ncomps - 1;
+    size_t base = path->len;
+    struct stat st;
+
+    if (c->kind == 0) {
+        // no pattern in it: no need to read the directory. A run of such
+        // components is taken in one go, not one recursion each.
+        for (;;) {
+            for (size_t k = 0; k < c->n; ++k) {
+                if (c->s[k] == '\\' && k + 1 < c->n) k++;
+                sb_add(path, c->s + k, 1);
+            }
+            if (last || c[1].kind != 0) break;
+            sb_add(path, "/", 1);
+            c++;
+            last = c - w->comps == w->ncomps - 1;
+        }
+        if (!last) {
+            sb_add(path, "/", 1);
+            glob_walk(w, path, c - w->comps + 1, 0);
+        } else if ((w->dirs_only ? stat(path->s, &st) == 0 && S_ISDIR(st.st_mode) : lstat(path->s, &st) == 0)) {
+            glob_add(w, path);
+        }
+        path_pop(path, base);
+        return;
+    }
+    // ** as no directory at all; a last one matches the directory itself
+    if (c->kind == 2 && !last) glob_walk(w, path, i + 1, 0);
+    else if (c->kind == 2 && base && !below) glob_add(w, path);
+
+    struct dir_cache *d = dir_read(base ? path->s : ".");
+    if (!d) return;
+    char **dirs = NULL;         // a parallel **'s subtrees
+    int ndirs = 0, cap = 0;
+    for (size_t off = 0; off < d->len; ) {
+        struct linux_dirent64 *e = (struct linux_dirent64 *)(d->ents + off);
+        off += e->d_reclen;
+        const char *name = e->d_name;
+        if (name[0] == '.' && (!name[1] || (name[1] == '.' && !name[2]))) continue;
+        // a leading dot is only matched by a pattern that starts with one
+        if (name[0] == '.' && (c->kind == 2 || c->s[0] != '.')) continue;
+        if (c->kind == 2) {
+            // **: every entry when it is last, and every subtree
+            int dir = entry_is_dir(e, path, 1);
+            if (last && (!w->dirs_only || dir)) {
+                path_push(path, name, 0);
+                glob_add(w, path);
+                path_pop(path, base);
+            }
+            if (!dir) continue;
+            if (w->threads > 1) {
+                if (ndirs == cap) dirs = realloc(dirs, (cap = cap ? cap * 2 : 64) * sizeof(char *));
+                dirs[ndirs] = malloc(strlen(name) + 2);
+                stpcpy(stpcpy(dirs[ndirs++], name), "/");
+                continue;
+            }
+            path_push(path, name, 1);
+            glob_walk(w, path, i, 1);
+            path_pop(path, base);
+            continue;
+        }
+        if (!glob_match(c->s, c->n, name)) continue;
+        if (last) {
+            if (w->dirs_only && !entry_is_dir(e, path, 0)) continue;
+            path_push(path, name, 0);
+            glob_add(w, path);
+            path_pop(path, base);
+        } else if (entry_is_dir(e, path, 0)) {
+            path_push(path, name, 1);
+            glob_walk(w, path, i + 1, 0);
+            path_pop(path, base);
+        }
+    }
+    dir_release(d);
+    if (ndirs) {
+        glob_parallel(w, path, i, dirs, ndirs);
+        for (int k = 0; k < ndirs; ++k) free(dirs[k]);
+    }
+    free(dirs);
+}
+
+static int cmp_path(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/* The paths pat matches, sorted, in *paths: one malloc'd block holding
+   the pointers and the strings. Returns how many; for none, 0 and no
+   block. Backslashes in pat escape the next character. */
+size_t glob_expand(const char *pat, char ***paths) {
+    size_t plen = strlen(pat), nslash = 0;
+    for (const char *p = pat; (p = strchr(p, '/')); ++p) nslash++;
+    // one component per '/'-separated part at most; not on the stack,
+    // as the word can be any length
+    struct glob_comp *comps = malloc((nslash + 1) * sizeof(*comps));
+    if (!comps) { perror("malloc"); exit(EXIT_FAILURE); }
+    struct glob_walk w = { comps, 0, 0, 1, { NULL, 0, 0 }, 0 };
+    for (const char *p = pat; *p; ) {
+        const char *q = p;
+        while (*q && *q != '/') q += (*q == '\\' && q[1] && q[1] != '/') ? 2 : 1;
+        if (q > p) {
+            struct glob_comp *c = &comps[w.ncomps++];
+            c->s = p;
+            c->n = q - p;
+            c->kind = (c->n == 2 && p[0] == '*' && p[1] == '*') ? 2 : glob_meta(p, c->n);
+        }
+        p = *q ? q + 1 : q;
+    }
+    if (!w.ncomps) { free(comps); return 0; }
+    w.dirs_only = pat[plen - 1] == '/';
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    w.threads = cpus < 1 ? 1 : cpus > GLOB_THREADS ? GLOB_THREADS : cpus;
+
+    // the cache is only trimmed here, between walks
+    if (dir_cache_n >= GLOB_CACHE_DIRS || dir_cache_bytes >= GLOB_CACHE_BYTES / 2) dir_cache_flush();
+    struct strbuf path = { NULL, 0, 0 };
+    sb_add(&path, "/", pat[0] == '/');
+    glob_walk(&w, &path, 0, 0);
+    free(path.s);
+    free(comps);
+    if (!w.count) {
+        free(w.names.s);
+        return 0;
+    }
+    char **v = malloc(w.count * sizeof(char *) + w.names.len);
+    if (!v) { perror("malloc"); exit(EXIT_FAILURE); }
+    char *names = memcpy(v + w.count, w.names.s, w.names.len);
+    for (size_t k = 0; k < w.count; ++k) {
+        v[k] = names;
+        names += strlen(names) + 1;
+    }
+    free(w.names.s);
+    qsort(v, w.count, sizeof(char *), cmp_path);
+    *paths = v;
+    return w.count;
+}
+
+/* ---------------- Completion ---------------- */
+/* Tab completes the first word of a command from a prefix trie of the
+   executables on $PATH and the builtins, and any other word as a file
+   name. The trie is built by a thread started at the first prompt, which
+   then sleeps on inotify watches of the PATH directories and swaps in a
+   rebuilt trie when one of them changes. A Tab never reads a PATH
+   directory: it is one walk down the trie, however many binaries there
+   are. */
+struct trie_node {
+    int child, next;            // first child and next sibling, 0 for none
+    unsigned count;             // names ending at or below this node
+    char c;
+    char term;                  // a name ends here
+};
+
+struct trie {
+    struct trie_node *nodes;    // [0] is the root
+    size_t n;
+};
+
+#define COMPLETE_EVENTS (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ATTRIB | \
+                         IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR)
+
+static pthread_mutex_t comp_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t comp_cond = PTHREAD_COND_INITIALIZER;
+static struct trie *comp_trie;          // the current trie, only used under comp_lock
+static char *comp_path;                 // the $PATH it is built from
+static int comp_pending;                // comp_path has no trie yet
+static int comp_wake[2] = { -1, -1 };   // tells the thread comp_path changed
+static int comp_started;                // 1 running, -1 could not start
+
+/* The trie of names, which are sorted and may repeat: a name shares its
+   prefix with the one before it, and every new node goes after the last
+   child of its parent, which was made for the name before. */
+static struct trie *trie_build(char **names, size_t n) {
+    struct trie *t = malloc(sizeof(*t));
+    size_t cap = 4096;
+    t->nodes = malloc(cap * sizeof(struct trie_node));
+    if (!t->nodes) { perror("malloc"); exit(EXIT_FAILURE); }
+    memset(&t->nodes[0], 0, sizeof(struct trie_node));
+    t->n = 1;
+    int at[257] = { 0 };        // the previous name's nodes by depth
+    const char *prev = "";
+    qsort(names, n, sizeof(char *), cmp_path);
+    for (size_t i = 0; i < n; ++i) {
+        const char *s = names[i];
+        size_t k = 0;
+        if (strlen(s) > 255 || strcmp(s, prev) == 0) continue;
+        while (s[k] && s[k] == prev[k]) k++;
+        for (size_t d = 0; d <= k; ++d) t->nodes[at[d]].count++;
+        for (int first = 1; s[k]; ++k, first = 0) {
+            if (t->n == cap) {
+                t->nodes = realloc(t->nodes, (cap *= 2) * sizeof(struct trie_node));
+                if (!t->nodes) { perror("malloc"); exit(EXIT_FAILURE); }
+            }
+            int node = t->n++;
+            t->nodes[node] = (struct trie_node){ 0, 0, 1, s[k], 0 };
+            if (first && prev[k]) t->nodes[at[k + 1]].next = node;
+            else t->nodes[at[k]].child = node;
+            at[k + 1] = node;
+        }
+        t->nodes[at[k]].term = 1;
+        prev = s;
+    }
+    return t;
+}
+
+static void trie_free(struct trie *t) {
+    if (!t) return;
+    free(t->nodes);
+    free(t);
+}
+
+/* The node spelling s[0..n), -1 if no name starts with it */
+static int trie_find(const struct trie *t, const char *s, size_t n) {
+    int node = 0;
+    for (size_t i = 0; i < n; ++i) {
+        int c = t->nodes[node].child;
+        while (c && t->nodes[c].c != s[i]) c = t->nodes[c].next;
+        if (!c) return -1;
+        node = c;
+    }
+    return node;
+}
+
+/* Up to *left of the names at or below node, which spells name[0..len),
+   into out in order, each NUL-terminated */
+static void trie_list(const struct trie *t, int node, char *name, size_t len,
+                      struct strbuf *out, size_t *left) {
+    if (t->nodes[node].term && *left) {
+        sb_add(out, name, len);
+        sb_add(out, "", 1);
+        --*left;
+    }
+    for (int c = t->nodes[node].child; c && *left; c = t->nodes[c].next) {
+        name[len] = t->nodes[c].c;
+        trie_list(t, c, name, len + 1, out, left);
+    }
+}
+
+/* Add the executables in dir to names, each NUL-terminated */
+static void comp_scan(const char *dir, struct strbuf *names, size_t *count) {
+    struct stat st;
+    if (stat(dir, &st) < 0 || !S_ISDIR(st.st_mode)) return;
+    struct dir_cache *d = dir_load(dir, &st);
+    int dfd = open(dir, O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (d && dfd >= 0) {
+        for (size_t off = 0; off < d->len; ) {
+            struct linux_dirent64 *e = (struct linux_dirent64 *)(d->ents + off);
+            off += e->d_reclen;
+            if (e->d_type == DIRENT_DIR) continue;
+            if (fstatat(dfd, e->d_name, &st, 0) < 0 || !S_ISREG(st.st_mode) || !(st.st_mode & 0111))
+                continue;
+            sb_add(names, e->d_name, strlen(e->d_name) + 1);
+            ++*count;
+        }
+    }
+    if (dfd >= 0) close(dfd);
+    free(d);
+}
+
+/* The trie of path's executables and the builtins. Each directory is
+   watched on ifd before it is read, so no change falls in between. */
+static struct trie *comp_build(const char *path, int ifd) {
+    struct strbuf names = { NULL, 0, 0 };
+    size_t count = 0;
+    for (const char *p = path; ; ) {
+        const char *q = strchrnul(p, ':');
+        char dir[4096];
+        snprintf(dir, sizeof(dir), "%.*s", (int)(q - p), p);
+        if (!dir[0]) strcpy(dir, ".");
+        if (ifd >= 0) inotify_add_watch(ifd, dir, COMPLETE_EVENTS);
+        comp_scan(dir, &names, &count);
+        if (!*q) break;
+        p = q + 1;
+    }
+    for (const char *const *b = builtin_names; *b; ++b) {
+        sb_add(&names, *b, strlen(*b) + 1);
+        count++;
+    }
+    char **v = malloc(count * sizeof(char *));
+    if (!v) { perror("malloc"); exit(EXIT_FAILURE); }
+    char *s = names.s;
+    for (size_t i = 0; i < count; ++i) {
+        v[i] = s;
+        s += strlen(s) + 1;
+    }
+    struct trie *t = trie_build(v, count);
+    free(v);
+    free(names.s);
+    return t;
+}
+
+static void *comp_thread(void *arg) {
+    (void)arg;
+    // signals are for the shell's own thread
+    sigset_t all;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, NULL);
+    char ev[4096];
+    while (1) {
+        pthread_mutex_lock(&comp_lock);
+        char *path = strdup(comp_path);
+        pthread_mutex_unlock(&comp_lock);
+        if (!path) { perror("malloc"); exit(EXIT_FAILURE); }
+        int ifd = inotify_init1(IN_CLOEXEC);
+        struct trie *t = comp_build(path, ifd);
+
+        pthread_mutex_lock(&comp_lock);
+        struct trie *old = comp_trie;
+        comp_trie = t;
+        if (strcmp(path, comp_path) == 0) comp_pending = 0;
+        pthread_cond_broadcast(&comp_cond);
+        pthread_mutex_unlock(&comp_lock);
+        trie_free(old);
+        free(path);
+
+        // sleep until $PATH or one of its directories changes; a burst of
+        // changes, like a package install, is waited out before rebuilding
+        struct pollfd pfd[2] = { { comp_wake[0], POLLIN, 0 }, { ifd, POLLIN, 0 } };
+        while (poll(pfd, 2, -1) < 0) ;
+        if (pfd[1].revents) {
+            for (int i = 0; i < 40 && read(ifd, ev, sizeof(ev)) > 0 && poll(&pfd[1], 1, 50) > 0; ++i) ;
+        }
+        while (read(comp_wake[0], ev, sizeof(ev)) > 0) ;
+        if (ifd >= 0) close(ifd);
+    }
+    return NULL;
+}
+
+/* Hand the trie thread $PATH, starting it the first time. Called at
+   every prompt, so a changed PATH is picked up before the next Tab. */
+void complete_prompt() {
+    const char *path = var_get("PATH");
+    if (!path) path = "";
+    pthread_mutex_lock(&comp_lock);
+    int changed = comp_started >= 0 && (!comp_path || strcmp(comp_path, path) != 0);
+    if (changed) {
+        free(comp_path);
+        comp_path = strdup(path);
+        if (!comp_path) { perror("malloc"); exit(EXIT_FAILURE); }
+        comp_pending = 1;
+    }
+    pthread_mutex_unlock(&comp_lock);
+
+    if (!comp_started) {
+        pthread_t tid;
+        if (pipe2(comp_wake, O_CLOEXEC | O_NONBLOCK) < 0 ||
+            pthread_create(&tid, NULL, comp_thread, NULL) != 0) {
+            // no thread, no trie: only file names are completed
+            pthread_mutex_lock(&comp_lock);
+            comp_started = -1;
+            comp_pending = 0;
+            pthread_mutex_unlock(&comp_lock);
+            return;
+        }
+        pthread_detach(tid);
+        comp_started = 1;
+    } else if (changed) {
+        char c = 1;
+        if (write(comp_wake[1], &c, 1) < 0) { /* a wake-up is already queued */ }
+    }
+}
+
+/* The candidates for word[0..n), already unquoted; command says it is
+   the first word of a command. Returns how many there are. *common gets
+   their longest common prefix from past the word's last '/' on, and
+   names up to limit of them, each NUL-terminated; a directory has a '/'
+   added in both. */
+size_t complete_word(const char *word, size_t n, int command, struct strbuf *common,
+                     struct strbuf *names, size_t limit) {
+    size_t count = 0;
+    const char *slash = memrchr(word, '/', n);
+    if (command && !slash) {
+        pthread_mutex_lock(&comp_lock);
+        while (comp_pending) pthread_cond_wait(&comp_cond, &comp_lock);
+        struct trie *t = comp_trie;
+        int node = t ? trie_find(t, word, n) : -1;
+        if (node >= 0) {
+            count = t->nodes[node].count;
+            sb_add(common, word, n);
+            // down while there is just one way to go
+            for (int k = node; !t->nodes[k].term && t->nodes[k].child &&
+                               !t->nodes[t->nodes[k].child].next; ) {
+                k = t->nodes[k].child;
+                sb_add(common, &t->nodes[k].c, 1);
+            }
+            char name[257];
+            memcpy(name, word, n);
+            if (names) trie_list(t, node, name, n, names, &limit);
+        }
+        pthread_mutex_unlock(&comp_lock);
+        return count;
+    }
+
+    size_t dlen = slash ? (size_t)(slash - word) + 1 : 0;
+    const char *base = word + dlen;
+    size_t blen = n - dlen;
+    struct strbuf dir = { NULL, 0, 0 };
+    sb_add(&dir, word, dlen);
+    struct dir_cache *d = dir_read(dlen ? dir.s : ".");
+    struct linux_dirent64 *one = NULL;
+    for (size_t off = 0; d && off < d->len; ) {
+        struct linux_dirent64 *e = (struct linux_dirent64 *)(d->ents + off);
+        off += e->d_reclen;
+        const char *name = e->d_name;
+        if (name[0] == '.' && (!name[1] || (name[1] == '.' && !name[2]))) continue;
+        if (name[0] == '.' && (!blen || base[0] != '.')) continue;
+        if (strncmp(name, base, blen) != 0) continue;
+        if (!count++) {
+            one = e;
+            sb_add(common, name, strlen(name));
+        } else {
+            size_t k = blen;
+            while (k < common->len && common->s[k] == name[k]) k++;
+            common->s[common->len = k] = '\0';
+        }
+        if (names && limit) {
+            limit--;
+            sb_add(names, name, strlen(name));
+            if (entry_is_dir(e, &dir, 0)) sb_add(names, "/", 1);
+            sb_add(names, "", 1);
+        }
+    }
+    if (count == 1 && entry_is_dir(one, &dir, 0)) sb_add(common, "/", 1);
+    if (d) dir_release(d);
+    free(dir.s);
+    return count;
+}
+
+/* The NUL-terminated strings in sb as a malloc'd, sorted array */
+static char **comp_sorted(struct strbuf *sb, size_t *n) {
+    *n = 0;
+    for (size_t off = 0; off < sb->len; off += strlen(sb->s + off) + 1) ++*n;
+    char **v = malloc((*n + 1) * sizeof(char *));
+    if (!v) { perror("malloc"); exit(EXIT_FAILURE); }
+    size_t i = 0;
+    for (size_t off = 0; off < sb->len; off += strlen(sb->s + off) + 1) v[i++] = sb->s + off;
+    qsort(v, *n, sizeof(char *), cmp_path);
+    return v;
+}
+
+/* Print the candidates below the line in columns, down then across */
+static void complete_list(const char *word, size_t n, int command, size_t count) {
+    if (count > COMPLETE_ASK) {
+        char ask[64];
+        editor_puts(ask, snprintf(ask, sizeof(ask), "\r\nDisplay all %zu possibilities? (y or n)", count));
+        int c = editor_getc();
+        if (c != 'y' && c != 'Y') {
+            editor_puts("\r\n", 2);
+            return;
+        }
+    }
+    struct strbuf common = { NULL, 0, 0 }, names = { NULL, 0, 0 }, out = { NULL, 0, 0 };
+    complete_word(word, n, command, &common, &names, count);
+    size_t k, width = 0;
+    char **v = comp_sorted(&names, &k);
+    for (size_t i = 0; i < k; ++i) if (strlen(v[i]) + 2 > width) width = strlen(v[i]) + 2;
+    struct winsize ws;
+    size_t screen = ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_col ? ws.ws_col : 80;
+    size_t cols = width && screen / width ? screen / width : 1;
+    size_t rows = (k + cols - 1) / cols;
+    sb_add(&out, "\r\n", 2);
+    for (size_t r = 0; r < rows; ++r) {
+        for (size_t c = 0; c < cols && c * rows + r < k; ++c) {
+            const char *s = v[c * rows + r];
+            sb_add(&out, s, strlen(s));
+            if ((c + 1) * rows + r < k)
+                for (size_t pad = strlen(s); pad < width; ++pad) sb_add(&out, " ", 1);
+        }
+        sb_add(&out, "\r\n", 2);
+    }
+    editor_puts(out.s, out.len);
+    free(v);
+    free(common.s);
+    free(names.s);
+    free(out.s);
+}
+
+/* Tab at *pos: complete the word before it as far as its candidates
+   agree, with a space after one that is complete. tabs counts the Tabs in
+   a row; from the second on, candidates that do not agree are listed. */
+void complete_line(struct strbuf *line, size_t *pos, int tabs) {
+    char *buf = line->s;
+    size_t start = *pos;
+    while (start > 0 && !strchr(" \t;|&<>()", buf[start - 1])) start--;
+    while (start >= 2 && buf[start - 2] == '\\' && (buf[start - 1] == ' ' || buf[start - 1] == '\t')) {
+        // an escaped blank belongs to the word
+        start -= 2;
+        while (start > 0 && !strchr(" \t;|&<>()", buf[start - 1])) start--;
+    }
+    size_t j = start;
+    while (j > 0 && (buf[j - 1] == ' ' || buf[j - 1] == '\t')) j--;
+    int command = j == 0 || strchr(";|&(", buf[j - 1]);
+
+    // the word as it will be expanded; quote characters are dropped
+    char *word = arena_alloc(*pos - start + 1);
+    size_t n = 0;
+    char quote = 0;
+    for (size_t i = start; i < *pos; ++i) {
+        char c = buf[i];
+        if (quote ? c == quote : c == '\'' || c == '"') quote = quote ? 0 : c;
+        else if (!quote && c == '\\' && i + 1 < *pos) word[n++] = buf[++i];
+        else word[n++] = c;
+    }
+    if (memchr(word, '$', n) || memchr(word, '`', n)) {
+        editor_puts("\a", 1);
+        return;
+    }
+
+    struct strbuf common = { NULL, 0, 0 }, ins = { NULL, 0, 0 };
+    size_t count = complete_word(word, n, command, &common, NULL, 0);
+    const char *slash = memrchr(word, '/', n);
+    size_t tail = slash ? n - (slash - word) - 1 : n;
+    for (size_t i = tail; i < common.len; ++i) {
+        if (!quote && strchr(" \t\\'\"$`|&;<>()*?[!", common.s[i])) sb_add(&ins, "\\", 1);
+        sb_add(&ins, common.s + i, 1);
+    }
+    if (count == 1 && (!common.len || common.s[common.len - 1] != '/')) {
+        if (quote) sb_add(&ins, &quote, 1);
+        sb_add(&ins, " ", 1);
+    }
+    if (ins.len) {
+        sb_room(line, ins.len);
+        memmove(line->s + *pos + ins.len, line->s + *pos, line->len - *pos);
+        memcpy(line->s + *pos, ins.s, ins.len);
+        line->len += ins.len;
+        *pos += ins.len;
+    } else if (count > 1 && tabs > 1) {
+        complete_list(word, n, command, count);
+    } else {
+        editor_puts("\a", 1);
+    }
+    free(common.s);
+    free(ins.s);
+}
+
+/* compgen -c [prefix]   commands starting with prefix
+   compgen -f [prefix]   file names starting with prefix
+   One per line, sorted: what Tab would offer. Returns 1 for none. */
+int builtin_compgen(char **args, struct outbuf *out) {
+    int command = args[1] && strcmp(args[1], "-c") == 0;
+    if (!args[1] || (!command && strcmp(args[1], "-f") != 0)) {
+        fprintf(stderr, "compgen: usage: compgen -c|-f [prefix]\n");
+        return 2;
+    }
+    const char *word = args[2] ? args[2] : "";
+    if (command) complete_prompt();
+    struct strbuf common = { NULL, 0, 0 }, names = { NULL, 0, 0 };
+    size_t count = complete_word(word, strlen(word), command, &common, &names, (size_t)-1);
+    const char *slash = strrchr(word, '/');
+    int dlen = slash ? (int)(slash - word) + 1 : 0;
+    size_t k;
+    char **v = comp_sorted(&names, &k);
+    for (size_t i = 0; i < k; ++i) ob_printf(out, "%.*s%s\n", dlen, word, v[i]);
+    free(v);
+    free(common.s);
+    free(names.s);
+    return count ? 0 : 1;
+}
+
+/* ---------------- Prompt ---------------- */
+/* The prompt is $PS1, "myshell:\w> " when unset, and each backslash
+   escape in it is a segment:
+     \w  working directory      \W  its last component
+     \?  status of the last command
+     \D  how long the last command took
+     \j  number of jobs
+     \g  git branch, with a * when the work tree is dirty
+     \\  a backslash
+   The working directory is cached and only cd changes it, so drawing the
+   prompt makes no system call. A segment with a compute function, like
+   \g, may be slow (git status in a big tree): it is run on the prompt
+   thread while the prompt is already up, which shows its last result for
+   the same directory meanwhile and is redrawn when a different one comes
+   in. A git that has not answered within PROMPT_TIMEOUT_MS is killed. */
+#define PROMPT_TIMEOUT_MS 1000
+#define PROMPT_STACK (64 * 1024)        // for the clone() that runs git
+#ifndef P_PIDFD
+#define P_PIDFD 3
+#endif
+
+/* What the prompt thread computes for: snapshots taken by the shell */
+struct prompt_req {
+    char *dir;
+    char *git;                  // hash_lookup("git"), NULL if there is none
+    char **env;                 // the environment, in one block
+    unsigned mask;              // segments wanted, by index
+};
+
+struct prompt_segment {
+    char key;                   // the character after the backslash
+    void (*render)(struct strbuf *out);
+    // slow segments: on the prompt thread; -1 keeps the last result
+    int (*compute)(const struct prompt_req *rq, struct strbuf *out);
+    struct strbuf value;        // the last result, under prompt_lock
+    char *dir;                  // the directory it was computed in
+};
+
+static pthread_mutex_t prompt_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t prompt_cond = PTHREAD_COND_INITIALIZER;
+static struct prompt_req prompt_want;   // the latest request, under prompt_lock
+static unsigned prompt_gen, prompt_done; // requests made and answered
+static int prompt_wake[2] = { -1, -1 }; // a new result wants a redraw
+static int prompt_started;              // 1 running, -1 could not start
+
+/* Refresh the cached working directory; the cd builtin calls it */
+void cwd_update() {
+    free(shell_cwd);
+    shell_cwd = getcwd(NULL, 0);
+    cwd_gen++;
+}
+
+static void seg_cwd(struct strbuf *out) {
+    sb_add(out, shell_cwd ? shell_cwd : "?", shell_cwd ? strlen(shell_cwd) : 1);
+}
+
+static void seg_cwd_base(struct strbuf *out) {
+    const char *base = shell_cwd ? strrchr(shell_cwd, '/') : NULL;
+    if (!base) sb_add(out, "?", 1);
+    else if (!base[1]) sb_add(out, "/", 1);
+    else sb_add(out, base + 1, strlen(base + 1));
+}
+
+static void seg_status(struct strbuf *out) {
+    char n[16];
+    sb_add(out, n, snprintf(n, sizeof(n), "%d", last_status));
+}
+
+static void seg_duration(struct strbuf *out) {
+    char d[32];
+    uint64_t ms = last_command_ns / 1000000;
+    if (ms < 1000) sb_add(out, d, snprintf(d, sizeof(d), "%lums", (unsigned long)ms));
+    else if (ms < 60000) sb_add(out, d, snprintf(d, sizeof(d), "%.1fs", ms / 1e3));
+    else sb_add(out, d, snprintf(d, sizeof(d), "%lum%lus", (unsigned long)(ms / 60000),
+                                 (unsigned long)(ms / 1000 % 60)));
+}
+
+static void seg_jobs(struct strbuf *out) {
+    char n[16];
+    int count = 0;
+    for (int i = 0; i < job_top; ++i) count += job_table[i] != NULL;
+    sb_add(out, n, snprintf(n, sizeof(n), "%d", count));
+}
+
+struct git_child {
+    const char *path;
+    char **argv, **env;
+    int out, null;
+};
+
+/* The clone() child: a vfork that shares our memory until the exec */
+static int git_exec(void *arg) {
+    struct git_child *g = arg;
+    sigset_t none;
+    sigemptyset(&none);
+    sigprocmask(SIG_SETMASK, &none, NULL);
+    if (dup2(g->null, STDIN_FILENO) >= 0 && dup2(g->out, STDOUT_FILENO) >= 0 &&
+        dup2(g->null, STDERR_FILENO) >= 0)
+        execve(g->path, g->argv, g->env);
+    _exit(127);
+}
+
+/* \g from "git status --porcelain -b": its first line is "## branch...",
+   and any line after that is a change, so reading stops at the first
+   one. git is held by a pidfd: job_reap() may reap it from under us, but
+   a kill can never reach a process that reused its pid. */
+static int seg_git(const struct prompt_req *rq, struct strbuf *out) {
+    static char *stack;
+    if (!rq->git) return 0;
+    if (!stack && !(stack = malloc(PROMPT_STACK))) return -1;
+    int p[2];
+    if (pipe2(p, O_CLOEXEC) < 0) return -1;
+    int null = open("/dev/null", O_RDWR | O_CLOEXEC);
+    char *argv[] = { "git", "--no-optional-locks", "-C", rq->dir, "status", "--porcelain", "-b",
+                     "--ignore-submodules", NULL };
+    struct git_child g = { rq->git, argv, rq->env, p[1], null };
+    int pidfd = -1;
+    pid_t pid = clone(git_exec, stack + PROMPT_STACK, CLONE_VM | CLONE_VFORK | CLONE_PIDFD | SIGCHLD,
+                      &g, &pidfd);
+    close(p[1]);
+    if (null >= 0) close(null);
+    if (pid < 0) { close(p[0]); return -1; }
+
+    char buf[4096];
+    size_t n = 0;
+    int dirty = 0, late = 0;
+    uint64_t deadline = trace_now() + PROMPT_TIMEOUT_MS * 1000000ull;
+    while (n < sizeof(buf)) {
+        uint64_t now = trace_now();
+        struct pollfd pfd = { p[0], POLLIN, 0 };
+        if (now >= deadline || poll(&pfd, 1, (deadline - now + 999999) / 1000000) == 0) { late = 1; break; }
+        ssize_t r = read(p[0], buf + n, sizeof(buf) - n);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) break;
+        n += r;
+        const char *nl = memchr(buf, '\n', n);
+        if (nl && nl + 1 < buf + n) { dirty = 1; break; }
+    }
+    close(p[0]);
+    if (late || dirty) syscall(SYS_pidfd_send_signal, pidfd, SIGKILL, NULL, 0);
+    siginfo_t si;
+    while (waitid(P_PIDFD, pidfd, &si, WEXITED) < 0 && errno == EINTR) ;
+    close(pidfd);
+    if (late) return -1;
+
+    // not a repository: no output at all
+    if (n < 3 || memcmp(buf, "## ", 3) != 0) return 0;
+    const char *b = buf + 3, *end = memchr(b, '\n', n - 3);
+    if (!end) end = buf + n;
+    if ((size_t)(end - b) > 18 && memcmp(b, "No commits yet on ", 18) == 0) b += 18;
+    // a branch name has no blanks and no ".."
+    const char *e = b;
+    while (e < end && *e != ' ' && !(e[0] == '.' && e + 1 < end && e[1] == '.')) e++;
+    sb_add(out, b, e - b);
+    if (dirty) sb_add(out, "*", 1);
+    return 0;
+}
+
+static struct prompt_segment prompt_segments[] = {
+    { 'w', seg_cwd, NULL, { NULL, 0, 0 }, NULL },
+    { 'W', seg_cwd_base, NULL, { NULL, 0, 0 }, NULL },
+    { '?', seg_status, NULL, { NULL, 0, 0 }, NULL },
+    { 'D', seg_duration, NULL, { NULL, 0, 0 }, NULL },
+    { 'j', seg_jobs, NULL, { NULL, 0, 0 }, NULL },
+    { 'g', NULL, seg_git, { NULL, 0, 0 }, NULL },
+};
+
+#define PROMPT_SEGMENTS (sizeof(prompt_segments) / sizeof(prompt_segments[0]))
+
+static void prompt_req_free(struct prompt_req *rq) {
+    free(rq->dir);
+    free(rq->git);
+    free(rq->env);
+    memset(rq, 0, sizeof(*rq));
+}
+
+static void *prompt_thread(void *arg) {
+    (void)arg;
+    // signals are for the shell's own thread
+    sigset_t all;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, NULL);
+    pthread_mutex_lock(&prompt_lock);
+    while (1) {
+        while (prompt_done == prompt_gen) pthread_cond_wait(&prompt_cond, &prompt_lock);
+        unsigned gen = prompt_gen;
+        struct prompt_req rq = prompt_want;
+        memset(&prompt_want, 0, sizeof(prompt_want));
+        pthread_mutex_unlock(&prompt_lock);
+
+        int changed = 0;
+        for (size_t i = 0; i < PROMPT_SEGMENTS; ++i) {
+            struct prompt_segment *seg = &prompt_segments[i];
+            if (!(rq.mask & 1u << i)) continue;
+            struct strbuf v = { NULL, 0, 0 };
+            sb_room(&v, 0);
+            v.s[0] = '\0';
+            if (seg->compute(&rq, &v) < 0) { free(v.s); continue; }
+            pthread_mutex_lock(&prompt_lock);
+            if (!seg->dir || strcmp(seg->dir, rq.dir) != 0 || seg->value.len != v.len ||
+                memcmp(seg->value.s, v.s, v.len) != 0) {
+                struct strbuf old = seg->value;
+                seg->value = v;
+                v = old;
+                free(seg->dir);
+                seg->dir = strdup(rq.dir);
+                changed = 1;
+            }
+            pthread_mutex_unlock(&prompt_lock);
+            free(v.s);
+        }
+        prompt_req_free(&rq);
+
+        pthread_mutex_lock(&prompt_lock);
+        prompt_done = gen;
+        // only a result for the prompt on screen is worth a redraw
+        char c = 1;
+        if (changed && gen == prompt_gen && write(prompt_wake[1], &c, 1) < 0) {
+            /* a redraw is already queued */
+        }
+    }
+    return NULL;
+}
+
+/* The exported environment, copied into one block the thread can free */
+static char **env_copy() {
+    char **env = var_envp();
+    size_t n = 0, bytes = 0;
+    for (; env[n]; ++n) bytes += strlen(env[n]) + 1;
+    char **copy = malloc((n + 1) * sizeof(char *) + bytes);
+    if (!copy) return NULL;
+    char *s = (char *)(copy + n + 1);
+    for (size_t i = 0; i < n; ++i) {
+        copy[i] = s;
+        s = stpcpy(s, env[i]) + 1;
+    }
+    copy[n] = NULL;
+    return copy;
+}
+
+/* Where git is, for the git segment. It is looked up on PATH apart from
+   the command hash, so drawing a prompt never adds to what hash lists,
+   and looked up again when PATH changes or it was not found. */
+static const char *prompt_git() {
+    static char *git, *seen;
+    const char *path = var_get("PATH");
+    if (!path) path = "";
+    if (!git || !seen || strcmp(path, seen) != 0) {
+        free(git);
+        free(seen);
+        git = search_path("git");
+        seen = strdup(path);
+    }
+    return git;
+}
+
+/* Hand the slow segments of this prompt to the thread, starting it the
+   first time */
+static void prompt_request(unsigned mask) {
+    if (prompt_started < 0) return;
+    if (!prompt_started) {
+        pthread_t tid;
+        if (pipe2(prompt_wake, O_CLOEXEC | O_NONBLOCK) < 0 ||
+            pthread_create(&tid, NULL, prompt_thread, NULL) != 0) {
+            // no thread: slow segments stay empty
+            prompt_started = -1;
+            return;
+        }
+        pthread_detach(tid);
+        prompt_started = 1;
+    }
+    const char *git = prompt_git();
+    pthread_mutex_lock(&prompt_lock);
+    prompt_req_free(&prompt_want);
+    prompt_want.dir = strdup(shell_cwd);
+    prompt_want.git = git ? strdup(git) : NULL;
+    prompt_want.env = env_copy();
+    prompt_want.mask = mask;
+    if (!prompt_want.dir || !prompt_want.env) {
+        prompt_req_free(&prompt_want);
+        prompt_want.mask = 0;
+    }
+    prompt_gen++;
+    pthread_cond_signal(&prompt_cond);
+    pthread_mutex_unlock(&prompt_lock);
+}
+
+/* Expand $PS1 into prompt_buf, the slow segments as they were last
+   computed for this directory. Returns those segments, by index, for
+   prompt_request(); the line editor redraws with it when
+   prompt_wake_fd() says a result came in. */
+unsigned prompt_render() {
+    static struct strbuf out;
+    if (prompt_wake[0] >= 0) {
+        char drain[64];
+        while (read(prompt_wake[0], drain, sizeof(drain)) > 0) ;
+    }
+    const char *ps1 = var_get("PS1");
+    if (!ps1) ps1 = "myshell:\\w> ";
+    if (!shell_cwd) cwd_update();
+    out.len = 0;
+    sb_room(&out, 0);
+    unsigned mask = 0;
+    pthread_mutex_lock(&prompt_lock);
+    for (const char *p = ps1; *p; ++p) {
+        if (*p != '\\' || !p[1]) { sb_add(&out, p, 1); continue; }
+        size_t i = 0;
+        while (i < PROMPT_SEGMENTS && prompt_segments[i].key != p[1]) ++i;
+        if (p[1] == '\\') {
+            sb_add(&out, p, 1);
+        } else if (i == PROMPT_SEGMENTS) {
+            sb_add(&out, p, 2);
+        } else if (prompt_segments[i].render) {
+            prompt_segments[i].render(&out);
+        } else {
+            struct prompt_segment *seg = &prompt_segments[i];
+            if (seg->dir && shell_cwd && strcmp(seg->dir, shell_cwd) == 0)
+                sb_add(&out, seg->value.s, seg->value.len);
+            mask |= 1u << i;
+        }
+        ++p;
+    }
+    pthread_mutex_unlock(&prompt_lock);
+    snprintf(prompt_buf, sizeof(prompt_buf), "%s", out.s);
+    return shell_cwd ? mask : 0;
+}
+
+/* Readable when a slow segment has a new result; -1 before the first */
+int prompt_wake_fd() {
+    return prompt_wake[0];
+}
+
+/* Print prompt; the slow segments are asked for once it is out, so
+   git does not compete with drawing it */
+void print_prompt() {
+    unsigned mask = prompt_render();
+    printf("%s", prompt_buf);
+    fflush(stdout);
+    if (mask) prompt_request(mask);
+}
+
+/* ---------------- Spawn engine ---------------- */
+
+/* Launch an external command with posix_spawn. glibc implements it with
+   clone(CLONE_VM|CLONE_VFORK), so the child never copies the shell's page
+   tables and launch cost no longer grows with the shell. in_fd/out_fd of -1
+   mean "inherit". Every other fd the shell opens is O_CLOEXEC, so the only
+   file actions needed are the two dup2s. The binary comes from the command
+   hash, so the child does a single execve instead of probing every PATH
+   entry. With job control the child joins process group pgid (0 starts a
+   new one) and gets back the signals the shell ignores. Returns the child
+   pid or -1; spawn_status then holds the status the command gets. */
+
+/* 127 for a command that is not there, 126 for one that will not run */
+static void spawn_failed(const char *name, int err) {
+    if (err == ENOENT) fprintf(stderr, "%s: command not found\n", name);
+    else fprintf(stderr, "%s: %s\n", name, strerror(err));
+    spawn_status = err == ENOENT ? 127 : 126;
+}
+
+/* An executable the kernel will not run (ENOEXEC) is a script without
+   "#!": like execvp, hand it to /bin/sh. Returns a malloc'd argv. */
+static char **spawn_sh_args(const char *path, char **args) {
+    int n = 0;
+    while (args[n]) ++n;
+    char **argv = malloc((n + 2) * sizeof(char *));
+    if (!argv) { perror("malloc"); exit(EXIT_FAILURE); }
+    argv[0] = "/bin/sh";
+    argv[1] = (char *)path;
+    memcpy(argv + 2, args + 1, n * sizeof(char *));
+    return argv;
+}
+
+pid_t spawn_command(char **args, int in_fd, int out_fd, pid_t pgid) {
+    posix_spawn_file_actions_t fa;
+    posix_spawn_file_actions_init(&fa);
+    if (in_fd != -1 && in_fd != STDIN_FILENO)
+        posix_spawn_file_actions_adddup2(&fa, in_fd, STDIN_FILENO);
+    if (out_fd != -1 && out_fd != STDOUT_FILENO)
+        posix_spawn_file_actions_adddup2(&fa, out_fd, STDOUT_FILENO);
+    posix_spawnattr_t attr;
+    posix_spawnattr_init(&attr);
+    if (job_control) {
+        sigset_t def;
+        sigemptyset(&def);
+        sigaddset(&def, SIGQUIT);
+        sigaddset(&def, SIGTSTP);
+        sigaddset(&def, SIGTTIN);
+        sigaddset(&def, SIGTTOU);
+        posix_spawnattr_setsigdefault(&attr, &def);
+        posix_spawnattr_setpgroup(&attr, pgid);
+        posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP | POSIX_SPAWN_SETSIGDEF);
+    }
+
+    pid_t pid;
+    int err = ENOENT;
+    const char *path = hash_lookup(args[0]);
+    if (path) {
+        err = posix_spawn(&pid, path, &fa, &attr, args, var_envp());
+        if (err == ENOENT && path != args[0]) {
+            // binary moved or was removed since it was hashed: look again
+            hash_forget(args[0]);
+            path = hash_lookup(args[0]);
+            if (path) err = posix_spawn(&pid, path, &fa, &attr, args, var_envp());
+        }
+        if (err == ENOEXEC) {
+            char **sh = spawn_sh_args(path, args);
+            err = posix_spawn(&pid, sh[0], &fa, &attr, sh, var_envp());
+            free(sh);
+        }
+    }
+    posix_spawn_file_actions_destroy(&fa);
+    posix_spawnattr_destroy(&attr);
+    if (err != 0) {
+        spawn_failed(args[0], err);
+        return -1;
+    }
+    return pid;
+}
+
+/* Run a builtin stage, or with args NULL a stage that only moves bytes */
+int run_stage(char **args, int in_fd, int out_fd) {
+    if (args) return run_builtin(args, in_fd, out_fd);
+    if (copy_fd(in_fd, out_fd) < 0 && errno != EPIPE) {
+        fprintf(stderr, "copy: %s\n", strerror(errno));
+        return 1;
+    }
+    return 0;
+}
+
+/* Builtin stages that cannot run on a helper thread (see execute_pipeline)
+   keep the classic fork() path; args NULL is a copy stage, as for
+   run_stage(). close_fds lists pipe fds the child
+   must drop (it never execs, so O_CLOEXEC does not help here). A
+   foreground stage that reads the terminal (tty) takes it for its job
+   itself rather than racing job_wait() to the first read. */
+pid_t fork_builtin(char **args, int in_fd, int out_fd, pid_t pgid, const int *close_fds, int nclose, int tty) {
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+        if (tty && job_control) {
+            // SIGTTOU is still ignored here
+            setpgid(0, pgid);
+            tcsetpgrp(STDIN_FILENO, getpgrp());
+        }
+        job_child_setup(pgid);
+        if (in_fd != -1) dup2(in_fd, STDIN_FILENO);
+        if (out_fd != -1) dup2(out_fd, STDOUT_FILENO);
+        for (int k = 0; k < nclose; ++k) close(close_fds[k]);
+        child_exit(run_stage(args, STDIN_FILENO, STDOUT_FILENO));
+    }
+    if (pid < 0) perror("fork");
+    else if (job_control) setpgid(pid, pgid ? pgid : pid);   // same as the child, whoever runs first
+    return pid;
+}
+
+/* ---------------- Copy engine ---------------- */
+
+/* Move everything from in_fd to out_fd without it passing through user
+   space where the kernel allows: splice() when either end is a pipe,
+   copy_file_range() between regular files, sendfile() from a regular file,
+   read/write for the rest. Returns 0, or -1 with errno set. */
+int copy_fd(int in_fd, int out_fd) {
+    struct stat si, so;
+    if (fstat(in_fd, &si) < 0 || fstat(out_fd, &so) < 0) return -1;
+    ssize_t n;
+
+    if (S_ISFIFO(si.st_mode) || S_ISFIFO(so.st_mode)) {
+        while ((n = splice(in_fd, NULL, out_fd, NULL, 1 << 20, SPLICE_F_MOVE | SPLICE_F_MORE)) > 0 ||
+               (n < 0 && errno == EINTR)) ;
+        if (n == 0) return 0;
+        if (errno != EINVAL) return -1;     // e.g. O_APPEND output: fall back
+    } else if (S_ISREG(si.st_mode) && S_ISREG(so.st_mode) && !(fcntl(out_fd, F_GETFL) & O_APPEND)) {
+        // copy_file_range() refuses O_APPEND output (">>") with EBADF
+        while ((n = copy_file_range(in_fd, NULL, out_fd, NULL, 1 << 30, 0)) > 0 ||
+               (n < 0 && errno == EINTR)) ;
+        if (n == 0) return 0;
+        if (errno != EXDEV && errno != EINVAL && errno != ENOSYS && errno != EOPNOTSUPP) return -1;
+    }
+    if (S_ISREG(si.st_mode)) {
+        while ((n = sendfile(out_fd, in_fd, NULL, 1 << 30)) > 0 || (n < 0 && errno == EINTR)) ;
+        if (n == 0) return 0;
+        if (errno != EINVAL && errno != ENOSYS) return -1;
+    }
+
+    char buf[65536];
+    while ((n = read(in_fd, buf, sizeof(buf))) != 0) {
+        if (n < 0) {
+            if (errno == EINTR && !sigint_pending) continue;
+            return -1;          // Ctrl-C stops a cat reading the terminal
+        }
+        for (ssize_t w = 0, k; w < n; w += k) {
+            k = write(out_fd, buf + w, n - w);
+            if (k < 0 && errno == EINTR) { k = 0; continue; }
+            if (k < 0) return -1;
+        }
+    }
+    return 0;
+}
+
+/* cat [file...]: each file ("-" or none: stdin) copied to stdout by
+   copy_fd(), so "cat a > b" is a copy_file_range() and "cat a | grep x"
+   a splice(), with no process launched. Flags go to /bin/cat. */
+int builtin_cat(char **args, int in_fd, struct outbuf *out) {
+    static char *stdin_only[] = { "cat", "-", NULL };
+    if (!args[1]) args = stdin_only;
+    ob_flush(out);
+    struct stat so;
+    int have_out = fstat(out->fd, &so) == 0;
+    int status = 0;
+    for (int i = 1; args[i]; ++i) {
+        int is_stdin = strcmp(args[i], "-") == 0;
+        int fd = is_stdin ? in_fd : open(args[i], O_RDONLY | O_CLOEXEC);
+        struct stat si;
+        if (fd < 0 || fstat(fd, &si) < 0) {
+            fprintf(stderr, "cat: %s: %s\n", args[i], strerror(errno));
+            status = 1;
+            continue;
+        }
+        if (S_ISDIR(si.st_mode)) {
+            fprintf(stderr, "cat: %s: Is a directory\n", args[i]);
+            status = 1;
+        } else if (have_out && S_ISREG(si.st_mode) && si.st_dev == so.st_dev && si.st_ino == so.st_ino) {
+            // "cat a >> a" would never end
+            fprintf(stderr, "cat: %s: input file is output file\n", args[i]);
+            status = 1;
+        } else if (copy_fd(fd, out->fd) < 0) {
+            int err = errno;
+            if (!is_stdin) close(fd);
+            if (err == EPIPE) return 128 + SIGPIPE;    // reader went away, as /bin/cat dies
+            if (err == EINTR) return 130;
+            fprintf(stderr, "cat: %s: %s\n", args[i], strerror(err));
+            return 1;
+        }
+        if (!is_stdin) close(fd);
+    }
+    return status;
+}
+
+/* Copy the open file in (src, with status si) to dst; closes in */
+static int cp_to(int in, const struct stat *si, const char *src, const char *dst) {
+    struct stat sd;
+    if (stat(dst, &sd) == 0 && sd.st_dev == si->st_dev && sd.st_ino == si->st_ino) {
+        fprintf(stderr, "cp: '%s' and '%s' are the same file\n", src, dst);
+        close(in);
+        return 1;
+    }
+    int out = open(dst, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, si->st_mode & 07777);
+    if (out < 0) {
+        fprintf(stderr, "cp: cannot create regular file '%s': %s\n", dst, strerror(errno));
+        close(in);
+        return 1;
+    }
+    int status = 0;
+    if (copy_fd(in, out) < 0) {
+        fprintf(stderr, "cp: error copying '%s' to '%s': %s\n", src, dst, strerror(errno));
+        status = 1;
+    }
+    close(in);
+    if (close(out) < 0 && !status) {
+        fprintf(stderr, "cp: error writing '%s': %s\n", dst, strerror(errno));
+        status = 1;
+    }
+    return status;
+}
+
+static int cp_one(const char *src, const char *dst, int into_dir) {
+    int in = open(src, O_RDONLY | O_CLOEXEC);
+    if (in < 0) {
+        // as coreutils: a missing file could not be stat'ed, anything else opened
+        fprintf(stderr, errno == ENOENT || errno == ENOTDIR ? "cp: cannot stat '%s': %s\n"
+                        : "cp: cannot open '%s' for reading: %s\n", src, strerror(errno));
+        return 1;
+    }
+    struct stat si;
+    if (fstat(in, &si) < 0) {
+        fprintf(stderr, "cp: cannot stat '%s': %s\n", src, strerror(errno));
+        close(in);
+        return 1;
+    }
+    if (S_ISDIR(si.st_mode)) {
+        fprintf(stderr, "cp: -r not specified; omitting directory '%s'\n", src);
+        close(in);
+        return 1;
+    }
+    if (!into_dir) return cp_to(in, &si, src, dst);
+    // malloc'd, not from the arena: cp may run on a helper thread
+    const char *base = strrchr(src, '/');
+    base = base ? base + 1 : src;
+    size_t n = strlen(dst) + strlen(base) + 2;
+    char *path = malloc(n);
+    if (!path) { perror("malloc"); exit(EXIT_FAILURE); }
+    snprintf(path, n, "%s/%s", dst, base);
+    int status = cp_to(in, &si, src, path);
+    free(path);
+    return status;
+}
+
+/* cp src dst, cp src... dir: copy_file_range() between the files, so on
+   filesystems that support it the data is shared or copied by the kernel.
+   Flags (-r, -p, ...) go to /bin/cp. */
+int builtin_cp(char **args) {
+    int n = 0;
+    while (args[n + 1]) n++;
+    if (n < 2) {
+        fprintf(stderr, n ? "cp: missing destination file operand after '%s'\n"
+                          : "cp: missing file operand\n", args[1]);
+        return 1;
+    }
+    const char *dst = args[n];
+    struct stat sd;
+    int into_dir = stat(dst, &sd) == 0 && S_ISDIR(sd.st_mode);
+    if (n > 2 && !into_dir) {
+        fprintf(stderr, "cp: target '%s' is not a directory\n", dst);
+        return 1;
+    }
+    int status = 0;
+    for (int i = 1; i < n; ++i) status |= cp_one(args[i], dst, into_dir);
+    return status;
+}
+
+/* "64k", "1M", "4096": a byte count with an optional k/m/g suffix, or -1 */
+long parse_size(const char *s) {
+    char *end;
+    errno = 0;
+    long n = strtol(s, &end, 10);
+    if (end == s || n < 0 || errno == ERANGE) return -1;
+    int shift = 0;
+    switch (*end) {
+    case 'k': case 'K': shift = 10; end++; break;
+    case 'm': case 'M': shift = 20; end++; break;
+    case 'g': case 'G': shift = 30; end++; break;
+    }
+    // a size that does not fit a long is as bad as no size at all
+    if (*end || n > LONG_MAX >> shift) return -1;
+    return n << shift;
+}
+
+/* set -o                list options
+   set -o pipesize=SIZE  capacity for the pipes of every later pipeline
+   set +o pipesize       back to the kernel default
+   set -o launcher       launch external commands through the launcher
+   set +o launcher       stop it (only with no jobs left)
+   set -o trace          record trace events, see stats
+   set +o trace          stop recording */
+int builtin_set(char **args, struct outbuf *out) {
+    if (!args[1] || (strcmp(args[1], "-o") == 0 && !args[2])) {
+        ob_printf(out, "pipesize\t%ld\n", opt_pipesize);
+        ob_printf(out, "launcher\t%s\n", launcher_fd != -1 ? "on" : "off");
+        ob_printf(out, "trace\t\t%s\n", trace_on ? "on" : "off");
+        return 0;
+    }
+    if (!args[2] || (strcmp(args[1], "-o") != 0 && strcmp(args[1], "+o") != 0)) {
+        fprintf(stderr, "set: usage: set [-o name=value | +o name]\n");
+        return 2;
+    }
+    if (strcmp(args[2], "trace") == 0) {
+        if (args[1][0] == '-') return trace_start() < 0;
+        trace_on = 0;
+        return 0;
+    }
+    if (strcmp(args[2], "launcher") == 0) {
+        if (args[1][0] == '-') return launcher_start() < 0;
+        if (job_top > 0) {
+            // its children would be left with nobody to report them
+            fprintf(stderr, "set: launcher: there are still jobs\n");
+            return 1;
+        }
+        launcher_stop();
+        return 0;
+    }
+    if (strcmp(args[1], "+o") == 0) {
+        if (strcmp(args[2], "pipesize") != 0) { fprintf(stderr, "set: %s: no such option\n", args[2]); return 1; }
+        opt_pipesize = 0;
+        return 0;
+    }
+    if (strncmp(args[2], "pipesize=", 9) != 0) {
+        fprintf(stderr, "set: %s: no such option\n", args[2]);
+        return 1;
+    }
+    long n = parse_size(args[2] + 9);
+    if (n < 0) { fprintf(stderr, "set: %s: bad size\n", args[2] + 9); return 1; }
+    opt_pipesize = n;
+    return 0;
+}
+
+/* ---------------- Job control ---------------- */
+
+static void sigchld_handler(int sig) {
+    (void)sig;
+    int saved = errno;
+    sigchld_pending = 1;
+    ssize_t r = write(sigchld_pipe[1], "", 1);   // wakes the line editor's poll
+    (void)r;
+    errno = saved;
+}
+
+/* Caught rather than ignored: it only ever reaches the shell while no
+   foreground job owns the terminal, and then it just breaks "wait". */
+static void sigint_handler(int sig) {
+    (void)sig;
+    sigint_pending = 1;
+}
+
+/* Install the SIGCHLD self-pipe and, on a terminal, take the foreground
+   process group so every job can get a group of its own. */
+void job_init() {
+    if (pipe2(sigchld_pipe, O_CLOEXEC | O_NONBLOCK) < 0) perror("pipe");
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sigemptyset(&sa.sa_mask);
+    sa.sa_handler = sigchld_handler;
+    sa.sa_flags = SA_RESTART;
+    sigaction(SIGCHLD, &sa, NULL);
+
+    if (!interactive) return;
+    // started in the background: wait until the terminal is ours
+    pid_t fg;
+    while ((fg = tcgetpgrp(STDIN_FILENO)) != -1 && fg != (shell_pgid = getpgrp()))
+        kill(-shell_pgid, SIGTTIN);
+    if (fg == -1) return;
+
+    sa.sa_handler = sigint_handler;
+    sa.sa_flags = 0;
+    sigaction(SIGINT, &sa, NULL);
+    signal(SIGQUIT, SIG_IGN);
+    signal(SIGTSTP, SIG_IGN);
+    signal(SIGTTIN, SIG_IGN);
+    signal(SIGTTOU, SIG_IGN);
+    setpgid(0, 0);              // fails harmlessly if we already lead a session
+    shell_pgid = getpgrp();
+    tcsetpgrp(STDIN_FILENO, shell_pgid);
+    tcgetattr(STDIN_FILENO, &shell_tmodes);
+    job_control = 1;
+}
+
+/* In a forked child that belongs to a job: join the job's process group,
+   give back the signals the shell keeps for itself, and let go of the
+   launcher. */
+void job_child_setup(pid_t pgid) {
+    // the launcher must see EOF when the shell goes, not wait for this child
+    if (launcher_fd != -1) { close(launcher_fd); launcher_fd = -1; }
+    if (!job_control) return;
+    setpgid(0, pgid);
+    signal(SIGINT, SIG_DFL);
+    signal(SIGQUIT, SIG_DFL);
+    signal(SIGTSTP, SIG_DFL);
+    signal(SIGTTIN, SIG_DFL);
+    signal(SIGTTOU, SIG_DFL);
+    job_control = 0;
+}
+
+/* A new job for pl (the whole && / || chain starting at pl if chain is
+   set). Its id is one above the highest in use, as in sh. */
+struct job *job_new(struct pipeline *pl, int chain, int background) {
+    struct job *j = job_free_list;
+    if (j) job_free_list = j->next;
+    else j = malloc(sizeof(*j));
+    memset(j, 0, sizeof(*j));
+    j->pl = pl;
+    j->chain = chain;
+    j->background = background;
+
+    if (job_top == job_cap) {
+        job_cap = job_cap ? job_cap * 2 : 16;
+        job_table = realloc(job_table, job_cap * sizeof(*job_table));
+    }
+    j->id = ++job_top;
+    job_table[j->id - 1] = j;
+    return j;
+}
+
+void job_add_proc(struct job *j, pid_t pid) {
+    struct proc *p = proc_free_list;
+    if (p) proc_free_list = p->next;
+    else p = malloc(sizeof(*p));
+    p->pid = pid;
+    p->state = PROC_RUNNING;
+    p->status = 0;
+    p->stat = NULL;
+    p->trace = 0;
+    p->job = j;
+    p->next = NULL;
+    struct proc **b = &job_pids[pid & (JOB_PID_BUCKETS - 1)];
+    p->hash_next = *b;
+    *b = p;
+    if (j->last) j->last->next = p;
+    else { j->procs = p; j->pgid = pid; }
+    j->last = p;
+    j->nrunning++;
+}
+
+static struct proc *job_find_pid(pid_t pid) {
+    struct proc *p = job_pids[pid & (JOB_PID_BUCKETS - 1)];
+    while (p && p->pid != pid) p = p->hash_next;
+    return p;
+}
+
+static void job_free(struct job *j) {
+    if (j->queued) {
+        struct job **pp = &job_changed;
+        while (*pp != j) pp = &(*pp)->next;
+        *pp = j->next;
+    }
+    struct proc *p = j->procs;
+    while (p) {
+        struct proc **h = &job_pids[p->pid & (JOB_PID_BUCKETS - 1)];
+        while (*h != p) h = &(*h)->hash_next;
+        *h = p->hash_next;
+        struct proc *next = p->next;
+        p->next = proc_free_list;
+        proc_free_list = p;
+        p = next;
+    }
+    free(j->text);
+    job_table[j->id - 1] = NULL;
+    while (job_top > 0 && !job_table[job_top - 1]) job_top--;
+    if (job_current == j->id) job_current = 0;
+    j->next = job_free_list;
+    job_free_list = j;
+}
+
+/* Exit status of a job: that of its last process, 128+n if killed or
+   stopped by signal n. */
+static int wait_status_code(int st) {
+    if (WIFEXITED(st)) return WEXITSTATUS(st);
+    if (WIFSIGNALED(st)) return 128 + WTERMSIG(st);
+    if (WIFSTOPPED(st)) return 128 + WSTOPSIG(st);
+    return 0;
+}
+
+static int job_status(struct job *j) {
+    return j->last ? wait_status_code(j->last->status) : 0;
+}
+
+static void text_append(char *buf, size_t *n, size_t cap, const char *s) {
+    size_t len = strlen(s);
+    if (len > cap - 1 - *n) len = cap - 1 - *n;
+    memcpy(buf + *n, s, len);
+    *n += len;
+}
+
+/* Give the job the command text jobs/fg/bg show. Rendered from the AST
+   only once the job outlives its line (background or stopped), since the
+   AST goes away with the line arena. */
+static void job_render(struct job *j) {
+    // the stage records go with the line too
+    for (struct proc *p = j->procs; p; p = p->next) p->stat = NULL;
+    if (j->text || !j->pl) return;
+    static const char *redir_ops[] = { " < ", " > ", " >> ", " << ", " <<< " };
+    char buf[512];
+    size_t n = 0;
+    for (struct pipeline *pl = j->pl; pl; pl = j->chain ? pl->next : NULL) {
+        for (int c = 0; c < pl->ncmds; ++c) {
+            struct command *cmd = &pl->cmds[c];
+            for (int w = 0; w < cmd->argc; ++w) {
+                if (w) text_append(buf, &n, sizeof(buf), " ");
+                text_append(buf, &n, sizeof(buf), cmd->argv[w]);
+            }
+            for (struct redirect *r = cmd->redirs; r; r = r->next) {
+                text_append(buf, &n, sizeof(buf), redir_ops[r->type]);
+                text_append(buf, &n, sizeof(buf), r->target);
+            }
+            if (c + 1 < pl->ncmds) text_append(buf, &n, sizeof(buf), " | ");
+        }
+        if (j->chain && pl->next)
+            text_append(buf, &n, sizeof(buf), pl->connector == CONN_AND ? " && " : " || ");
+    }
+    j->text = strndup(buf, n);
+    j->pl = NULL;
+}
+
+/* A background job has all its processes: report it, or drop it if
+   nothing could be launched. */
+void job_launched(struct job *j) {
+    if (!j->procs) { job_free(j); return; }
+    job_render(j);
+    job_current = j->id;
+    if (job_control) printf("[%d] %d\n", j->id, (int)j->last->pid);
+}
+
+static void job_record(pid_t pid, int status, const struct rusage *ru) {
+    struct proc *p = job_find_pid(pid);
+    if (!p) return;                     // not ours (e.g. a compaction helper)
+    struct job *j = p->job;
+    if (p->state == PROC_RUNNING) j->nrunning--;
+    else if (p->state == PROC_STOPPED) j->nstopped--;
+
+    if (WIFSTOPPED(status)) {
+        p->state = PROC_STOPPED;
+        j->nstopped++;
+    } else if (WIFCONTINUED(status)) {
+        p->state = PROC_RUNNING;
+        j->nrunning++;
+        return;
+    } else {
+        p->state = PROC_DONE;
+    }
+    p->status = status;
+    if (p->stat) {
+        p->stat->status = wait_status_code(status);
+        p->stat->ran = 1;
+        p->stat->ru = *ru;
+        if (pipe_timed) clock_gettime(CLOCK_MONOTONIC, &p->stat->end);
+    }
+    if (p->trace && p->state == PROC_DONE) {
+        trace_event(PH_WAIT, p->trace, pid, p->trace_start);
+        p->trace = 0;
+    }
+
+    if (j->background && j->nrunning == 0 && !j->queued) {
+        j->queued = 1;
+        j->next = job_changed;
+        job_changed = j;
+    }
+}
+
+/* Collect whatever children have changed state. Costs nothing unless
+   SIGCHLD arrived since the last call. */
+void job_reap() {
+    if (!sigchld_pending) return;
+    sigchld_pending = 0;
+    char drain[64];
+    while (read(sigchld_pipe[0], drain, sizeof(drain)) > 0) ;
+    int status;
+    struct rusage ru;
+    pid_t pid;
+    while ((pid = wait4(-1, &status, WNOHANG | WUNTRACED | WCONTINUED, &ru)) > 0)
+        job_record(pid, status, &ru);
+    launcher_collect();
+}
+
+/* Wait until every process of j has exited or stopped and return the
+   job's status. A foreground job gets the terminal meanwhile. A job that
+   finished is freed; one that stopped becomes a background job. */
+int job_wait(struct job *j, int foreground) {
+    int tty = foreground && job_control && j->procs;
+    if (tty) tcsetpgrp(STDIN_FILENO, j->pgid);
+    sigint_pending = 0;
+
+    while (j->nrunning > 0) {
+        int status;
+        struct rusage ru;
+        pid_t pid;
+        if (launcher_fd != -1) {
+            // the launcher's children can't be waitpid()ed: sleep until it
+            // reports or one of our own exits, then collect both
+            struct pollfd pfd[2] = { { sigchld_pipe[0], POLLIN, 0 }, { launcher_fd, POLLIN, 0 } };
+            pid = poll(pfd, 2, -1);
+            if (pid >= 0) {
+                sigchld_pending = 1;
+                job_reap();
+                continue;
+            }
+        } else {
+            pid = wait4(job_control ? -j->pgid : -1, &status, WUNTRACED, &ru);
+        }
+        if (pid < 0 && errno == EINTR) {
+            if (sigint_pending && !foreground) {
+                printf("\n");
+                if (!j->background) job_render(j);
+                j->background = 1;
+                return 130;
+            }
+            continue;
+        }
+        if (pid < 0) {
+            // someone else reaped them: nothing left to wait for
+            for (struct proc *p = j->procs; p; p = p->next)
+                if (p->state == PROC_RUNNING) p->state = PROC_DONE;
+            j->nrunning = 0;
+            break;
+        }
+        job_record(pid, status, &ru);
+    }
+
+    if (tty) {
+        tcsetpgrp(STDIN_FILENO, shell_pgid);
+        if (j->nstopped) {
+            tcgetattr(STDIN_FILENO, &j->tmodes);
+            j->have_tmodes = 1;
+        }
+        tcsetattr(STDIN_FILENO, TCSADRAIN, &shell_tmodes);
+        // the terminal echoed ^C; start the prompt on a fresh line
+        if (j->last->state == PROC_DONE && WIFSIGNALED(j->last->status) &&
+            WTERMSIG(j->last->status) == SIGINT)
+            printf("\n");
+    }
+
+    int status = job_status(j);
+    if (j->nstopped) {
+        job_render(j);
+        j->background = 1;
+        j->notified = 1;
+        job_current = j->id;
+        printf("\n[%d]+  Stopped                 %s\n", j->id, j->text);
+    } else {
+        job_free(j);
+    }
+    return status;
+}
+
+static const char *job_state_text(struct job *j, char *buf, size_t n) {
+    if (j->nrunning) return "Running";
+    if (j->nstopped) return "Stopped";
+    int status = job_status(j);
+    if (status == 0) return "Done";
+    snprintf(buf, n, "Exit %d", status);
+    return buf;
+}
+
+/* Report background jobs that finished or stopped since the last prompt;
+   finished ones are dropped from the table. */
+void job_notify() {
+    job_reap();
+    while (job_changed) {
+        struct job *j = job_changed;
+        job_changed = j->next;
+        j->queued = 0;
+        if (j->nstopped == 0) {
+            char buf[32];
+            if (job_control)
+                printf("[%d]%c  %-22s  %s\n", j->id, j->id == job_current ? '+' : ' ',
+                       job_state_text(j, buf, sizeof(buf)), j->text);
+            job_free(j);
+        } else if (!j->notified) {
+            if (job_control) printf("\n[%d]+  Stopped                 %s\n", j->id, j->text);
+            j->notified = 1;
+        }
+    }
+}
+
+/* %n, %+ / %% / %, %prefix, or (for wait) a plain pid. NULL means the
+   current job: the last one stopped or put in the background. */
+static struct job *job_lookup(const char *spec, const char *who) {
+    struct job *j = NULL;
+    if (!spec || strcmp(spec, "%") == 0 || strcmp(spec, "%%") == 0 || strcmp(spec, "%+") == 0) {
+        int id = job_current ? job_current : job_top;
+        if (id) j = job_table[id - 1];
+        if (!j) { fprintf(stderr, "%s: no current job\n", who); return NULL; }
+        return j;
+    }
+    if (spec[0] == '%' && spec[1] >= '0' && spec[1] <= '9') {
+        int id = atoi(spec + 1);
+        if (id >= 1 && id <= job_top) j = job_table[id - 1];
+    } else if (spec[0] == '%') {
+        size_t n = strlen(spec + 1);
+        for (int id = job_top; id >= 1 && !j; --id) {
+            struct job *c = job_table[id - 1];
+            if (c && c->text && strncmp(c->text, spec + 1, n) == 0) j = c;
+        }
+    } else {
+        struct proc *p = job_find_pid(atoi(spec));
+        if (p) j = p->job;
+    }
+    if (!j) fprintf(stderr, "%s: %s: no such job\n", who, spec);
+    return j;
+}
+
+/* Send SIGCONT to a stopped job and mark it running again. */
+static void job_continue(struct job *j) {
+    if (job_control) kill(-j->pgid, SIGCONT);
+    for (struct proc *p = j->procs; p; p = p->next) {
+        if (!job_control && p->state != PROC_DONE) kill(p->pid, SIGCONT);
+        if (p->state == PROC_STOPPED) {
+            p->state = PROC_RUNNING;
+            j->nstopped--;
+            j->nrunning++;
+        }
+    }
+    j->notified = 0;
+}
+
+int builtin_jobs(char **args, struct outbuf *out) {
+    int show_pids = 0, only_pids = 0;
+    for (int i = 1; args[i]; ++i) {
+        if (strcmp(args[i], "-l") == 0) show_pids = 1;
+        else if (strcmp(args[i], "-p") == 0) only_pids = 1;
+        else { fprintf(stderr, "jobs: usage: jobs [-l|-p]\n"); return 2; }
+    }
+    job_reap();
+    for (int id = 1; id <= job_top; ++id) {
+        struct job *j = job_table[id - 1];
+        if (!j) continue;
+        if (only_pids) {
+            ob_printf(out, "%d\n", (int)j->pgid);
+            continue;
+        }
+        char buf[32];
+        char pid[16] = "";
+        if (show_pids) snprintf(pid, sizeof(pid), "%d ", (int)j->pgid);
+        ob_printf(out, "[%d]%c  %s%-22s  %s%s\n", id, id == job_current ? '+' : ' ', pid,
+                  job_state_text(j, buf, sizeof(buf)), j->text, j->nrunning ? " &" : "");
+        if (!j->nrunning && !j->nstopped) job_free(j);     // reported, done
+    }
+    return 0;
+}
+
+int builtin_fg(char **args, struct outbuf *out) {
+    struct job *j = job_lookup(args[1], "fg");
+    if (!j) return 1;
+    ob_printf(out, "%s\n", j->text);
+    ob_flush(out);
+    j->background = 0;
+    if (j->nstopped) {
+        if (job_control && j->have_tmodes) tcsetattr(STDIN_FILENO, TCSADRAIN, &j->tmodes);
+        job_continue(j);
+    }
+    return job_wait(j, 1);
+}
+
+int builtin_bg(char **args, struct outbuf *out) {
+    struct job *j = job_lookup(args[1], "bg");
+    if (!j) return 1;
+    if (!j->nstopped) {
+        fprintf(stderr, "bg: job %d already in background\n", j->id);
+        return 0;
+    }
+    job_continue(j);
+    job_current = j->id;
+    ob_printf(out, "[%d]+ %s &\n", j->id, j->text);
+    return 0;
+}
+
+/* wait: every running job, status 0. wait %n / wait pid: that job, with
+   its status. Ctrl-C breaks the wait with 130. */
+int builtin_wait(char **args, struct outbuf *out) {
+    (void)out;
+    job_reap();
+    if (!args[1]) {
+        for (int id = 1; id <= job_top; ++id) {
+            struct job *j = job_table[id - 1];
+            if (j && j->nrunning && job_wait(j, 0) == 130 && sigint_pending) return 130;
+        }
+        return 0;
+    }
+    int status = 0;
+    for (int i = 1; args[i]; ++i) {
+        struct job *j = job_lookup(args[i], "wait");
+        status = j ? job_wait(j, 0) : 127;
+        if (status == 130 && sigint_pending) break;
+    }
+    return status;
+}
+
+/* ---------------- Launcher ---------------- */
+/* set -o launcher (or myshell -o launcher, which starts it before the
+   history is even loaded): a helper forked while the shell is still small
+   does the fork+exec of external commands, so a launch never depends on
+   how big the session has grown. Each command goes over a SOCK_SEQPACKET
+   socket as one message: the binary, argv and environment as NUL-separated
+   strings, with the shell's cwd, the command's stdin/stdout and the
+   shell's current stderr attached as SCM_RIGHTS. The launcher answers with the pid. Later exits and stops come
+   back as LAUNCH_STATUS messages, followed by a SIGCHLD to wake the shell,
+   and job_reap() records them like those of the shell's own children. */
+enum { LAUNCH_SPAWN, LAUNCH_PID, LAUNCH_STATUS };
+#define LAUNCH_MAX (128 * 1024)     // bigger commands are spawned by the shell itself
+#define LAUNCH_IN 1                 // fd attached for stdin
+#define LAUNCH_OUT 2                // fd attached for stdout
+#define LAUNCH_JOBCTL 4             // put the child in process group pid
+#define LAUNCH_ERR 8                // fd attached for stderr
+
+struct launch_msg {
+    int32_t type;
+    int32_t pid;                // spawn: process group (0: a new one); else the child
+    int32_t value;              // spawn: argc; pid: errno; status: wait status
+    int32_t nenv;
+    uint32_t flags;
+    struct rusage ru;           // status: the child's resource usage
+};
+
+static const int launcher_signo[] = { SIGINT, SIGQUIT, SIGTSTP, SIGTTIN, SIGTTOU };
+static struct sigaction launcher_sigs[5];   // dispositions the launcher started with
+
+/* In the launcher: fork+exec one request. Returns the pid or -errno. */
+static pid_t launcher_exec(struct launch_msg *m, char *data, size_t len,
+                           const int *fds, int nfds, const sigset_t *mask) {
+    int want = 1 + !!(m->flags & LAUNCH_IN) + !!(m->flags & LAUNCH_OUT) + !!(m->flags & LAUNCH_ERR);
+    if (m->value < 1 || m->nenv < 0 || nfds != want) return -EINVAL;
+    char **strs = malloc((m->value + m->nenv + 3) * sizeof(char *));
+    if (!strs) return -ENOMEM;
+    int n = 0, need = 1 + m->value + m->nenv;
+    for (char *p = data, *end = data + len; p < end && n < need; p += strlen(p) + 1) {
+        if (!memchr(p, '\0', end - p)) break;
+        strs[n++] = p;
+    }
+    if (n != need) { free(strs); return -EINVAL; }
+    char **argv = strs + 1, **envp = strs + 1 + m->value + 1;
+    memmove(envp, strs + 1 + m->value, m->nenv * sizeof(char *));
+    argv[m->value] = NULL;
+    envp[m->nenv] = NULL;
+
+    int err[2];
+    if (pipe2(err, O_CLOEXEC) < 0) { free(strs); return -errno; }
+    pid_t pid = fork();
+    if (pid == 0) {
+        if (m->flags & LAUNCH_JOBCTL) setpgid(0, m->pid);
+        for (int i = 0; i < 5; ++i) {
+            if (m->flags & LAUNCH_JOBCTL) signal(launcher_signo[i], SIG_DFL);
+            else sigaction(launcher_signo[i], &launcher_sigs[i], NULL);
+        }
+        sigprocmask(SIG_SETMASK, mask, NULL);
+        int k = 1;
+        if (fchdir(fds[0]) == 0 &&
+            (!(m->flags & LAUNCH_IN) || dup2(fds[k++], STDIN_FILENO) >= 0) &&
+            (!(m->flags & LAUNCH_OUT) || dup2(fds[k++], STDOUT_FILENO) >= 0) &&
+            (!(m->flags & LAUNCH_ERR) || dup2(fds[k++], STDERR_FILENO) >= 0))
+            execve(strs[0], argv, envp);
+        int e = errno;
+        ssize_t w = write(err[1], &e, sizeof(e));
+        (void)w;
+        _exit(127);
+    }
+    int e = pid < 0 ? errno : 0;
+    close(err[1]);
+    // EOF: the exec went through (err is close-on-exec)
+    if (pid > 0 && read(err[0], &e, sizeof(e)) == sizeof(e)) waitpid(pid, NULL, 0);
+    close(err[0]);
+    free(strs);
+    return e ? -e : pid;
+}
+
+/* The launcher's loop: requests from the shell, and its children's exits
+   from a signalfd. Ends when the shell closes the socket. */
+static void launcher_main(int sock) {
+    sigset_t chld, mask;
+    sigemptyset(&chld);
+    sigaddset(&chld, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &chld, &mask);
+    int sfd = signalfd(-1, &chld, SFD_CLOEXEC | SFD_NONBLOCK);
+    // Ctrl-C at the prompt reaches the shell's process group, this included
+    for (int i = 0; i < 5; ++i) {
+        sigaction(launcher_signo[i], NULL, &launcher_sigs[i]);
+        signal(launcher_signo[i], SIG_IGN);
+    }
+    pid_t shell = getppid();
+    static char data[LAUNCH_MAX];
+    struct pollfd pfd[2] = { { sock, POLLIN, 0 }, { sfd, POLLIN, 0 } };
+
+    for (;;) {
+        if (poll(pfd, 2, -1) < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        if (pfd[1].revents) {
+            struct signalfd_siginfo si;
+            while (read(sfd, &si, sizeof(si)) > 0) ;
+            int status, sent = 0;
+            struct rusage ru;
+            pid_t pid;
+            while ((pid = wait4(-1, &status, WNOHANG | WUNTRACED | WCONTINUED, &ru)) > 0) {
+                struct launch_msg r = { .type = LAUNCH_STATUS, .pid = pid, .value = status, .ru = ru };
+                sent |= send(sock, &r, sizeof(r), MSG_NOSIGNAL) == sizeof(r);
+            }
+            if (sent) kill(shell, SIGCHLD);
+        }
+        if (pfd[0].revents) {
+            struct launch_msg m;
+            int fds[4], nfds = 0;
+            union { struct cmsghdr h; char buf[CMSG_SPACE(sizeof(fds))]; } ctl;
+            struct iovec iov[2] = { { &m, sizeof(m) }, { data, sizeof(data) } };
+            struct msghdr msg = { .msg_iov = iov, .msg_iovlen = 2,
+                                  .msg_control = ctl.buf, .msg_controllen = sizeof(ctl.buf) };
+            ssize_t n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) break;              // the shell is gone
+            for (struct cmsghdr *c = CMSG_FIRSTHDR(&msg); c; c = CMSG_NXTHDR(&msg, c)) {
+                if (c->cmsg_level != SOL_SOCKET || c->cmsg_type != SCM_RIGHTS) continue;
+                int k = (c->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+                for (int i = 0; i < k; ++i) {
+                    int fd;
+                    memcpy(&fd, CMSG_DATA(c) + i * sizeof(int), sizeof(int));
+                    if (nfds < 4) fds[nfds++] = fd;
+                    else close(fd);
+                }
+            }
+            pid_t pid = -EINVAL;
+            if (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) pid = -E2BIG;
+            else if ((size_t)n >= sizeof(m) && m.type == LAUNCH_SPAWN)
+                pid = launcher_exec(&m, data, n - sizeof(m), fds, nfds, &mask);
+            for (int i = 0; i < nfds; ++i) close(fds[i]);
+            struct launch_msg r = { .type = LAUNCH_PID, .pid = pid > 0 ? pid : 0,
+                                    .value = pid > 0 ? 0 : -pid };
+            send(sock, &r, sizeof(r), MSG_NOSIGNAL);
+        }
+    }
+    _exit(0);
+}
+
+/* Fork the launcher. Returns 0, or -1 after reporting why not. */
+int launcher_start() {
+    if (launcher_fd != -1) return 0;
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) < 0) { perror("launcher"); return -1; }
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("launcher");
+        close(sv[0]);
+        close(sv[1]);
+        return -1;
+    }
+    if (pid == 0) {
+        close(sv[0]);
+        if (sigchld_pipe[0] != -1) { close(sigchld_pipe[0]); close(sigchld_pipe[1]); }
+        launcher_main(sv[1]);
+    }
+    close(sv[1]);
+    launcher_fd = sv[0];
+    launcher_pid = pid;
+    return 0;
+}
+
+/* Close the socket; the launcher exits when it reads EOF. */
+void launcher_stop() {
+    if (launcher_fd == -1) return;
+    close(launcher_fd);
+    launcher_fd = -1;
+    waitpid(launcher_pid, NULL, 0);
+    launcher_pid = 0;
+}
+
+/* The launcher died under us. Its children now belong to init and will
+   never be reported, so count them as done. */
+static void launcher_lost() {
+    fprintf(stderr, "myshell: launcher exited\n");
+    launcher_stop();
+    for (int i = 0; i < job_top; ++i) {
+        struct job *j = job_table[i];
+        for (struct proc *p = j ? j->procs : NULL; p; p = p->next) {
+            if (p->state == PROC_DONE) continue;
+            int status;
+            struct rusage ru;
+            pid_t r = wait4(p->pid, &status, WNOHANG | WUNTRACED, &ru);
+            if (r > 0) job_record(r, status, &ru);
+            else if (r < 0 && errno == ECHILD) {
+                memset(&ru, 0, sizeof(ru));
+                job_record(p->pid, 0, &ru);
+            }
+        }
+    }
+}
+
+/* Record whatever the launcher has reported so far; called by job_reap(). */
+void launcher_collect() {
+    if (launcher_fd == -1) return;
+    struct launch_msg m;
+    ssize_t n;
+    while ((n = recv(launcher_fd, &m, sizeof(m), MSG_DONTWAIT)) != 0) {
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN) return;
+            break;
+        }
+        if (m.type == LAUNCH_STATUS) job_record(m.pid, m.value, &m.ru);
+    }
+    launcher_lost();
+}
+
+/* Send one command to the launcher. Returns 0 with *pid set, an errno
+   value from the exec, or -1 if the launcher can't take it (too big, or
+   gone) and the shell should spawn it itself. */
+static int launcher_spawn(pid_t *pid, const char *path, char **args, int in_fd, int out_fd, pid_t pgid) {
+    size_t len = strlen(path) + 1;
+    int argc = 0, nenv = 0;
+    char **env = var_envp();
+    for (; args[argc]; ++argc) len += strlen(args[argc]) + 1;
+    for (; env[nenv]; ++nenv) len += strlen(env[nenv]) + 1;
+    if (len > LAUNCH_MAX) return -1;
+    char *data = arena_alloc(len), *d = stpcpy(data, path) + 1;
+    for (int i = 0; i < argc; ++i) d = stpcpy(d, args[i]) + 1;
+    for (int i = 0; i < nenv; ++i) d = stpcpy(d, env[i]) + 1;
+
+    struct launch_msg m = { .type = LAUNCH_SPAWN, .pid = pgid, .value = argc, .nenv = nenv,
+                            .flags = job_control ? LAUNCH_JOBCTL : 0 };
+    int fds[4], nfds = 0;
+    fds[nfds++] = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (fds[0] < 0) return -1;
+    if (in_fd != -1) { fds[nfds++] = in_fd; m.flags |= LAUNCH_IN; }
+    // inside $(...) fd 1 is the capture pipe, not the launcher's stdout
+    if (out_fd == -1 && subst_depth) out_fd = STDOUT_FILENO;
+    if (out_fd != -1) { fds[nfds++] = out_fd; m.flags |= LAUNCH_OUT; }
+    // wherever stderr points now (parallel moves it to a job's memfd)
+    fds[nfds++] = STDERR_FILENO;
+    m.flags |= LAUNCH_ERR;
+
+    union { struct cmsghdr h; char buf[CMSG_SPACE(sizeof(fds))]; } ctl;
+    memset(&ctl, 0, sizeof(ctl));
+    struct iovec iov[2] = { { &m, sizeof(m) }, { data, len } };
+    struct msghdr msg = { .msg_iov = iov, .msg_iovlen = 2,
+                          .msg_control = ctl.buf, .msg_controllen = CMSG_SPACE(nfds * sizeof(int)) };
+    struct cmsghdr *c = CMSG_FIRSTHDR(&msg);
+    c->cmsg_level = SOL_SOCKET;
+    c->cmsg_type = SCM_RIGHTS;
+    c->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+    memcpy(CMSG_DATA(c), fds, nfds * sizeof(int));
+    ssize_t n;
+    while ((n = sendmsg(launcher_fd, &msg, MSG_NOSIGNAL)) < 0 && errno == EINTR) ;
+    close(fds[0]);
+    if (n < 0) { launcher_lost(); return -1; }
+
+    // reports on earlier children may come ahead of the answer
+    for (;;) {
+        n = recv(launcher_fd, &m, sizeof(m), 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) { launcher_lost(); return EIO; }    // it may have run: don't run it twice
+        if (m.type == LAUNCH_STATUS) { job_record(m.pid, m.value, &m.ru); continue; }
+        *pid = m.pid;
+        return m.value;
+    }
+}
+
+/* spawn_command() for the command path: through the launcher when it
+   runs, with the same command hash lookup and retry. */
+pid_t launch_command(char **args, int in_fd, int out_fd, pid_t pgid) {
+    if (launcher_fd == -1) return spawn_command(args, in_fd, out_fd, pgid);
+    pid_t pid;
+    const char *path = hash_lookup(args[0]);
+    int err = path ? launcher_spawn(&pid, path, args, in_fd, out_fd, pgid) : ENOENT;
+    if (err == ENOENT && path && path != args[0]) {
+        hash_forget(args[0]);
+        path = hash_lookup(args[0]);
+        err = path ? launcher_spawn(&pid, path, args, in_fd, out_fd, pgid) : ENOENT;
+    }
+    if (err == ENOEXEC) {
+        char **sh = spawn_sh_args(path, args);
+        err = launcher_spawn(&pid, sh[0], sh, in_fd, out_fd, pgid);
+        free(sh);
+    }
+    if (err < 0) return spawn_command(args, in_fd, out_fd, pgid);
+    if (err != 0) {
+        spawn_failed(args[0], err);
+        return -1;
     }
-    tokens[pos] = NULL;
-    return tokens;
-}
-void free_tokens(char **tokens) {
-    if (!tokens) return;
-    for (int i = 0; tokens[i] != NULL; ++i) free(tokens[i]);
-    free(tokens);
+    return pid;
 }
 
-/* Builtin detection */
-int is_builtin(const char *cmd) {
-    if (!cmd) return 0;
-    return (strcmp(cmd, "cd") == 0 ||
-            strcmp(cmd, "pwd") == 0 ||
-            strcmp(cmd, "echo") == 0 ||
-            strcmp(cmd, "exit") == 0 ||
-            strcmp(cmd, "history") == 0);
-}
+/* ---------------- parallel ---------------- */
+/* parallel [-j N] [-k] [-v] command... [::: arg...]
+   Runs command once per argument (one per line from stdin when there is
+   no :::), keeping at most N jobs in flight (default: one per CPU) and
+   starting the next as soon as any job ends. In the command, {} is the
+   argument, {.} the argument without its extension, {/} its basename and
+   {#} the job number; with none of them the argument is appended. Words
+   are joined with spaces and the result is parsed as a command line, so
+   quote operators to keep them for the job ('a | b'). Jobs read /dev/null.
+   Each job's stdout and stderr go to memfds and are written out in one
+   piece when it ends: in completion order, or in argument order with -k.
+   Failed jobs are reported on stderr, and with -v every job is. The
+   status is the number of failed jobs (at most 101), or 130 after Ctrl-C. */
 
-int handle_builtin_parent(char **args) {
-    if (!args[0]) return 0;
+struct par_task {
+    pid_t pid;
+    struct proc *proc;          // in the parallel run's job while it runs
+    int out, err;               // memfds holding the job's output
+    int status;
+    int done;
+    char *text;
+};
 
-    if (strcmp(args[0], "cd") == 0) {
-        char *target_dir = args[1];
-        if (!target_dir || strcmp(target_dir, "~") == 0) {
-            target_dir = getenv("HOME");
-            if (!target_dir) target_dir = "/";
+struct line_reader {
+    int fd;
+    char *buf;
+    size_t cap, start, end;
+    int eof;
+};
+
+/* Next line from lr->fd without its newline, in the arena; NULL at EOF */
+static char *read_line_from(struct line_reader *lr) {
+    while (1) {
+        char *nl = memchr(lr->buf + lr->start, '\n', lr->end - lr->start);
+        if (nl) {
+            char *line = arena_strndup(lr->buf + lr->start, nl - (lr->buf + lr->start));
+            lr->start = nl - lr->buf + 1;
+            return line;
         }
-        if (chdir(target_dir) != 0) perror("cd");
-        return 1;
+        if (lr->eof) {
+            if (lr->start == lr->end) return NULL;
+            char *line = arena_strndup(lr->buf + lr->start, lr->end - lr->start);
+            lr->start = lr->end;
+            return line;
+        }
+        memmove(lr->buf, lr->buf + lr->start, lr->end - lr->start);
+        lr->end -= lr->start;
+        lr->start = 0;
+        if (lr->end == lr->cap) {
+            lr->cap = lr->cap ? lr->cap * 2 : 4096;
+            lr->buf = realloc(lr->buf, lr->cap);
+            if (!lr->buf) { perror("malloc"); exit(EXIT_FAILURE); }
+        }
+        ssize_t r = read(lr->fd, lr->buf + lr->end, lr->cap - lr->end);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) lr->eof = 1;
+        else lr->end += r;
     }
+}
 
-    if (strcmp(args[0], "pwd") == 0) {
-        char cwd[1024];
-        if (getcwd(cwd, sizeof(cwd))) printf("%s\n", cwd);
-        else perror("pwd");
-        return 1;
+/* s as one single-quoted shell word */
+static void sb_add_quoted(struct strbuf *sb, const char *s, size_t n) {
+    sb_add(sb, "'", 1);
+    for (size_t i = 0; i < n; ++i) {
+        if (s[i] == '\'') sb_add(sb, "'\\''", 4);
+        else sb_add(sb, s + i, 1);
     }
+    sb_add(sb, "'", 1);
+}
 
-    if (strcmp(args[0], "echo") == 0) {
-        for (int i = 1; args[i]; ++i) {
-            printf("%s", args[i]);
-            if (args[i+1]) printf(" ");
+/* The command line for job seq: template words joined by spaces with the
+   replacement strings filled in. */
+static char *par_command(struct strbuf *sb, char **tmpl, const char *arg, int seq) {
+    size_t alen = strlen(arg);
+    const char *slash = memrchr(arg, '/', alen);
+    const char *base = slash ? slash + 1 : arg;
+    const char *dot = strrchr(base, '.');
+    size_t stem = (dot && dot != base) ? (size_t)(dot - arg) : alen;
+    int used = 0;
+
+    sb->len = 0;
+    for (int w = 0; tmpl[w]; ++w) {
+        if (w) sb_add(sb, " ", 1);
+        for (const char *p = tmpl[w]; *p; ) {
+            if (strncmp(p, "{}", 2) == 0) {
+                sb_add_quoted(sb, arg, alen); p += 2; used = 1;
+            } else if (strncmp(p, "{.}", 3) == 0) {
+                sb_add_quoted(sb, arg, stem); p += 3; used = 1;
+            } else if (strncmp(p, "{/}", 3) == 0) {
+                sb_add_quoted(sb, base, alen - (base - arg)); p += 3; used = 1;
+            } else if (strncmp(p, "{#}", 3) == 0) {
+                char num[16];
+                sb_add(sb, num, snprintf(num, sizeof(num), "%d", seq + 1)); p += 3;
+            } else {
+                sb_add(sb, p++, 1);
+            }
         }
-        printf("\n");
-        return 1;
     }
+    if (!used) {
+        sb_add(sb, " ", 1);
+        sb_add_quoted(sb, arg, alen);
+    }
+    return arena_strndup(sb->s, sb->len);
+}
 
-    if (strcmp(args[0], "history") == 0) {
-        for (int i = 0; i < history_count; ++i)
-            printf("%d %s\n", i+1, history[i]);
-        return 1;
+/* The shell's own variables as assignments for a "myshell -c" job; the
+   exported ones reach it through the environment anyway. */
+static void par_shell_vars(struct strbuf *sb) {
+    for (size_t i = 0; i < var_size; ++i) {
+        struct var *v = &var_table[i];
+        if (!v->str || v->str == var_gone || (v->flags & VAR_EXPORT)) continue;
+        sb_add(sb, v->str, v->nlen + 1);
+        sb_add_quoted(sb, v->str + v->nlen + 1, v->vlen);
+        sb_add(sb, "; ", 2);
+    }
+    if (opt_pipesize > 0) {
+        char opt[48];
+        sb_add(sb, opt, snprintf(opt, sizeof(opt), "set -o pipesize=%ld; ", opt_pipesize));
     }
+}
 
-    if (strcmp(args[0], "exit") == 0) {
-        return 0;
+/* Start one job through launch_command(), like any command, with the
+   shell's stderr pointed at the job's memfd for the duration of the call.
+   A plain external command is launched as it is; anything else (builtins,
+   pipelines, && chains) is run by a new "myshell -c" that is given the
+   shell's variables first. */
+static pid_t par_launch(struct par_task *t, int in_fd, int saved_err, struct strbuf *sb) {
+    struct cmd_list *list = parse_line(t->text, strlen(t->text));
+    if (!list) return -1;
+    struct and_or *ao = list->first;
+    char **args = NULL;
+    if (ao && !ao->next && !ao->background && !ao->first->next &&
+        ao->first->ncmds == 1 && !ao->first->cmds[0].redirs &&
+        !assignment_words(&ao->first->cmds[0])) {
+        args = expand_argv(&ao->first->cmds[0]);
+        if (!args[0] || runs_as_builtin(args)) args = NULL;
     }
+    if (!args) {
+        sb->len = 0;
+        par_shell_vars(sb);
+        sb_add(sb, t->text, strlen(t->text));
+        args = arena_alloc(4 * sizeof(char *));
+        args[0] = "/proc/self/exe";
+        args[1] = "-c";
+        args[2] = arena_strndup(sb->s, sb->len);
+        args[3] = NULL;
+    }
+    dup2(t->err, STDERR_FILENO);
+    pid_t pid = launch_command(args, in_fd, t->out, 0);
+    dup2(saved_err, STDERR_FILENO);
+    return pid;
+}
 
-    return 0;
+/* Copy all of memfd from to fd to */
+static void par_copy(int from, int to) {
+    off_t off = 0;
+    ssize_t n;
+    while ((n = sendfile(to, from, &off, 1 << 20)) > 0 || (n < 0 && errno == EINTR)) ;
+    if (n < 0 && (errno == EINVAL || errno == ENOSYS)) {
+        // sendfile cannot write to this fd: plain copy
+        char buf[8192];
+        while ((n = pread(from, buf, sizeof(buf), off)) > 0) {
+            for (ssize_t w = 0, k; w < n; w += k) {
+                k = write(to, buf + w, n - w);
+                if (k < 0 && errno == EINTR) { k = 0; continue; }
+                if (k <= 0) return;
+            }
+            off += n;
+        }
+    }
 }
 
+/* Write a finished job's output and report its status */
+static int par_flush(struct par_task *t, int seq, int out_fd, int verbose) {
+    if (t->out != -1) { par_copy(t->out, out_fd); close(t->out); }
+    if (t->err != -1) { par_copy(t->err, STDERR_FILENO); close(t->err); }
+    if (t->status != 0 || verbose)
+        fprintf(stderr, "parallel: [%d] exit %d: %s\n", seq + 1, t->status, t->text);
+    return t->status != 0;
+}
 
-/* Builtins executed in child (when inside pipeline). Return 1 if handled. */
-int handle_builtin_child(char **args) {
-    if (!args[0]) return 0;
-    if (strcmp(args[0], "cd") == 0) {
-        if (!args[1]) exit(EXIT_FAILURE);
-        if (chdir(args[1]) != 0) { perror("cd"); exit(EXIT_FAILURE); }
-        exit(EXIT_SUCCESS);
+int builtin_parallel(char **args, int in_fd, struct outbuf *out) {
+    long jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    int keep = 0, verbose = 0;
+    int i = 1;
+    for (; args[i] && args[i][0] == '-'; ++i) {
+        if (strncmp(args[i], "-j", 2) == 0) {
+            const char *v = args[i][2] ? args[i] + 2 : args[++i];
+            if (!v || (jobs = atol(v)) < 1) break;
+        } else if (strcmp(args[i], "-k") == 0) {
+            keep = 1;
+        } else if (strcmp(args[i], "-v") == 0) {
+            verbose = 1;
+        } else if (strcmp(args[i], "--") == 0) {
+            ++i;
+            break;
+        } else {
+            break;
+        }
     }
-    if (strcmp(args[0], "pwd") == 0) {
-        char cwd[1024];
-        if (getcwd(cwd, sizeof(cwd))) printf("%s\n", cwd);
-        else perror("pwd");
-        exit(EXIT_SUCCESS);
+    char **tmpl = args + i;
+    char **argv_list = NULL;
+    for (; args[i]; ++i) {
+        if (strcmp(args[i], ":::") == 0) { args[i] = NULL; argv_list = args + i + 1; break; }
     }
-    if (strcmp(args[0], "echo") == 0) {
-        for (int i = 1; args[i]; ++i) {
-            printf("%s", args[i]);
-            if (args[i+1]) printf(" ");
-        }
-        printf("\n");
-        exit(EXIT_SUCCESS);
+    if (!tmpl[0] || tmpl[0][0] == '-' || jobs < 1) {
+        fprintf(stderr, "parallel: usage: parallel [-j N] [-k] [-v] command... [::: arg...]\n");
+        return 2;
     }
-    if (strcmp(args[0], "history") == 0) {
-        for (int i = 0; i < history_count; ++i) {
-            printf("%d %s\n", i+1, history[i]);
+    if (jobs > 1024) jobs = 1024;
+
+    ob_flush(out);
+    int out_fd = out->fd;
+    int saved_err = fcntl(STDERR_FILENO, F_DUPFD_CLOEXEC, 3);
+    // jobs read /dev/null: stdin may carry the arguments, and a job in a
+    // background process group would stop on reading the terminal
+    int job_in = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    struct line_reader lr = { in_fd, NULL, 0, 0, 0, 0 };
+    struct strbuf sb = { NULL, 0, 0 };
+    struct par_task *tasks = NULL;
+    int ntasks = 0, cap = 0;
+    int *running = arena_alloc(jobs * sizeof(int));
+    int nrunning = 0, next_flush = 0, failed = 0, no_more = 0, interrupted = 0;
+    // one job holds the running tasks, so their exits are recorded by
+    // job_record() whether the shell or the launcher reaps them
+    struct job *pj = job_new(NULL, 0, 0);
+    sigint_pending = 0;
+
+    while (1) {
+        while (!no_more && !interrupted && nrunning < jobs) {
+            const char *arg = argv_list ? *argv_list : read_line_from(&lr);
+            if (!arg) { no_more = 1; break; }
+            if (argv_list) argv_list++;
+            if (ntasks == cap) {
+                cap = cap ? cap * 2 : 64;
+                tasks = realloc(tasks, cap * sizeof(*tasks));
+                if (!tasks) { perror("malloc"); exit(EXIT_FAILURE); }
+            }
+            struct par_task *t = &tasks[ntasks];
+            t->text = par_command(&sb, tmpl, arg, ntasks);
+            t->out = memfd_create("parallel-out", MFD_CLOEXEC);
+            t->err = memfd_create("parallel-err", MFD_CLOEXEC);
+            t->status = 127;
+            t->done = 1;
+            if (t->out < 0 || t->err < 0) perror("parallel: memfd_create");
+            else if ((t->pid = par_launch(t, job_in, saved_err, &sb)) > 0) {
+                job_add_proc(pj, t->pid);
+                t->proc = pj->last;
+                t->done = 0;
+                running[nrunning++] = ntasks;
+            }
+            if (t->done && !keep) failed += par_flush(t, ntasks, out_fd, verbose);
+            ntasks++;
+        }
+        if (keep) {
+            while (next_flush < ntasks && tasks[next_flush].done) {
+                failed += par_flush(&tasks[next_flush], next_flush, out_fd, verbose);
+                next_flush++;
+            }
+        }
+        if (nrunning == 0) {
+            if (no_more || interrupted) break;
+            continue;
+        }
+
+        int r;
+        if (launcher_fd != -1) {
+            // as in job_wait(): sleep until the launcher or a child of ours reports
+            struct pollfd pfd[2] = { { sigchld_pipe[0], POLLIN, 0 }, { launcher_fd, POLLIN, 0 } };
+            if ((r = poll(pfd, 2, -1)) >= 0) {
+                sigchld_pending = 1;
+                job_reap();
+            }
+        } else {
+            int status;
+            struct rusage ru;
+            if ((r = wait4(-1, &status, 0, &ru)) > 0) job_record(r, status, &ru);
+        }
+        if (r < 0) {
+            if (errno != EINTR) break;
+            if (sigint_pending && !interrupted) {
+                // the jobs have process groups of their own: pass Ctrl-C on
+                interrupted = 1;
+                for (int k = 0; k < nrunning; ++k) {
+                    pid_t p = tasks[running[k]].pid;
+                    kill(job_control ? -p : p, SIGINT);
+                }
+            }
+            continue;
+        }
+        for (int k = 0; k < nrunning; ) {
+            struct par_task *t = &tasks[running[k]];
+            if (t->proc->state != PROC_DONE) { k++; continue; }
+            running[k] = running[--nrunning];
+            t->done = 1;
+            t->status = wait_status_code(t->proc->status);
+            if (!keep) failed += par_flush(t, t - tasks, out_fd, verbose);
         }
-        exit(EXIT_SUCCESS);
     }
-    return 0;
+
+    job_free(pj);
+    if (saved_err != -1) close(saved_err);
+    if (job_in != -1) close(job_in);
+    free(lr.buf);
+    free(sb.s);
+    free(tasks);
+    if (interrupted) return 130;
+    return failed > 101 ? 101 : failed;
 }
 
-/* Execute a simple command (no pipes). in_fd/out_fd allow redirection; -1 means use default.
-   Returns 0 normally, 2 on exit request. */
-int execute_simple_command(char **args, int in_fd, int out_fd, int is_background) {
-    if (!args[0]) return 0;
+/* ---------------- Stage statistics ---------------- */
 
-    // --- Handle builtins in parent process ---
-    if (is_builtin(args[0])) {
-        int saved_stdout = dup(STDOUT_FILENO);  // Save current stdout
+/* Fresh records for a foreground pipeline of n stages; a stage that is
+   never run keeps 127. */
+static void stats_begin(int n, int timed) {
+    if (n > pipe_stats_cap) {
+        pipe_stats_cap = n < 8 ? 8 : n;
+        pipe_stats = realloc(pipe_stats, pipe_stats_cap * sizeof(*pipe_stats));
+        pipestatus = realloc(pipestatus, pipe_stats_cap * sizeof(*pipestatus));
+    }
+    memset(pipe_stats, 0, n * sizeof(*pipe_stats));
+    for (int i = 0; i < n; ++i) pipe_stats[i].status = 127;
+    pipe_nstats = n;
+    pipe_timed = timed;
+    if (timed) clock_gettime(CLOCK_MONOTONIC, &pipe_start);
+}
 
-        // If there's output redirection, duplicate out_fd to stdout
-        if (out_fd != STDOUT_FILENO) {
-            dup2(out_fd, STDOUT_FILENO);
-        }
+/* A stage the shell ran itself, on the calling thread: its status and,
+   under time, what the thread used since ru0. maxrss stays the shell's. */
+static void stage_ran(struct stage_stat *st, int status, const struct rusage *ru0) {
+    st->status = status;
+    if (!pipe_timed) return;
+    st->ran = 1;
+    clock_gettime(CLOCK_MONOTONIC, &st->end);
+    getrusage(RUSAGE_THREAD, &st->ru);
+    timersub(&st->ru.ru_utime, &ru0->ru_utime, &st->ru.ru_utime);
+    timersub(&st->ru.ru_stime, &ru0->ru_stime, &st->ru.ru_stime);
+    st->ru.ru_nvcsw -= ru0->ru_nvcsw;
+    st->ru.ru_nivcsw -= ru0->ru_nivcsw;
+}
 
-        // If there's input redirection, duplicate in_fd to stdin
-        int saved_stdin = dup(STDIN_FILENO);
-        if (in_fd != STDIN_FILENO) {
-            dup2(in_fd, STDIN_FILENO);
-        }
+/* The pipeline is done: its statuses become PIPESTATUS. Only now, as
+   its own words still expand to those of the one before. */
+static void stats_end() {
+    for (int i = 0; i < pipe_nstats; ++i) pipestatus[i] = pipe_stats[i].status;
+    pipestatus_n = pipe_nstats;
+}
 
-        // Execute builtin
-        int handled = handle_builtin_parent(args);
+static double tv_sec(const struct timeval *tv) {
+    return tv->tv_sec + tv->tv_usec / 1e6;
+}
+
+static double ts_since(const struct timespec *end, const struct timespec *start) {
+    return (end->tv_sec - start->tv_sec) + (end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/* The time report, on stderr: one line per stage with its status, wall
+   time since the pipeline started, CPU time, peak RSS and voluntary /
+   involuntary context switches, then the totals. */
+static void time_report(struct pipeline *pl) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double user = 0, sys = 0;
+    fprintf(stderr, "%5s %6s %9s %9s %9s %8s %7s %7s  %s\n",
+            "stage", "status", "real", "user", "sys", "maxrss", "vcsw", "ivcsw", "command");
+    for (int i = 0; i < pipe_nstats; ++i) {
+        struct stage_stat *st = &pipe_stats[i];
+        struct command *cmd = &pl->cmds[i];
+        char text[64];
+        size_t n = 0;
+        for (int w = 0; w < cmd->argc; ++w) {
+            if (w) text_append(text, &n, sizeof(text), " ");
+            text_append(text, &n, sizeof(text), cmd->argv[w]);
+        }
+        text[n] = '\0';
+        if (!st->ran) {
+            fprintf(stderr, "%5d %6d %9s %9s %9s %8s %7s %7s  %s\n",
+                    i + 1, st->status, "-", "-", "-", "-", "-", "-", text);
+            continue;
+        }
+        user += tv_sec(&st->ru.ru_utime);
+        sys += tv_sec(&st->ru.ru_stime);
+        fprintf(stderr, "%5d %6d %8.3fs %8.3fs %8.3fs %7.1fM %7ld %7ld  %s\n",
+                i + 1, st->status, ts_since(&st->end, &pipe_start),
+                tv_sec(&st->ru.ru_utime), tv_sec(&st->ru.ru_stime), st->ru.ru_maxrss / 1024.0,
+                st->ru.ru_nvcsw, st->ru.ru_nivcsw, text);
+    }
+    fprintf(stderr, "real %.3fs  user %.3fs  sys %.3fs\n", ts_since(&now, &pipe_start), user, sys);
+}
 
-        // Restore standard I/O
-        dup2(saved_stdout, STDOUT_FILENO);
-        dup2(saved_stdin, STDIN_FILENO);
-        close(saved_stdout);
-        close(saved_stdin);
+/* Execute a simple command (no pipes). in_fd/out_fd allow redirection; -1 means use default.
+   pl is the command's pipeline, for the job's text. Returns 0 normally, 2 on exit request. */
+int execute_simple_command(struct pipeline *pl, char **args, int in_fd, int out_fd, int is_background) {
+    if (!args[0]) return 0;
 
-        return handled;
+    // --- Handle builtins in the shell process ---
+    if (runs_as_builtin(args)) {
+        fflush(stdout);     // keep anything printf'd so far ahead of the builtin
+        struct rusage ru0;
+        if (pipe_timed) getrusage(RUSAGE_THREAD, &ru0);
+        last_status = run_builtin(args, in_fd != -1 ? in_fd : STDIN_FILENO,
+                                  out_fd != -1 ? out_fd : STDOUT_FILENO);
+        if (!is_background) stage_ran(&pipe_stats[0], last_status, &ru0);
+        if (trace_on) trace_event(PH_WAIT, trace_name(args[0]), 0, trace_line_start);
+        return 0;
     }
 
     // --- Handle external commands ---
-    pid_t pid = fork();
-    if (pid == 0) {
-        if (in_fd != STDIN_FILENO) dup2(in_fd, STDIN_FILENO);
-        if (out_fd != STDOUT_FILENO) dup2(out_fd, STDOUT_FILENO);
-        execvp(args[0], args);
-        perror("execvp");
-        exit(1);
+    int tn = trace_on ? trace_name(args[0]) : 0;
+    if (tn) trace_event(PH_FORK, tn, 0, trace_line_start);
+    pid_t pid = launch_command(args, in_fd, out_fd, 0);
+    if (pid < 0) { last_status = spawn_status; return 0; }
+    struct job *job = job_new(pl, 0, is_background);
+    job_add_proc(job, pid);
+    if (!is_background) job->last->stat = &pipe_stats[0];
+    if (tn) trace_launched(job->last, tn);
+    if (is_background) {
+        job_launched(job);
+        last_status = 0;
     } else {
-        if (!is_background) waitpid(pid, NULL, 0);
+        last_status = job_wait(job, 1);
     }
 
     return 0;
@@ -264,286 +5612,951 @@ int execute_simple_command(char **args, int in_fd, int out_fd, int is_background
 
 
 
-int handle_redirection_in_tokens(char **tokens, int *in_fd, int *out_fd, int *append_flag) {
+/* A descriptor to read s[0..n) from. What fits in a pipe's buffer is
+   written into a pipe; anything bigger into a memfd, a file that lives
+   in memory only, which a reader may also mmap or seek. Nothing touches
+   the filesystem either way, and the text is copied once, into the
+   kernel. */
+static int here_fd(const char *s, size_t n) {
+    int p[2];
+    if (pipe2(p, O_CLOEXEC) == 0) {
+        long cap = fcntl(p[1], F_GETPIPE_SZ);
+        if (cap > 0 && n <= (size_t)cap) {
+            ssize_t w = n ? write(p[1], s, n) : 0;
+            close(p[1]);
+            if (w == (ssize_t)n) return p[0];
+            close(p[0]);
+            return -1;
+        }
+        close(p[0]);
+        close(p[1]);
+    }
+    int fd = memfd_create("here-document", MFD_CLOEXEC);
+    if (fd < 0) return -1;
+    for (size_t off = 0; off < n; ) {
+        ssize_t w = write(fd, s + off, n - off);
+        if (w < 0 && errno == EINTR) continue;
+        if (w <= 0) { close(fd); return -1; }
+        off += w;
+    }
+    lseek(fd, 0, SEEK_SET);
+    return fd;
+}
+
+/* The standard input of a << or <<< redirection */
+static int here_open(struct redirect *r) {
+    const char *s = r->body;
+    size_t n = r->blen;
+    if (r->type == REDIR_HERESTRING) {
+        // the word, expanded but not split, and a newline
+        const char *word = expand_word(r->target);
+        n = strlen(word);
+        char *t = arena_alloc(n + 1);
+        memcpy(t, word, n);
+        t[n++] = '\n';
+        s = t;
+    } else {
+        if (r->here & HERE_STRIP) {
+            // <<-: leading tabs go from every line
+            char *t = arena_alloc(n + 1), *o = t;
+            for (size_t i = 0; i < n; ) {
+                while (i < n && r->body[i] == '\t') i++;
+                while (i < n && r->body[i] != '\n') *o++ = r->body[i++];
+                if (i < n) *o++ = r->body[i++];
+            }
+            s = t;
+            n = o - t;
+        }
+        if (!(r->here & HERE_QUOTED) && (memchr(s, '$', n) || memchr(s, '`', n) || memchr(s, '\\', n)))
+            s = expand_heredoc(s, n, &n);
+    }
+    return here_fd(s, n);
+}
+
+/* Open a command's redirections in order (so every '>' target is created
+   or truncated, as in sh); the last one of each direction wins. */
+int open_redirections(struct command *cmd, int *in_fd, int *out_fd) {
     *in_fd = -1;
     *out_fd = -1;
-    *append_flag = 0;
-    for (int i = 0; tokens[i]; ++i) {
-        if (strcmp(tokens[i], "<") == 0) {
-            if (!tokens[i+1]) return -1;
-            int fd = open(tokens[i+1], O_RDONLY);
-            if (fd < 0) { perror("open"); return -1; }
-            *in_fd = fd;
-            free(tokens[i]); free(tokens[i+1]);
-            // shift tokens left
-            int j = i;
-            while (tokens[j+2]) { tokens[j] = tokens[j+2]; j++; }
-            tokens[j] = NULL;
-            tokens[j+1] = NULL;
-            i--; // re-evaluate current index
-        } else if (strcmp(tokens[i], ">") == 0 || strcmp(tokens[i], ">>") == 0) {
-            if (!tokens[i+1]) return -1;
-            int flags = O_WRONLY | O_CREAT;
-            if (strcmp(tokens[i], ">>") == 0) { flags |= O_APPEND; *append_flag = 1; }
-            else { flags |= O_TRUNC; *append_flag = 0; }
-            int fd = open(tokens[i+1], flags, 0644);
-            if (fd < 0) { perror("open"); return -1; }
-            *out_fd = fd;
-            free(tokens[i]); free(tokens[i+1]);
-            int j = i;
-            while (tokens[j+2]) { tokens[j] = tokens[j+2]; j++; }
-            tokens[j] = NULL;
-            tokens[j+1] = NULL;
-            i--;
+    for (struct redirect *r = cmd->redirs; r; r = r->next) {
+        char *target = r->target;
+        int fd;
+        if (r->type == REDIR_HEREDOC || r->type == REDIR_HERESTRING) {
+            fd = here_open(r);
+            if (fd < 0) target = r->type == REDIR_HEREDOC ? "here-document" : "here-string";
+        } else if (r->type == REDIR_IN) {
+            target = expand_word(r->target);
+            fd = open(target, O_RDONLY | O_CLOEXEC);
+        } else {
+            target = expand_word(r->target);
+            int flags = O_WRONLY | O_CREAT | O_CLOEXEC;
+            flags |= (r->type == REDIR_APPEND) ? O_APPEND : O_TRUNC;
+            fd = open(target, flags, 0644);
         }
+        if (fd < 0) {
+            fprintf(stderr, "%s: %s\n", target, strerror(errno));
+            if (*in_fd != -1) close(*in_fd);
+            if (*out_fd != -1) close(*out_fd);
+            *in_fd = *out_fd = -1;
+            return -1;
+        }
+        int *slot = (r->type == REDIR_OUT || r->type == REDIR_APPEND) ? out_fd : in_fd;
+        if (*slot != -1) close(*slot);
+        *slot = fd;
     }
     return 0;
 }
 
-/* Execute a pipeline line. Returns 0 normally, 2 on exit request */
-int execute_pipeline(char *line, int is_background) {
-    // Split by '|'
-    char *cmds[MAX_COMMANDS];
-    int cmd_count = 0;
-    char *saveptr = NULL;
-    char *sline = strdup(line);
-    char *part = strtok_r(sline, "|", &saveptr);
-    while (part && cmd_count < MAX_COMMANDS - 1) {
-        trim(part);
-        cmds[cmd_count++] = strdup(part);
-        part = strtok_r(NULL, "|", &saveptr);
-    }
-    cmds[cmd_count] = NULL;
-
-    if (cmd_count == 0) { free(sline); return 0; }
-
-    // Special-case: single command -> use execute_simple_command with redir parsing
-    if (cmd_count == 1) {
-        char *c = strdup(cmds[0]);
-        char **tokens = tokenize(c, " \t\n");
-        // detect background & remove token
-        int background = is_background;
-        int t = 0;
-        while (tokens[t]) t++;
-        if (t > 0 && strcmp(tokens[t-1], "&") == 0) { background = 1; free(tokens[t-1]); tokens[t-1]=NULL; }
-
-        int in_fd = -1, out_fd = -1, append = 0;
-        if (handle_redirection_in_tokens(tokens, &in_fd, &out_fd, &append) < 0) {
-            fprintf(stderr, "Redirection syntax error\n");
-            free_tokens(tokens); free(c);
-            free(sline);
-            for (int i=0;i<cmd_count;i++) free(cmds[i]);
+/* A builtin stage of a foreground pipeline, run on a helper thread of the
+   shell instead of a forked child. The thread owns its own dups of the
+   stage's fds and closes them when the builtin is done, which is what
+   gives the next stage EOF. A stage that only moves bytes ("< file",
+   "cat > file") has no args and is served by copy_fd(). */
+struct builtin_job {
+    char **args;                // NULL: copy stage
+    int in_fd, out_fd;
+    int status;
+    struct stage_stat *stat;
+    int trace;                  // trace name, 0: not traced
+    pthread_t thread;
+};
+
+static void *builtin_thread(void *arg) {
+    struct builtin_job *job = arg;
+    // a reader that went away must give this thread EPIPE, not kill the
+    // shell; a SIGPIPE left pending on the thread dies with it
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+    struct rusage ru0;
+    if (pipe_timed) getrusage(RUSAGE_THREAD, &ru0);
+    job->status = run_stage(job->args, job->in_fd, job->out_fd);
+    close(job->in_fd);
+    close(job->out_fd);
+    stage_ran(job->stat, job->status, &ru0);
+    if (job->trace) trace_event(PH_WAIT, job->trace, 0, trace_line_start);
+    return NULL;
+}
+
+/* Execute one pipeline. Returns 0 normally, 2 on exit request */
+int execute_pipeline(struct pipeline *pl, int is_background) {
+    // "time pipeline": each stage's cost on stderr once it is done
+    struct command *first = &pl->cmds[0];
+    int timed = first->argc > 0 && strcmp(first->argv[0], "time") == 0;
+    if (timed) {
+        first->argv++;
+        first->argc--;
+    }
+
+    // PIPESIZE=n in front of the pipeline overrides set -o pipesize for it
+    long pipe_size = opt_pipesize;
+    if (first->argc > 0 && strncmp(first->argv[0], "PIPESIZE=", 9) == 0) {
+        pipe_size = parse_size(first->argv[0] + 9);
+        if (pipe_size < 0) {
+            fprintf(stderr, "PIPESIZE: %s: bad size\n", first->argv[0] + 9);
+            last_status = 2;
+            return 0;
+        }
+        first->argv++;
+        first->argc--;
+    }
+    if (!is_background) stats_begin(pl->ncmds, timed);
+
+    // Special-case: single command -> execute_simple_command, builtins stay in the shell
+    if (pl->ncmds == 1) {
+        struct command *cmd = &pl->cmds[0];
+        // leading NAME=value words set shell variables on their own and
+        // are the command's environment in front of one
+        int nassign = assignment_words(cmd);
+        struct command words = *cmd;
+        words.argv += nassign;
+        words.argc -= nassign;
+        char **args = expand_argv(&words);
+        if (args[0] && strcmp(args[0], "exit") == 0) {
+            if (args[1]) last_status = atoi(args[1]);
+            return 2;
+        }
+
+        int in_fd, out_fd;
+        if (open_redirections(cmd, &in_fd, &out_fd) < 0) {
+            last_status = 1;
+            if (!is_background) {
+                pipe_stats[0].status = 1;
+                stats_end();
+            }
             return 0;
         }
-        int rc = execute_simple_command(tokens, in_fd, out_fd, background);
+        // a bare redirection (": > file") only creates the file
+        if (args[0]) {
+            char **saved = nassign ? arena_alloc(nassign * sizeof(char *)) : NULL;
+            var_assign(cmd->argv, nassign, 1, saved);
+            execute_simple_command(pl, args, in_fd, out_fd, is_background);
+            var_restore(saved, nassign);
+        } else {
+            last_status = 0;    // unless a $(...) in a value says otherwise
+            var_assign(cmd->argv, nassign, 0, NULL);
+        }
         if (in_fd != -1) close(in_fd);
         if (out_fd != -1) close(out_fd);
-        free_tokens(tokens); free(c);
-        free(sline); for (int i=0;i<cmd_count;i++) free(cmds[i]);
-        if (rc == 2) return 2;
+        if (!is_background) {
+            pipe_stats[0].status = last_status;
+            stats_end();
+            if (timed) time_report(pl);
+        }
         return 0;
     }
 
-    // For multiple commands -> set up pipes
+    // For multiple commands -> set up pipes (close-on-exec, so spawned
+    // stages only keep the ends the file actions dup2 onto stdin/stdout)
+    int cmd_count = pl->ncmds;
     int num_pipes = cmd_count - 1;
-    int pipefds[2 * num_pipes];
+    int *pipefds = arena_alloc(2 * num_pipes * sizeof(int));
     for (int i = 0; i < num_pipes; ++i) {
-        if (pipe(pipefds + i*2) < 0) { perror("pipe"); return 0; }
+        if (pipe2(pipefds + i*2, O_CLOEXEC) < 0) {
+            perror("pipe");
+            for (int k = 0; k < 2*i; ++k) close(pipefds[k]);
+            last_status = 1;
+            return 0;
+        }
+        // fewer, larger transfers between stages (capped by fs.pipe-max-size)
+        if (pipe_size > 0 && fcntl(pipefds[i*2], F_SETPIPE_SZ, (int)pipe_size) < 0 && i == 0)
+            fprintf(stderr, "pipesize %ld: %s\n", pipe_size, strerror(errno));
     }
+    struct job *job = job_new(pl, 0, is_background);
+    pid_t last_pid = -1;
+    int last_failed = 127;
+    struct builtin_job *jobs = arena_alloc(cmd_count * sizeof(struct builtin_job));
+    int njobs = 0;
+    int last_job = -1;
 
     for (int i = 0; i < cmd_count; ++i) {
-        char *c = strdup(cmds[i]);
-        char **tokens = tokenize(c, " \t\n");
-
-        // check background token on last command only
-        if (i == cmd_count - 1) {
-            int t = 0; while (tokens[t]) t++;
-            if (t > 0 && strcmp(tokens[t-1], "&") == 0) {
-                is_background = 1;
-                free(tokens[t-1]); tokens[t-1] = NULL;
-            }
-        }
+        struct command *cmd = &pl->cmds[i];
+        int nassign = assignment_words(cmd);
+        struct command words = *cmd;
+        words.argv += nassign;
+        words.argc -= nassign;
+        char **args = expand_argv(&words);
+        int tn = trace_on ? trace_name(args[0] ? args[0] : "<") : 0;
 
-        int in_fd = -1, out_fd = -1, append = 0;
-        if (handle_redirection_in_tokens(tokens, &in_fd, &out_fd, &append) < 0) {
-            fprintf(stderr, "Redirection syntax error\n");
-            free_tokens(tokens); free(c);
-            continue;
-        }
-
-        pid_t pid = fork();
-        if (pid == 0) {
-            // child
-            // if not first, connect read end of previous pipe to stdin
-            if (i != 0) {
-                dup2(pipefds[(i-1)*2], STDIN_FILENO);
-            } else if (in_fd != -1) {
-                dup2(in_fd, STDIN_FILENO);
-            }
+        int in_fd, out_fd;
+        pid_t pid = -1;
+        if (open_redirections(cmd, &in_fd, &out_fd) == 0) {
+            // a stage's own redirection overrides the pipe, as in sh
+            int stage_in = (in_fd != -1) ? in_fd : (i != 0) ? pipefds[(i-1)*2] : -1;
+            int stage_out = (out_fd != -1) ? out_fd : (i != cmd_count - 1) ? pipefds[i*2 + 1] : -1;
 
-            // if not last, connect stdout to write end of current pipe
-            if (i != cmd_count - 1) {
-                dup2(pipefds[i*2 + 1], STDOUT_FILENO);
-            } else if (out_fd != -1) {
-                dup2(out_fd, STDOUT_FILENO);
+            // a stage that only moves bytes ("< file", "cat < file",
+            // "cat > file"); not from the terminal, which belongs to the
+            // job's process group while it runs
+            int copy_stage = stage_in != -1 &&
+                             (!args[0] ? cmd->redirs != NULL : strcmp(args[0], "cat") == 0 && !args[1]);
+            // a builtin cat on the terminal has to be in the job's process
+            // group to read it, so its child takes the terminal itself
+            int reads_tty = 0;
+            if (job_control && cmd_count > 1 && stage_in == -1 && args[0] && strcmp(args[0], "cat") == 0) {
+                reads_tty = !args[1];
+                for (int a = 1; args[a]; ++a) reads_tty |= strcmp(args[a], "-") == 0;
             }
-
-            // close all pipe fds in child
-            for (int k = 0; k < 2*num_pipes; ++k) close(pipefds[k]);
-            if (in_fd != -1) close(in_fd);
-            if (out_fd != -1) close(out_fd);
-
-            // If builtin inside pipeline, run in child
-            if (is_builtin(tokens[0])) {
-                if (handle_builtin_child(tokens)) exit(EXIT_SUCCESS);
+            // assignments go to the environment of the stage launched here
+            char **saved = nassign ? arena_alloc(nassign * sizeof(char *)) : NULL;
+            var_assign(cmd->argv, nassign, 1, saved);
+            // a stage on a helper thread cannot be stopped with the job,
+            // so with job control (Ctrl-Z) builtin stages are children
+            if (!is_background && !job_control && (copy_stage ||
+                                   (args[0] && runs_as_builtin(args) && !builtin_needs_child(args[0])))) {
+                // runs on a helper thread once every process is launched
+                struct builtin_job *bj = &jobs[njobs];
+                bj->args = copy_stage ? NULL : args;
+                bj->in_fd = fcntl(stage_in != -1 ? stage_in : STDIN_FILENO, F_DUPFD_CLOEXEC, 3);
+                bj->out_fd = fcntl(stage_out != -1 ? stage_out : STDOUT_FILENO, F_DUPFD_CLOEXEC, 3);
+                bj->status = 0;
+                bj->stat = &pipe_stats[i];
+                bj->trace = tn;
+                if (i == cmd_count - 1) last_job = njobs;
+                njobs++;
+            } else if (!args[0] && !copy_stage) {
+                // empty stage, nothing to launch
+                if (!is_background) pipe_stats[i].status = 0;
+            } else if (!args[0] || runs_as_builtin(args)) {
+                // state-changing builtin, one that has to outlive this line
+                // or be stopped with the job
+                if (tn) trace_event(PH_FORK, tn, 0, trace_line_start);
+                pid = fork_builtin(args[0] ? args : NULL, stage_in, stage_out, job->pgid, pipefds,
+                                   2*num_pipes, reads_tty && !is_background);
+            } else {
+                if (tn) trace_event(PH_FORK, tn, 0, trace_line_start);
+                pid = launch_command(args, stage_in, stage_out, job->pgid);
+                if (pid < 0) {
+                    if (!is_background) pipe_stats[i].status = spawn_status;
+                    if (i == cmd_count - 1) last_failed = spawn_status;
+                }
             }
-
-            execvp(tokens[0], tokens);
-            fprintf(stderr, "Command failed: %s\n", strerror(errno));
-            exit(EXIT_FAILURE);
-        } else if (pid < 0) {
-            perror("fork");
-        } else {
-            // parent continues, close fds that are not needed
+            var_restore(saved, nassign);
+            // parent closes redirection fds, the child has its own copies
             if (in_fd != -1) close(in_fd);
             if (out_fd != -1) close(out_fd);
+        } else if (!is_background) {
+            pipe_stats[i].status = 1;
         }
+        if (pid > 0) {
+            job_add_proc(job, pid);
+            if (!is_background) job->last->stat = &pipe_stats[i];
+            if (tn) trace_launched(job->last, tn);
+        }
+        if (i == cmd_count - 1) last_pid = pid;
+    }
 
-        free_tokens(tokens);
-        free(c);
+    // start the builtin stages only now, so they never race the spawn
+    // loop over shell state such as the command hash
+    fflush(stdout);
+    for (int j = 0; j < njobs; ++j) {
+        if (pthread_create(&jobs[j].thread, NULL, builtin_thread, &jobs[j]) != 0) {
+            // no thread: run it inline; the stages it feeds are already running
+            builtin_thread(&jobs[j]);
+            jobs[j].thread = 0;
+        }
     }
 
     // parent closes all pipe fds
     for (int k = 0; k < 2*num_pipes; ++k) close(pipefds[k]);
 
-    // wait for children if not background
+    // wait for the job if not background; the pipeline's status is the
+    // last stage's
     if (!is_background) {
-        for (int i = 0; i < cmd_count; ++i) wait(NULL);
+        int status = job_wait(job, 1);
+        for (int j = 0; j < njobs; ++j)
+            if (jobs[j].thread) pthread_join(jobs[j].thread, NULL);
+        if (last_job >= 0) last_status = jobs[last_job].status;
+        else last_status = (last_pid > 0) ? status : last_failed;
+        stats_end();
+        if (timed) time_report(pl);
     } else {
-        printf("[Background] pipeline launched\n");
+        job_launched(job);
+        last_status = 0;
+    }
+
+    return 0;
+}
+
+/* Run pipelines joined by && and ||. A skipped pipeline leaves the
+   status alone, so "false && a || b" runs b. */
+int execute_and_or(struct and_or *ao) {
+    struct pipeline *pl = ao->first;
+    if (execute_pipeline(pl, 0) == 2) return 2;
+    while (pl->next) {
+        int run = (pl->connector == CONN_AND) ? last_status == 0 : last_status != 0;
+        pl = pl->next;
+        if (run && execute_pipeline(pl, 0) == 2) return 2;
     }
+    return 0;
+}
 
-    free(sline);
-    for (int i=0;i<cmd_count;i++) free(cmds[i]);
+/* Run a parsed line. Returns 0 normally, 2 on exit request */
+int execute_list(struct cmd_list *list) {
+    for (struct and_or *ao = list->first; ao; ao = ao->next) {
+        if (!ao->background) {
+            if (execute_and_or(ao) == 2) return 2;
+        } else if (!ao->first->next) {
+            if (execute_pipeline(ao->first, 1) == 2) return 2;
+        } else {
+            // "a && b &": the whole chain runs in a forked child, one job
+            fflush(stdout);
+            pid_t pid = fork();
+            if (pid == 0) {
+                job_child_setup(0);
+                // a SIGCHLD pipe of its own, so it never drains the shell's
+                close(sigchld_pipe[0]);
+                close(sigchld_pipe[1]);
+                if (pipe2(sigchld_pipe, O_CLOEXEC | O_NONBLOCK) < 0) sigchld_pipe[0] = sigchld_pipe[1] = -1;
+                execute_and_or(ao);
+                child_exit(last_status);
+            }
+            if (pid < 0) { perror("fork"); last_status = 1; continue; }
+            if (job_control) setpgid(pid, pid);
+            struct job *job = job_new(ao->first, 1, 1);
+            job_add_proc(job, pid);
+            job_launched(job);
+            last_status = 0;
+        }
+    }
     return 0;
 }
 
-/* Execute a line (handles history commands !n, and top-level parsing) */
+/* Execute a line (handles history commands !n, then parses the whole line once) */
 int execute_line(char *line) {
     if (!line) return 0;
     trim(line);
     if (line[0] == 0) return 0;
+    sigint_pending = 0;
+    if (trace_on) trace_line_start = trace_now();
 
     // history expansion: !! or !n
-    if (line[0] == '!') {
-        if (line[1] == '!') {
-            if (history_count == 0) { printf("No history\n"); return 0; }
-            free(line);
-            line = strdup(history[history_count - 1]);
-            printf("%s\n", line);
-        } else {
-            int idx = atoi(line + 1) - 1;
-            if (idx < 0 || idx >= history_count) { printf("No such command in history\n"); return 0; }
-            free(line);
-            line = strdup(history[idx]);
-            printf("%s\n", line);
-        }
+    if (history_enabled && line[0] == '!') {
+        history_sync();
+        int idx = (line[1] == '!') ? history_count - 1 : atoi(line + 1) - 1;
+        if (history_count == 0) { printf("No history\n"); return 0; }
+        if (idx < 0 || idx >= history_count) { printf("No such command in history\n"); return 0; }
+        size_t len;
+        const char *h = history_entry(idx, &len);
+        line = arena_strndup(h, len);
+        printf("%s\n", line);
     }
 
-    // add to history and persist
-    add_history(line);
-    save_history();
-
-    // detect background overall (if trailing & not in pipeline)
-    int is_background = 0;
-    int L = strlen(line);
-    if (L > 0 && line[L - 1] == '&') {
-        is_background = 1;
-        // but pipeline handler also checks last command
+    // add to history and persist; here-document bodies stay out of it
+    if (history_enabled) {
+        size_t first = strcspn(line, "\n");
+        const char *h = line[first] ? arena_strndup(line, first) : line;
+        if (add_history(h)) persist_history(h);
     }
+    // whatever the shell printed goes out before the line's commands write
+    fflush(stdout);
 
-    // if contains pipe
-    if (strchr(line, '|') != NULL) {
-        int rc = execute_pipeline(line, is_background);
-        return rc == 2 ? 2 : 0;
-    } else {
-        // single command - parse tokens, handle redirection
-        char *copy = strdup(line);
-        char **tokens = tokenize(copy, " \t\n");
-
-        // if empty
-        if (!tokens[0]) { free_tokens(tokens); free(copy); return 0; }
-
-        // exit special-case
-        if (strcmp(tokens[0], "exit") == 0) {
-            free_tokens(tokens); free(copy);
-            return 2;
-        }
+#ifdef MYSHELL_COUNT_MALLOC
+    line_malloc_start = malloc_calls;
+#endif
+    int rc = 0;
+    struct cmd_list *list = parse_line(line, strlen(line));
+    if (trace_on) trace_event(PH_PARSE, 0, 0, trace_line_start);
+    if (list) rc = execute_list(list);
+    else last_status = 2;
+#ifdef MYSHELL_COUNT_MALLOC
+    line_malloc_calls = malloc_calls - line_malloc_start;
+#endif
+    // everything the line allocated goes in one step
+    arena_reset();
+    return rc;
+}
 
-        // detect background at end
-        int t = 0; while (tokens[t]) t++;
-        if (t > 0 && strcmp(tokens[t-1], "&") == 0) {
-            is_background = 1;
-            free(tokens[t-1]); tokens[t-1] = NULL;
+/* ---------------- Main loop ---------------- */
+/* The bodies of a line's here-documents follow it in the input: read
+   lines until each delimiter has turned up, and return the line and the
+   bodies as one text in the arena. Body lines are read whole, however
+   long they are. */
+static char *read_heredocs(char *line) {
+    struct strbuf delims = { NULL, 0, 0 };
+    int n = strstr(line, "<<") ? here_delims(line, strlen(line), &delims) : 0;
+    if (!n) {
+        free(delims.s);
+        return line;
+    }
+    struct strbuf text = { NULL, 0, 0 };
+    sb_add(&text, line, strlen(line));
+    const char *d = delims.s;
+    char *buf = NULL;
+    size_t cap = 0;
+    while (n > 0) {
+        const char *l;
+        if (interactive) {
+            l = edit_line("> ");
+        } else {
+            ssize_t r = getline(&buf, &cap, script_in ? script_in : stdin);
+            if (r > 0 && buf[r - 1] == '\n') buf[--r] = '\0';
+            l = r < 0 ? NULL : buf;
         }
-
-        int in_fd = -1, out_fd = -1, append = 0;
-        if (handle_redirection_in_tokens(tokens, &in_fd, &out_fd, &append) < 0) {
-            fprintf(stderr, "Redirection syntax error\n");
-            free_tokens(tokens); free(copy);
-            return 0;
+        if (!l) break;
+        sb_add(&text, "\n", 1);
+        sb_add(&text, l, strlen(l));
+        if (d[0] == '-') while (*l == '\t') l++;
+        if (strcmp(l, d + 1) == 0) {
+            d += strlen(d) + 1;
+            n--;
         }
-
-        int rc = execute_simple_command(tokens, in_fd, out_fd, is_background);
-        if (in_fd != -1) close(in_fd);
-        if (out_fd != -1) close(out_fd);
-        free_tokens(tokens); free(copy);
-        return rc == 2 ? 2 : 0;
     }
+    free(buf);
+    free(delims.s);
+    arena_own(text.s);
+    return text.s;
 }
 
-/* ---------------- Main loop ---------------- */
+/* Read and run commands until EOF or exit; returns the shell's exit
+   status. Only a terminal session gets the banner, prompts and editor. */
 int main_loop() {
-    load_history();
+    interactive = !script_in && isatty(STDIN_FILENO);
+    if (history_enabled) load_history();
+    job_init();
 
-    // ASCII banner
-    system("figlet 'Welcome to My_Shell !!'");
-    printf("\n");
+    if (interactive) {
+        // ASCII banner
+        system("figlet 'Welcome to My_Shell !!'");
+        printf("\n");
+    }
 
     while (1) {
-        print_prompt();
+        job_notify();
+        if (interactive) print_prompt();
 
+        uint64_t read_start = trace_on ? trace_now() : 0;
         char *line = read_input();
         if (!line)
             break;
+        if (read_start) trace_event(PH_READ, 0, 0, read_start);
 
         // skip empty input
         if (strlen(line) == 0)
             continue;
+        line = read_heredocs(line);
 
-        // duplicate the input line before storing in history
-        add_history(strdup(line));
-
+        uint64_t start = interactive ? trace_now() : 0;
         int rc = execute_line(line);
+        if (interactive) last_command_ns = trace_now() - start;
 
         if (rc == 2)  // exit
             break;
     }
 
-    save_history();
+    if (interactive) printf("Exiting MyShell...\n");
+    return last_status;
+}
+
+/* myshell -c 'commands': parse the whole string once and run it */
+int run_command_string(const char *text) {
+    history_enabled = 0;
+    job_init();
+    struct cmd_list *list = parse_line(text, strlen(text));
+    if (!list) return 2;
+    execute_list(list);
+    return last_status;
+}
+
 
-    // free history memory
-    for (int i = 0; i < history_count; i++)
-        free(history[i]);
+/* ---------------- Script cache ---------------- */
+/* myshell script parses the whole script once, ahead of running it, and
+   keeps the trees as an image in the cache directory. A later run of the
+   same text maps the image and runs it without parsing a line. Nodes in
+   the image refer to each other and to their strings by offset from its
+   start, 0 standing for NULL, so it can be mapped anywhere; only the
+   nodes and argv vectors of the line about to run are rebuilt in the
+   arena, their strings pointing into the (private) mapping. */
+#define IMAGE_MAGIC "mysh\0img"
+#define IMAGE_VERSION 1
 
-    printf("Exiting MyShell...\n");
-    return 0;
+struct img_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t size;              // of the whole image
+    uint64_t src_size;          // the script it was compiled from
+    uint64_t src_hash;
+    uint32_t units, nunits;     // struct img_unit[nunits]
+};
+
+/* One input line with its here-documents. A line the parser rejected
+   keeps its text instead and goes through execute_line() to report it. */
+struct img_unit { uint32_t first, text; };
+struct img_and_or { uint32_t first, next; int32_t background; };
+struct img_pipeline { uint32_t cmds, ncmds, next; int32_t connector; };
+struct img_command { uint32_t argv, argc, redirs; };    // argv: uint32_t[argc]
+struct img_redirect { uint32_t target, body, blen, next; int32_t type, here; };
+
+/* 64-bit hash of n bytes, a word at a time: every run hashes the whole
+   script, so this has to keep up with memory */
+static uint64_t script_hash(const char *p, size_t n) {
+    uint64_t h = 0x9e3779b97f4a7c15ULL ^ n, w;
+    for (; n >= 8; p += 8, n -= 8) {
+        memcpy(&w, p, 8);
+        h = (h ^ w) * 0xff51afd7ed558ccdULL;
+        h ^= h >> 32;
+    }
+    w = 0;
+    memcpy(&w, p, n);
+    h = (h ^ w) * 0xff51afd7ed558ccdULL;
+    return h ^ (h >> 29);
+}
+
+/* Append n bytes at a 4-byte boundary; returns their offset */
+static uint32_t img_put(struct strbuf *img, const void *p, size_t n) {
+    while (img->len % 4) sb_add(img, "", 1);
+    uint32_t off = img->len;
+    sb_add(img, p, n);
+    return off;
+}
+
+static uint32_t img_str(struct strbuf *img, const char *s, size_t n) {
+    if (!s) return 0;
+    uint32_t off = img->len;
+    sb_add(img, s, n);
+    sb_add(img, "", 1);
+    return off;
+}
+
+/* The chains are written in order; each node's next is patched in once
+   the node after it has an offset */
+static uint32_t img_redirects(struct strbuf *img, struct redirect *r) {
+    uint32_t first = 0, prev = 0;
+    for (; r; r = r->next) {
+        struct img_redirect ir = {
+            img_str(img, r->target, strlen(r->target)), img_str(img, r->body, r->blen),
+            r->blen, 0, r->type, r->here
+        };
+        uint32_t off = img_put(img, &ir, sizeof(ir));
+        if (prev) ((struct img_redirect *)(img->s + prev))->next = off;
+        else first = off;
+        prev = off;
+    }
+    return first;
+}
+
+static uint32_t img_pipelines(struct strbuf *img, struct pipeline *pl) {
+    uint32_t first = 0, prev = 0;
+    for (; pl; pl = pl->next) {
+        struct img_command *ic = arena_alloc(pl->ncmds * sizeof(*ic));
+        for (int i = 0; i < pl->ncmds; ++i) {
+            struct command *cmd = &pl->cmds[i];
+            uint32_t *words = arena_alloc((cmd->argc + 1) * sizeof(*words));
+            for (int j = 0; j < cmd->argc; ++j) words[j] = img_str(img, cmd->argv[j], strlen(cmd->argv[j]));
+            ic[i].argv = img_put(img, words, cmd->argc * sizeof(*words));
+            ic[i].argc = cmd->argc;
+            ic[i].redirs = img_redirects(img, cmd->redirs);
+        }
+        struct img_pipeline ip = { img_put(img, ic, pl->ncmds * sizeof(*ic)), pl->ncmds, 0, pl->connector };
+        uint32_t off = img_put(img, &ip, sizeof(ip));
+        if (prev) ((struct img_pipeline *)(img->s + prev))->next = off;
+        else first = off;
+        prev = off;
+    }
+    return first;
+}
+
+static uint32_t img_and_ors(struct strbuf *img, struct and_or *ao) {
+    uint32_t first = 0, prev = 0;
+    for (; ao; ao = ao->next) {
+        struct img_and_or ia = { img_pipelines(img, ao->first), 0, ao->background };
+        uint32_t off = img_put(img, &ia, sizeof(ia));
+        if (prev) ((struct img_and_or *)(img->s + prev))->next = off;
+        else first = off;
+        prev = off;
+    }
+    return first;
+}
+
+/* Parse the script's size bytes at src into an image in img, reading
+   lines the way main_loop() does. Returns 0 if there can be no image
+   (it would not fit 32-bit offsets). */
+static int image_compile(const char *src, size_t size, uint64_t hash, struct strbuf *img) {
+    FILE *in = size ? fmemopen((void *)src, size, "r") : NULL;
+    if (size && !in) return 0;
+    struct img_header h = { IMAGE_MAGIC, IMAGE_VERSION, 0, size, hash, 0, 0 };
+    img_put(img, &h, sizeof(h));
+
+    struct img_unit *units = NULL;
+    size_t nunits = 0, cap = 0;
+    script_in = in;
+    parse_quiet = 1;
+    char *line;
+    while (in && (line = read_input())) {
+        if (line[0] == 0) continue;
+        line = read_heredocs(line);
+        trim(line);
+        if (line[0] == 0) continue;
+        parse_complaints = 0;
+        struct cmd_list *list = parse_line(line, strlen(line));
+        struct img_unit u = { 0, 0 };
+        if (list && !parse_complaints) u.first = img_and_ors(img, list->first);
+        else u.text = img_str(img, line, strlen(line));
+        if (nunits == cap) {
+            cap = cap ? cap * 2 : 256;
+            units = realloc(units, cap * sizeof(*units));
+            if (!units) { perror("malloc"); exit(EXIT_FAILURE); }
+        }
+        units[nunits++] = u;
+        arena_reset();
+    }
+    parse_quiet = 0;
+    script_in = NULL;
+    if (in) fclose(in);
+
+    h.nunits = nunits;
+    h.units = img_put(img, units, nunits * sizeof(*units));
+    free(units);
+    if (img->len > UINT32_MAX) return 0;
+    h.size = img->len;
+    memcpy(img->s, &h, sizeof(h));
+    return 1;
+}
+
+/* Whether n bytes at off lie in the image past its header, aligned as
+   the nodes are written */
+static int img_span(const struct img_header *h, uint64_t off, uint64_t n) {
+    return off >= sizeof(*h) && off % 4 == 0 && off + n <= h->size;
+}
+
+/* Whether a string of n bytes (n unknown: (size_t)-1) and its NUL start
+   at off */
+static int img_string(const char *img, uint32_t off, size_t n) {
+    const struct img_header *h = (const void *)img;
+    if (off < sizeof(*h) || off >= h->size) return 0;
+    if (n == (size_t)-1) return memchr(img + off, '\0', h->size - off) != NULL;
+    return n < h->size - off && img[off + n] == '\0';
+}
+
+/* The checks below walk every node before any of the image runs: a
+   cache file may be damaged or left by another build, and a bad offset
+   has to mean a recompile, not a crash. A chain's nodes were written in
+   order, so each next must lie further on; a damaged chain cannot loop. */
+static int img_check_redirects(const char *img, uint32_t off) {
+    const struct img_header *h = (const void *)img;
+    for (uint32_t prev = 0; off; prev = off, off = ((const struct img_redirect *)(img + off))->next) {
+        if (off <= prev || !img_span(h, off, sizeof(struct img_redirect))) return 0;
+        const struct img_redirect *ir = (const void *)(img + off);
+        if (ir->type < REDIR_IN || ir->type > REDIR_HERESTRING || !img_string(img, ir->target, -1) ||
+            (ir->body && !img_string(img, ir->body, ir->blen)))
+            return 0;
+    }
+    return 1;
+}
+
+static int img_check_pipelines(const char *img, uint32_t off) {
+    const struct img_header *h = (const void *)img;
+    if (!off) return 0;         // an and-or list has at least one
+    for (uint32_t prev = 0; off; prev = off, off = ((const struct img_pipeline *)(img + off))->next) {
+        if (off <= prev || !img_span(h, off, sizeof(struct img_pipeline))) return 0;
+        const struct img_pipeline *ip = (const void *)(img + off);
+        if (!ip->ncmds || ip->connector < CONN_END || ip->connector > CONN_OR ||
+            !img_span(h, ip->cmds, (uint64_t)ip->ncmds * sizeof(struct img_command)))
+            return 0;
+        const struct img_command *ic = (const void *)(img + ip->cmds);
+        for (uint32_t i = 0; i < ip->ncmds; ++i) {
+            if (!img_span(h, ic[i].argv, (uint64_t)ic[i].argc * sizeof(uint32_t))) return 0;
+            const uint32_t *words = (const void *)(img + ic[i].argv);
+            for (uint32_t j = 0; j < ic[i].argc; ++j)
+                if (!img_string(img, words[j], -1)) return 0;
+            if (!img_check_redirects(img, ic[i].redirs)) return 0;
+        }
+    }
+    return 1;
+}
+
+static int image_check(const char *img) {
+    const struct img_header *h = (const void *)img;
+    const struct img_unit *units = (const void *)(img + h->units);
+    for (uint32_t u = 0; u < h->nunits; ++u) {
+        if (units[u].text) {
+            if (!img_string(img, units[u].text, -1)) return 0;
+            continue;
+        }
+        uint32_t off = units[u].first;
+        for (uint32_t prev = 0; off; prev = off, off = ((const struct img_and_or *)(img + off))->next) {
+            if (off <= prev || !img_span(h, off, sizeof(struct img_and_or))) return 0;
+            if (!img_check_pipelines(img, ((const struct img_and_or *)(img + off))->first)) return 0;
+        }
+    }
+    return 1;
+}
+
+static char *img_at(char *img, uint32_t off) {
+    return off ? img + off : NULL;
+}
+
+/* Rebuild a unit's and-or lists in the arena, strings left in the image */
+static struct and_or *image_load(char *img, uint32_t off) {
+    struct and_or *first = NULL, **ao_tail = &first;
+    for (struct img_and_or *ia; (ia = (void *)img_at(img, off)); off = ia->next) {
+        struct and_or *ao = arena_alloc(sizeof(*ao));
+        ao->background = ia->background;
+        ao->next = NULL;
+        struct pipeline **pl_tail = &ao->first;
+        for (struct img_pipeline *ip = (void *)img_at(img, ia->first); ip; ip = (void *)img_at(img, ip->next)) {
+            struct pipeline *pl = arena_alloc(sizeof(*pl));
+            struct img_command *ic = (void *)(img + ip->cmds);
+            pl->ncmds = ip->ncmds;
+            pl->cmds = arena_alloc(ip->ncmds * sizeof(*pl->cmds));
+            pl->connector = ip->connector;
+            pl->next = NULL;
+            for (uint32_t i = 0; i < ip->ncmds; ++i) {
+                struct command *cmd = &pl->cmds[i];
+                uint32_t *words = (void *)(img + ic[i].argv);
+                cmd->argc = ic[i].argc;
+                cmd->argv = arena_alloc((ic[i].argc + 1) * sizeof(char *));
+                for (uint32_t j = 0; j < ic[i].argc; ++j) cmd->argv[j] = img + words[j];
+                cmd->argv[ic[i].argc] = NULL;
+                struct redirect **r_tail = &cmd->redirs;
+                for (struct img_redirect *ir = (void *)img_at(img, ic[i].redirs); ir; ir = (void *)img_at(img, ir->next)) {
+                    struct redirect *r = arena_alloc(sizeof(*r));
+                    r->type = ir->type;
+                    r->target = img + ir->target;
+                    r->body = img_at(img, ir->body);
+                    r->blen = ir->blen;
+                    r->here = ir->here;
+                    r->here_next = NULL;
+                    *r_tail = r;
+                    r_tail = &r->next;
+                }
+                *r_tail = NULL;
+            }
+            *pl_tail = pl;
+            pl_tail = &pl->next;
+        }
+        *ao_tail = ao;
+        ao_tail = &ao->next;
+    }
+    return first;
+}
+
+/* Run an image unit by unit, as main_loop() runs lines */
+static int image_run(char *img) {
+    struct img_header *h = (void *)img;
+    struct img_unit *units = (void *)(img + h->units);
+    for (uint32_t i = 0; i < h->nunits; ++i) {
+        job_notify();
+        int rc;
+        if (units[i].text) {
+            rc = execute_line(img + units[i].text);
+        } else {
+            sigint_pending = 0;
+            if (trace_on) trace_line_start = trace_now();
+            fflush(stdout);
+            struct cmd_list list = { image_load(img, units[i].first) };
+            if (trace_on) trace_event(PH_PARSE, 0, 0, trace_line_start);
+            rc = execute_list(&list);
+            arena_reset();
+        }
+        if (rc == 2)  // exit
+            break;
+    }
+    return last_status;
+}
+
+/* $MYSHELL_CACHE, else $XDG_CACHE_HOME/myshell, else ~/.cache/myshell;
+   0 if there is none or MYSHELL_CACHE is set empty to turn caching off */
+static int image_dir(char *dir, size_t n) {
+    const char *d = getenv("MYSHELL_CACHE");
+    if (d) {
+        if (!*d) return 0;
+        snprintf(dir, n, "%s", d);
+    } else if ((d = getenv("XDG_CACHE_HOME")) && *d) {
+        snprintf(dir, n, "%s/myshell", d);
+    } else if ((d = getenv("HOME")) && *d) {
+        snprintf(dir, n, "%s/.cache/myshell", d);
+    } else {
+        return 0;
+    }
+    return 1;
+}
+
+/* The image in file if it was compiled from this very text and is
+   whole, else NULL */
+static char *image_map(const char *file, size_t src_size, uint64_t src_hash, size_t *size) {
+    int fd = open(file, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return NULL;
+    struct stat st;
+    char *img = NULL;
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(struct img_header)) {
+        // private and writable: the words are expanded where they lie
+        img = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        if (img == MAP_FAILED) img = NULL;
+    }
+    close(fd);
+    if (!img) return NULL;
+    struct img_header *h = (void *)img;
+    if (memcmp(h->magic, IMAGE_MAGIC, 8) != 0 || h->version != IMAGE_VERSION || h->size != (size_t)st.st_size ||
+        h->src_size != src_size || h->src_hash != src_hash ||
+        !img_span(h, h->units, (uint64_t)h->nunits * sizeof(struct img_unit)) || !image_check(img)) {
+        munmap(img, st.st_size);
+        return NULL;
+    }
+    *size = st.st_size;
+    return img;
+}
+
+/* Write the image next to the others under a temporary name and rename
+   it into place, so a concurrent run never maps half of one. Failing to
+   save only costs the next run a parse. */
+static void image_save(char *dir, const char *file, const struct strbuf *img) {
+    char tmp[4224];
+    snprintf(tmp, sizeof(tmp), "%s.%d", file, (int)getpid());
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    if (fd < 0 && errno == ENOENT) {
+        for (char *p = dir + 1; *p; ++p) {
+            if (*p != '/') continue;
+            *p = '\0';
+            mkdir(dir, 0700);
+            *p = '/';
+        }
+        mkdir(dir, 0700);
+        fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    }
+    if (fd < 0) return;
+    size_t done = 0;
+    while (done < img->len) {
+        ssize_t n = write(fd, img->s + done, img->len - done);
+        if (n <= 0) break;
+        done += n;
+    }
+    if (close(fd) != 0 || done < img->len || rename(tmp, file) != 0) unlink(tmp);
 }
 
+/* myshell script: run the script's cached image, compiling and saving
+   one first if there is none for this text. Anything but a regular
+   file is read and run line by line by main_loop(). */
+int run_script(const char *path) {
+    history_enabled = 0;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) { fprintf(stderr, "myshell: %s: %s\n", path, strerror(errno)); return 127; }
+    struct stat st;
+    int regular = fstat(fd, &st) == 0 && S_ISREG(st.st_mode);
+    size_t size = regular ? st.st_size : 0;
+    char *src = NULL;
+    if (size) {
+        src = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (src == MAP_FAILED) src = NULL;
+    }
+    if (!regular || (size && !src)) {
+        script_in = fdopen(fd, "r");
+        return main_loop();
+    }
+    close(fd);
+    uint64_t hash = script_hash(src, size);
+
+    // one image per script path, named after the path's hash
+    char dir[4096], file[4200], real[4096];
+    int cache = image_dir(dir, sizeof(dir));
+    if (cache) {
+        const char *name = realpath(path, real) ? real : path;
+        snprintf(file, sizeof(file), "%s/%016llx.img", dir, (unsigned long long)script_hash(name, strlen(name)));
+    }
+    size_t img_size = 0;
+    char *img = cache ? image_map(file, size, hash, &img_size) : NULL;
+    struct strbuf built = { NULL, 0, 0 };
+    if (!img) {
+        if (!image_compile(src, size, hash, &built)) {
+            free(built.s);
+            script_in = fmemopen(src, size, "r");
+            return main_loop();
+        }
+        if (cache) image_save(dir, file, &built);
+        img = built.s;
+    }
+    if (src) munmap(src, size);
+
+    job_init();
+    int status = image_run(img);
+    if (built.s) free(built.s);
+    else munmap(img, img_size);
+    return status;
+}
 
+#ifndef MYSHELL_NO_MAIN
 int main(int argc, char **argv) {
-    // If already inside the new terminal (child process)
-    if (argc > 1 && strcmp(argv[1], "--child") == 0) {
+    // myshell -o launcher ...: start the launcher first, while we are small
+    if (argc > 2 && strcmp(argv[1], "-o") == 0) {
+        if (strcmp(argv[2], "launcher") != 0) { fprintf(stderr, "myshell: %s: no such option\n", argv[2]); return 2; }
+        launcher_start();
+        argv[2] = argv[0];
+        argv += 2;
+        argc -= 2;
+    }
+    // myshell -c 'commands' and myshell script: no terminal needed, run right away
+    if (argc > 1 && strcmp(argv[1], "-c") == 0) {
+        if (argc < 3) { fprintf(stderr, "myshell: -c: option requires an argument\n"); return 2; }
+        return run_command_string(argv[2]);
+    }
+    if (argc > 1 && strcmp(argv[1], "--child") != 0) {
+        return run_script(argv[1]);
+    }
+
+    // If already inside the new terminal (child process), or if commands
+    // come from a pipe or file, there is no terminal to open
+    if (argc > 1 || !isatty(STDIN_FILENO)) {
         return main_loop();
     }
 
@@ -574,3 +6587,4 @@ int main(int argc, char **argv) {
     printf("⚠️ No compatible terminal emulator found — running inline.\n");
     return main_loop();
 }
+#endif /* MYSHELL_NO_MAIN */
@@ -0,0 +1,217 @@
+// bench.c  -- regression benchmark for the shell: latency percentiles per operation
+//
+// Build:  gcc -O2 bench/bench.c -o shell_bench -pthread
+// Run:    ./shell_bench [-n reps] [-w warmup] [-s stages] [-m mb] [-H entries] [-o file.json] [shell]
+//
+// Every case is warmed up, then timed rep by rep, and reported as mean and
+// p50/p95/p99 in microseconds. With -o the same numbers are written as JSON,
+// one object per case, so two runs can be diffed.
+//
+//   startup       shell -c echo, a cold start running one builtin
+//   history_load  shell reading "!!" on stdin with an -H entry history,
+//                 i.e. start-up plus mapping and indexing the history
+//   launch        one external command (true), run in-process
+//   builtin       echo, run in-process
+//   pipeline      -s stage "true | true | ..." pipeline, run in-process
+//   throughput    -m MB through "cat file | cat | cat > /dev/null"
+//
+// The in-process cases call execute_line() directly, so they measure the
+// command path itself without the shell's start-up in every sample.
+#define MYSHELL_NO_MAIN
+#include "../CP_1.c"
+
+#include <time.h>
+#include <getopt.h>
+
+struct result {
+    const char *name;
+    double mean, p50, p95, p99;
+    double mb;                  // throughput case: megabytes per rep
+};
+
+static struct result results[8];
+static int nresults = 0;
+
+static double now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static double pct(double *sorted, int n, double q) {
+    return sorted[(int)(q * (n - 1) + 0.5)];
+}
+
+static void record(const char *name, double *samples, int n, double mb) {
+    qsort(samples, n, sizeof(double), cmp_double);
+    double sum = 0;
+    for (int i = 0; i < n; ++i) sum += samples[i];
+    struct result *r = &results[nresults++];
+    r->name = name;
+    r->mean = sum / n;
+    r->p50 = pct(samples, n, 0.50);
+    r->p95 = pct(samples, n, 0.95);
+    r->p99 = pct(samples, n, 0.99);
+    r->mb = mb;
+    printf("%-13s mean %9.1f us   p50 %9.1f us   p95 %9.1f us   p99 %9.1f us",
+           name, r->mean, r->p50, r->p95, r->p99);
+    if (mb > 0) printf("   %7.1f MB/s at p50", mb / (r->p50 / 1e6));
+    printf("\n");
+    fflush(stdout);
+}
+
+/* Time one line through execute_line() with stdout on /dev/null */
+static void bench_line(const char *name, const char *line, int reps, int warmup, double mb,
+                       double *samples, int devnull) {
+    char *buf = malloc(strlen(line) + 1);
+    int saved_out = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 3);
+    fflush(stdout);
+    dup2(devnull, STDOUT_FILENO);
+    for (int i = -warmup; i < reps; ++i) {
+        strcpy(buf, line);
+        double t0 = now_us();
+        execute_line(buf);
+        if (i >= 0) samples[i] = now_us() - t0;
+    }
+    fflush(stdout);
+    dup2(saved_out, STDOUT_FILENO);
+    close(saved_out);
+    free(buf);
+    record(name, samples, reps, mb);
+}
+
+/* Time a launch of the shell itself, optionally feeding it input on stdin */
+static void bench_shell(const char *name, char **args, const char *input, int reps, int warmup,
+                        double *samples, int devnull) {
+    for (int i = -warmup; i < reps; ++i) {
+        int p[2] = { -1, -1 };
+        if (input) {
+            if (pipe2(p, O_CLOEXEC) < 0) { perror("pipe"); exit(1); }
+            ssize_t n = write(p[1], input, strlen(input));
+            (void)n;
+            close(p[1]);
+        }
+        double t0 = now_us();
+        pid_t pid = spawn_command(args, p[0], devnull, 0);
+        if (pid > 0) waitpid(pid, NULL, 0);
+        if (i >= 0) samples[i] = now_us() - t0;
+        if (p[0] != -1) close(p[0]);
+    }
+    record(name, samples, reps, 0);
+}
+
+static int write_file(const char *path, const char *data, size_t len, size_t total) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0) return -1;
+    for (size_t done = 0; done < total; done += len) {
+        size_t n = total - done < len ? total - done : len;
+        if (write(fd, data, n) != (ssize_t)n) { close(fd); return -1; }
+    }
+    return close(fd);
+}
+
+static void write_json(const char *path, const char *shell, int reps, int warmup) {
+    FILE *f = fopen(path, "w");
+    if (!f) { perror(path); return; }
+    fprintf(f, "{\n  \"shell\": \"%s\",\n  \"reps\": %d,\n  \"warmup\": %d,\n  \"cases\": [\n",
+            shell, reps, warmup);
+    for (int i = 0; i < nresults; ++i) {
+        struct result *r = &results[i];
+        fprintf(f, "    {\"name\": \"%s\", \"unit\": \"us\", \"mean\": %.1f, \"p50\": %.1f, "
+                   "\"p95\": %.1f, \"p99\": %.1f",
+                r->name, r->mean, r->p50, r->p95, r->p99);
+        if (r->mb > 0) fprintf(f, ", \"mb_per_s_p50\": %.1f", r->mb / (r->p50 / 1e6));
+        fprintf(f, "}%s\n", i + 1 < nresults ? "," : "");
+    }
+    fprintf(f, "  ]\n}\n");
+    fclose(f);
+}
+
+int main(int argc, char **argv) {
+    int reps = 200, warmup = 20, stages = 8, mb = 64, entries = 50000;
+    const char *json = NULL;
+    int c;
+    while ((c = getopt(argc, argv, "n:w:s:m:H:o:")) != -1) {
+        switch (c) {
+        case 'n': reps = atoi(optarg); break;
+        case 'w': warmup = atoi(optarg); break;
+        case 's': stages = atoi(optarg); break;
+        case 'm': mb = atoi(optarg); break;
+        case 'H': entries = atoi(optarg); break;
+        case 'o': json = optarg; break;
+        default:
+            fprintf(stderr, "usage: %s [-n reps] [-w warmup] [-s stages] [-m mb] [-H entries] "
+                            "[-o file.json] [shell]\n", argv[0]);
+            return 2;
+        }
+    }
+    if (reps < 1) reps = 1;
+    if (warmup < 0) warmup = 0;
+    if (stages < 2) stages = 2;
+    if (mb < 1) mb = 1;
+    char shell[4096];
+    if (!realpath(optind < argc ? argv[optind] : "./myshell", shell)) {
+        perror(optind < argc ? argv[optind] : "./myshell");
+        return 1;
+    }
+
+    // scratch directory: the data file and a history of `entries` lines
+    char start_dir[4096];
+    if (!getcwd(start_dir, sizeof(start_dir))) { perror("getcwd"); return 1; }
+    char dir[] = "/tmp/myshell_benchXXXXXX";
+    if (!mkdtemp(dir) || chdir(dir) < 0) { perror("mkdtemp"); return 1; }
+    char chunk[1 << 16];
+    for (size_t i = 0; i < sizeof(chunk); ++i) chunk[i] = 'a' + i % 26;
+    chunk[sizeof(chunk) - 1] = '\n';
+    char data[64];
+    snprintf(data, sizeof(data), "%s/data", dir);
+    if (write_file(data, chunk, sizeof(chunk), (size_t)mb << 20) < 0) { perror(data); return 1; }
+    FILE *h = fopen(HISTORY_FILE, "w");
+    if (!h) { perror(HISTORY_FILE); return 1; }
+    for (int i = 0; i < entries; ++i) fprintf(h, "echo history entry %d\n", i);
+    fclose(h);
+
+    int devnull = open("/dev/null", O_RDWR | O_CLOEXEC);
+    double *samples = malloc(sizeof(double) * reps);
+    history_enabled = 0;        // in-process cases must not touch the history file
+    job_init();
+
+    printf("%s: %d reps after %d warm-up, %d-stage pipeline, %d MB, %d history entries\n",
+           shell, reps, warmup, stages, mb, entries);
+
+    char *startup[] = { shell, "-c", "echo", NULL };
+    bench_shell("startup", startup, NULL, reps, warmup, samples, devnull);
+    char *piped[] = { shell, NULL };
+    bench_shell("history_load", piped, "!!\n", reps, warmup, samples, devnull);
+
+    bench_line("launch", "true", reps, warmup, 0, samples, devnull);
+    bench_line("builtin", "echo builtin", reps, warmup, 0, samples, devnull);
+
+    char *pipeline = malloc(stages * 7 + 1);
+    char *p = pipeline + strlen(strcpy(pipeline, "true"));
+    for (int i = 1; i < stages; ++i) p = stpcpy(p, " | true");
+    bench_line("pipeline", pipeline, reps, warmup, 0, samples, devnull);
+    free(pipeline);
+
+    char line[4096];
+    snprintf(line, sizeof(line), "cat %s | cat | cat > /dev/null", data);
+    int treps = reps < 20 ? reps : 20;      // each rep moves the whole file
+    bench_line("throughput", line, treps, warmup < 2 ? warmup : 2, mb, samples, devnull);
+
+    // relative -o paths are relative to where we were started
+    if (chdir(start_dir) == 0 && json) write_json(json, shell, reps, warmup);
+
+    unlink(data);
+    char hist[64];
+    snprintf(hist, sizeof(hist), "%s/%s", dir, HISTORY_FILE);
+    unlink(hist);
+    rmdir(dir);
+    free(samples);
+    close(devnull);
+    return 0;
+}
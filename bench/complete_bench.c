@@ -0,0 +1,111 @@
+// complete_bench.c  -- Tab completion of command names over a big PATH directory
+//
+// Build:  gcc -O2 bench/complete_bench.c -o complete_bench -pthread
+// Run:    ./complete_bench [binaries] [reps]     (defaults: 5000 binaries, 100000 lookups)
+//
+// Fills a scratch directory with executables, puts it in front of $PATH
+// and reports:
+//   build    start of the trie thread until the first trie is published
+//   tab      complete_word() for a random prefix of a random name, as a
+//            Tab press does, p50 and p99
+//   list     the same with every candidate collected, for a 2-letter prefix
+//   refresh  a new executable dropped in the directory until Tab offers
+//            it, through inotify and a rebuild on the thread
+#define MYSHELL_NO_MAIN
+#include "../CP_1.c"
+
+static double now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static size_t lookup(const char *word, size_t n, struct strbuf *names) {
+    struct strbuf common = { NULL, 0, 0 };
+    size_t count = complete_word(word, n, 1, &common, names, names ? (size_t)-1 : 0);
+    free(common.s);
+    return count;
+}
+
+int main(int argc, char **argv) {
+    int nbin = argc > 1 ? atoi(argv[1]) : 5000;
+    int reps = argc > 2 ? atoi(argv[2]) : 100000;
+    if (nbin < 1) nbin = 1;
+    if (reps < 1) reps = 1;
+
+    char dir[] = "/tmp/complete_benchXXXXXX";
+    if (!mkdtemp(dir)) { perror("mkdtemp"); return 1; }
+    static const char *stems[] = { "git", "python", "perl", "x86_64-linux-gnu-", "lib", "k", "z", "gcc" };
+    char **names = malloc(nbin * sizeof(char *));
+    char path[256];
+    for (int i = 0; i < nbin; ++i) {
+        char name[64];
+        snprintf(name, sizeof(name), "%s%x-tool%d", stems[i % 8], (i * 2654435761u) >> 20, i);
+        names[i] = strdup(name);
+        snprintf(path, sizeof(path), "%s/%s", dir, name);
+        int fd = open(path, O_WRONLY | O_CREAT | O_CLOEXEC, 0755);
+        if (fd < 0) { perror(path); return 1; }
+        close(fd);
+    }
+    const char *old = getenv("PATH");
+    char *newpath = malloc(strlen(dir) + (old ? strlen(old) : 0) + 2);
+    sprintf(newpath, "%s:%s", dir, old ? old : "");
+    var_set("PATH", newpath, 1);
+
+    double t0 = now_us();
+    complete_prompt();
+    lookup("", 0, NULL);         // waits for the first trie
+    printf("%d binaries in %s\n", nbin, dir);
+    printf("build    %9.1f us\n", now_us() - t0);
+
+    double *samples = malloc(reps * sizeof(double));
+    unsigned seed = 1;
+    size_t found = 0;
+    for (int i = 0; i < reps; ++i) {
+        const char *name = names[rand_r(&seed) % nbin];
+        size_t n = 1 + rand_r(&seed) % strlen(name);
+        t0 = now_us();
+        found += lookup(name, n, NULL);
+        samples[i] = now_us() - t0;
+    }
+    qsort(samples, reps, sizeof(double), cmp_double);
+    printf("tab      p50 %6.2f us   p99 %6.2f us   (%.0f candidates on average)\n",
+           samples[reps / 2], samples[(int)(reps * 0.99)], (double)found / reps);
+
+    int lreps = reps / 100 > 0 ? reps / 100 : 1;
+    size_t count = 0;
+    for (int i = 0; i < lreps; ++i) {
+        struct strbuf list = { NULL, 0, 0 };
+        t0 = now_us();
+        count = lookup("gi", 2, &list);
+        samples[i] = now_us() - t0;
+        free(list.s);
+    }
+    qsort(samples, lreps, sizeof(double), cmp_double);
+    printf("list     p50 %6.2f us   (%zu candidates)\n", samples[lreps / 2], count);
+
+    snprintf(path, sizeof(path), "%s/freshly-installed", dir);
+    t0 = now_us();
+    int fd = open(path, O_WRONLY | O_CREAT | O_CLOEXEC, 0755);
+    if (fd >= 0) close(fd);
+    while (!lookup("freshly-", 8, NULL) && now_us() - t0 < 5e6) usleep(100);
+    printf("refresh  %9.1f us\n", now_us() - t0);
+
+    for (int i = 0; i < nbin; ++i) {
+        snprintf(path, sizeof(path), "%s/%s", dir, names[i]);
+        unlink(path);
+        free(names[i]);
+    }
+    snprintf(path, sizeof(path), "%s/freshly-installed", dir);
+    unlink(path);
+    rmdir(dir);
+    free(names);
+    free(samples);
+    free(newpath);
+    return 0;
+}
@@ -0,0 +1,95 @@
+// glob_bench.c  -- the shell's glob against glob(3) on a big directory
+//
+// Build:  gcc -O2 bench/glob_bench.c -o glob_bench -pthread
+// Run:    ./glob_bench [files] [reps]     (defaults: 100000 files, 5 runs)
+//
+// Fills a scratch directory with files, a tenth of them *.c, and a tree
+// of 16 x 16 directories below it, then reports the p50 time of
+//   dir/*.c      glob(3), the shell cold (cache flushed) and warm
+//   dir/**/*.c   glob(3) cannot do it; the shell cold and warm
+// The shell's warm case is one stat per directory: the entries come from
+// the getdents64 cache.
+#define MYSHELL_NO_MAIN
+#include "../CP_1.c"
+
+#include <glob.h>
+
+static double now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/* p50 of reps runs of pattern: 0 glob(3), 1 the shell cold, 2 warm */
+static double run(const char *pattern, int how, int reps, double *samples, size_t *count) {
+    for (int i = 0; i < reps; ++i) {
+        if (how == 1) dir_cache_flush();
+        double t0 = now_us();
+        if (how == 0) {
+            glob_t g;
+            *count = glob(pattern, 0, NULL, &g) == 0 ? g.gl_pathc : 0;
+            globfree(&g);
+        } else {
+            char **paths;
+            *count = glob_expand(pattern, &paths);
+            if (*count) free(paths);
+        }
+        samples[i] = now_us() - t0;
+    }
+    qsort(samples, reps, sizeof(double), cmp_double);
+    return samples[reps / 2];
+}
+
+int main(int argc, char **argv) {
+    int files = argc > 1 ? atoi(argv[1]) : 100000;
+    int reps = argc > 2 ? atoi(argv[2]) : 5;
+    if (files < 10) files = 10;
+    if (reps < 1) reps = 1;
+
+    char dir[] = "/tmp/glob_benchXXXXXX";
+    if (!mkdtemp(dir)) { perror("mkdtemp"); return 1; }
+    char path[256];
+    for (int i = 0; i < files; ++i) {
+        snprintf(path, sizeof(path), "%s/file%07d.%s", dir, i, i % 10 ? "txt" : "c");
+        int fd = open(path, O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+        if (fd < 0) { perror(path); return 1; }
+        close(fd);
+    }
+    for (int a = 0; a < 16; ++a) {
+        snprintf(path, sizeof(path), "%s/d%02d", dir, a);
+        mkdir(path, 0755);
+        for (int b = 0; b < 16; ++b) {
+            snprintf(path, sizeof(path), "%s/d%02d/e%02d", dir, a, b);
+            mkdir(path, 0755);
+            for (int f = 0; f < 8; ++f) {
+                snprintf(path, sizeof(path), "%s/d%02d/e%02d/f%d.c", dir, a, b, f);
+                close(open(path, O_WRONLY | O_CREAT | O_CLOEXEC, 0644));
+            }
+        }
+    }
+    // directories changed in the last second are not cached: let them age
+    sleep(2);
+
+    double *samples = malloc(sizeof(double) * reps);
+    size_t n;
+    char pat[256];
+    printf("%d files, p50 of %d runs\n", files, reps);
+    snprintf(pat, sizeof(pat), "%s/*.c", dir);
+    printf("*.c     glob(3) %9.0f us", run(pat, 0, reps, samples, &n));
+    printf("   shell cold %9.0f us", run(pat, 1, reps, samples, &n));
+    printf("   warm %9.0f us   (%zu matches)\n", run(pat, 2, reps, samples, &n), n);
+    snprintf(pat, sizeof(pat), "%s/**/*.c", dir);
+    printf("**/*.c  shell cold %9.0f us", run(pat, 1, reps, samples, &n));
+    printf("   warm %9.0f us   (%zu matches)\n", run(pat, 2, reps, samples, &n), n);
+
+    char cmd[512];
+    snprintf(cmd, sizeof(cmd), "rm -rf %s", dir);
+    if (system(cmd) != 0) fprintf(stderr, "could not remove %s\n", dir);
+    free(samples);
+    return 0;
+}
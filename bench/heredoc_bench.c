@@ -0,0 +1,90 @@
+// heredoc_bench.c  -- here-documents against the temp file scripts used to write
+//
+// Build:  gcc -O2 bench/heredoc_bench.c -o heredoc_bench -pthread
+// Run:    ./heredoc_bench [reps] [kb...]     (sizes default to 4 1024 16384)
+//
+// For every size a body of that many KB is fed to "wc -c" two ways, run
+// in-process through execute_line():
+//   heredoc    wc -c <<EOF ... EOF          a pipe, or a memfd past 64 KB
+//   tempfile   echo '...' > file in $TMPDIR, then wc -c < file, and the
+//              file removed, as scripts did without <<
+// and the p50 time of each is reported.
+#define MYSHELL_NO_MAIN
+#include "../CP_1.c"
+
+static double now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+int main(int argc, char **argv) {
+    int reps = argc > 1 ? atoi(argv[1]) : 20;
+    char *default_sizes[] = { "4", "1024", "16384" };
+    char **sizes = argc > 2 ? argv + 2 : default_sizes;
+    int nsizes = argc > 2 ? argc - 2 : 3;
+    if (reps < 1) reps = 1;
+
+    history_enabled = 0;
+    job_init();
+    const char *tmpdir = getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp";
+    int devnull = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    int saved_out = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 3);
+    FILE *report = fdopen(saved_out, "w");
+    double *samples[2] = { malloc(reps * sizeof(double)), malloc(reps * sizeof(double)) };
+    fprintf(report, "p50 of %d runs\n%-8s %12s %12s\n", reps, "KB", "heredoc", "tempfile");
+
+    for (int s = 0; s < nsizes; ++s) {
+        size_t kb = atol(sizes[s]) > 0 ? atol(sizes[s]) : 1, n = kb << 10;
+        char *body = malloc(n);
+        for (size_t i = 0; i < n; ++i) body[i] = (i % 64 == 63) ? '\n' : 'a' + i % 26;
+        size_t tlen = n + 4200;
+        char *text = malloc(tlen), *work = malloc(tlen);
+        int len = snprintf(text, tlen, "wc -c <<EOF\n");
+        memcpy(text + len, body, n);
+        len += n;
+        len += snprintf(text + len, tlen - len, "EOF");
+        char path[4096];
+        snprintf(path, sizeof(path), "%s/heredoc_bench.%d", tmpdir, (int)getpid());
+        char *etext = malloc(tlen + sizeof(path)), line[4200];
+        int elen = snprintf(etext, tlen, "echo '");
+        memcpy(etext + elen, body, n - 1);      // echo adds the last newline
+        elen += n - 1;
+        elen += sprintf(etext + elen, "' > %s", path);
+        snprintf(line, sizeof(line), "wc -c < %s", path);
+
+        dup2(devnull, STDOUT_FILENO);
+        for (int i = -1; i < reps; ++i) {
+            memcpy(work, text, len + 1);        // execute_line() trims in place
+            double t0 = now_us();
+            execute_line(work);
+            if (i >= 0) samples[0][i] = now_us() - t0;
+
+            memcpy(work, etext, elen + 1);
+            t0 = now_us();
+            execute_line(work);
+            execute_line(line);
+            unlink(path);
+            if (i >= 0) samples[1][i] = now_us() - t0;
+        }
+        fflush(stdout);
+        qsort(samples[0], reps, sizeof(double), cmp_double);
+        qsort(samples[1], reps, sizeof(double), cmp_double);
+        fprintf(report, "%-8zu %9.0f us %9.0f us\n", kb, samples[0][reps / 2], samples[1][reps / 2]);
+        fflush(report);
+        free(body);
+        free(text);
+        free(etext);
+        free(work);
+    }
+    free(samples[0]);
+    free(samples[1]);
+    fclose(report);
+    close(devnull);
+    return 0;
+}
@@ -0,0 +1,79 @@
+// launch_bench.c  -- before/after launch latency: fork()+execvp vs the posix_spawn engine
+//
+// Build:  gcc -O2 bench/launch_bench.c -o launch_bench
+// Run:    ./launch_bench [iterations] [ballast_mb]
+//
+// ballast_mb grows the benchmark's heap (and touches every page) to mimic a
+// long-running shell with a big history; fork() has to copy those page
+// tables on every launch, posix_spawn does not.
+#define MYSHELL_NO_MAIN
+#include "../CP_1.c"
+
+#include <time.h>
+
+static double now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/* The launch path CP_1.c used before the spawn engine */
+static pid_t fork_exec(char **args, int in_fd, int out_fd) {
+    pid_t pid = fork();
+    if (pid == 0) {
+        if (in_fd != -1) dup2(in_fd, STDIN_FILENO);
+        if (out_fd != -1) dup2(out_fd, STDOUT_FILENO);
+        execvp(args[0], args);
+        _exit(127);
+    }
+    return pid;
+}
+
+static void report(const char *name, double *samples, int n) {
+    qsort(samples, n, sizeof(double), cmp_double);
+    double sum = 0;
+    for (int i = 0; i < n; ++i) sum += samples[i];
+    printf("%-12s mean %8.1f us   p50 %8.1f us   p99 %8.1f us\n",
+           name, sum / n, samples[n / 2], samples[(int)(n * 0.99)]);
+}
+
+int main(int argc, char **argv) {
+    int iterations = argc > 1 ? atoi(argv[1]) : 500;
+    size_t ballast_mb = argc > 2 ? strtoul(argv[2], NULL, 10) : 256;
+    if (iterations < 1) iterations = 1;
+
+    char *ballast = malloc(ballast_mb << 20);
+    if (ballast) memset(ballast, 1, ballast_mb << 20);
+
+    int devnull = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    char *args[] = { "true", NULL };
+    double *samples = malloc(sizeof(double) * iterations);
+
+    printf("launching '%s' %d times, %zu MB ballast\n", args[0], iterations, ballast_mb);
+
+    for (int i = 0; i < iterations; ++i) {
+        double t0 = now_us();
+        pid_t pid = fork_exec(args, -1, devnull);
+        waitpid(pid, NULL, 0);
+        samples[i] = now_us() - t0;
+    }
+    report("fork+execvp", samples, iterations);
+
+    for (int i = 0; i < iterations; ++i) {
+        double t0 = now_us();
+        pid_t pid = spawn_command(args, -1, devnull, 0);
+        waitpid(pid, NULL, 0);
+        samples[i] = now_us() - t0;
+    }
+    report("posix_spawn", samples, iterations);
+
+    free(samples);
+    free(ballast);
+    close(devnull);
+    return 0;
+}
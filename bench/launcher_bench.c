@@ -0,0 +1,105 @@
+// launcher_bench.c  -- launch latency in a large session: fork, posix_spawn, launcher
+//
+// Build:  gcc -O2 bench/launcher_bench.c -o launcher_bench -pthread
+// Run:    ./launcher_bench [iterations] [history_entries] [ballast_mb]
+//
+// The launcher is started first, while the process is small. Then the
+// benchmark grows into a long-running session: it loads and indexes a
+// history of history_entries lines and touches ballast_mb MB of heap.
+// Each case launches /bin/true and waits for it:
+//   fork+exec    the shell's old path, fork() copies the session's page tables
+//   posix_spawn  "/bin/true" through execute_line(), the default engine
+//   launcher     the same line with set -o launcher, the helper forks
+#define MYSHELL_NO_MAIN
+#include "../CP_1.c"
+
+#include <time.h>
+
+static double now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static void report(const char *name, double *samples, int n) {
+    qsort(samples, n, sizeof(double), cmp_double);
+    double sum = 0;
+    for (int i = 0; i < n; ++i) sum += samples[i];
+    printf("%-12s mean %8.1f us   p50 %8.1f us   p99 %8.1f us\n",
+           name, sum / n, samples[n / 2], samples[(int)(n * 0.99)]);
+    fflush(stdout);
+}
+
+static void bench_line(const char *name, int iterations, double *samples) {
+    char buf[64];
+    for (int i = 0; i < iterations; ++i) {
+        strcpy(buf, "/bin/true");
+        double t0 = now_us();
+        execute_line(buf);
+        samples[i] = now_us() - t0;
+    }
+    report(name, samples, iterations);
+}
+
+int main(int argc, char **argv) {
+    int iterations = argc > 1 ? atoi(argv[1]) : 500;
+    int entries = argc > 2 ? atoi(argv[2]) : 100000;
+    size_t ballast_mb = argc > 3 ? strtoul(argv[3], NULL, 10) : 256;
+    if (iterations < 1) iterations = 1;
+    if (entries > MAX_HISTORY) entries = MAX_HISTORY;
+
+    // start the launcher before anything else, as myshell -o launcher does
+    if (launcher_start() < 0) return 1;
+    int launcher = launcher_fd;
+    launcher_fd = -1;           // off until its own case
+
+    char dir[] = "/tmp/launcher_benchXXXXXX";
+    if (!mkdtemp(dir) || chdir(dir) < 0) { perror("mkdtemp"); return 1; }
+    FILE *h = fopen(HISTORY_FILE, "w");
+    if (!h) { perror(HISTORY_FILE); return 1; }
+    for (int i = 0; i < entries; ++i) fprintf(h, "echo history entry %d with some more words\n", i);
+    fclose(h);
+    load_history();
+    history_sync();
+    history_search("entry 1", 7, history_count);    // builds the trigram index
+    char *ballast = malloc(ballast_mb << 20);
+    if (ballast) memset(ballast, 1, ballast_mb << 20);
+
+    history_enabled = 0;
+    job_init();
+    double *samples = malloc(sizeof(double) * iterations);
+    printf("launching /bin/true %d times, %d history entries, %zu MB ballast\n",
+           iterations, history_count, ballast_mb);
+
+    char *args[] = { "/bin/true", NULL };
+    for (int i = 0; i < iterations; ++i) {
+        double t0 = now_us();
+        fflush(stdout);
+        pid_t pid = fork();
+        if (pid == 0) {
+            execv(args[0], args);
+            _exit(127);
+        }
+        waitpid(pid, NULL, 0);
+        samples[i] = now_us() - t0;
+    }
+    report("fork+exec", samples, iterations);
+
+    bench_line("posix_spawn", iterations, samples);
+    launcher_fd = launcher;
+    bench_line("launcher", iterations, samples);
+    launcher_stop();
+
+    char hist[64];
+    snprintf(hist, sizeof(hist), "%s/%s", dir, HISTORY_FILE);
+    unlink(hist);
+    rmdir(dir);
+    free(samples);
+    free(ballast);
+    return 0;
+}
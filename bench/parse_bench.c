@@ -0,0 +1,135 @@
+// parse_bench.c  -- parse throughput of the single-pass lexer/parser on generated scripts
+//
+// Build:  gcc -O2 bench/parse_bench.c -o parse_bench
+// Run:    ./parse_bench [script_mb] [repetitions]
+//
+// Generates a script of script_mb MB mixing pipelines, redirections,
+// quoting, && / || chains and background jobs, then reports MB/s and
+// lines/s for parse_line() over the whole script, and for the old
+// strtok/trim/strdup tokenizer on the same lines for comparison. Last
+// come single generated lines of 10k to 1M words and of 1k to 100k
+// stages, whose ns/word should stay flat as they grow.
+#define MYSHELL_NO_MAIN
+#include "../CP_1.c"
+
+#include <time.h>
+
+#define LEGACY_MAX_TOKENS 256   // the old tokenizer's fixed argv
+
+static double now_s(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static const char *templates[] = {
+    "echo \"hello world %d\" 'single | quoted' plain%d\n",
+    "cat input%d.txt | grep -v foo | sort | uniq -c > out%d.txt\n",
+    "ls -la /tmp/dir%d && echo ok || echo failed %d\n",
+    "sleep %d & echo started%d; wc -l < data%d.txt >> log.txt\n",
+    "grep -r pattern%d src/ | head -n %d | cut -d: -f1\n",
+};
+
+/* The split-by-'|' + strtok + strdup path CP_1.c used before the parser */
+static int legacy_parse(const char *line) {
+    int words = 0;
+    char *sline = strdup(line);
+    char *save = NULL;
+    for (char *part = strtok_r(sline, "|", &save); part; part = strtok_r(NULL, "|", &save)) {
+        trim(part);
+        char *c = strdup(part);
+        char **tokens = calloc(LEGACY_MAX_TOKENS, sizeof(char*));
+        int pos = 0;
+        for (char *tok = strtok(c, " \t\n"); tok && pos < LEGACY_MAX_TOKENS - 1; tok = strtok(NULL, " \t\n"))
+            tokens[pos++] = strdup(tok);
+        words += pos;
+        for (int i = 0; i < pos; ++i) free(tokens[i]);
+        free(tokens);
+        free(c);
+    }
+    free(sline);
+    return words;
+}
+
+int main(int argc, char **argv) {
+    size_t mb = argc > 1 ? strtoul(argv[1], NULL, 10) : 8;
+    int reps = argc > 2 ? atoi(argv[2]) : 5;
+    if (mb < 1) mb = 1;
+    if (reps < 1) reps = 1;
+
+    size_t cap = (mb << 20) + 256, len = 0;
+    long lines = 0;
+    char *script = malloc(cap);
+    for (int i = 0; len + 200 < (mb << 20); ++i, ++lines)
+        len += snprintf(script + len, cap - len, templates[i % 5], i, i, i);
+
+    printf("script: %zu bytes, %ld lines\n", len, lines);
+
+    double best = 1e9;
+    for (int r = 0; r < reps; ++r) {
+        double t0 = now_s();
+        struct cmd_list *list = parse_line(script, len);
+        double t = now_s() - t0;
+        if (!list) { fprintf(stderr, "parse failed\n"); return 1; }
+        arena_reset();
+        if (t < best) best = t;
+    }
+    printf("%-16s %8.1f MB/s  %10.0f lines/s\n", "parse_line", len / best / 1e6, lines / best);
+
+    // line at a time, the way the interactive loop feeds it
+    best = 1e9;
+    for (int r = 0; r < reps; ++r) {
+        double t0 = now_s();
+        for (char *p = script, *end = script + len; p < end;) {
+            char *nl = memchr(p, '\n', end - p);
+            parse_line(p, nl - p);
+            arena_reset();
+            p = nl + 1;
+        }
+        double t = now_s() - t0;
+        if (t < best) best = t;
+    }
+    printf("%-16s %8.1f MB/s  %10.0f lines/s\n", "parse_line/line", len / best / 1e6, lines / best);
+
+    best = 1e9;
+    for (int r = 0; r < reps; ++r) {
+        double t0 = now_s();
+        for (char *p = script, *end = script + len; p < end;) {
+            char *nl = memchr(p, '\n', end - p);
+            *nl = '\0';
+            legacy_parse(p);
+            *nl = '\n';
+            p = nl + 1;
+        }
+        double t = now_s() - t0;
+        if (t < best) best = t;
+    }
+    printf("%-16s %8.1f MB/s  %10.0f lines/s\n", "legacy strtok", len / best / 1e6, lines / best);
+
+    // one long line: "echo w w w ..." and "true | true | ..."
+    for (int stages = 0; stages < 2; ++stages) {
+        for (long n = stages ? 1000 : 10000; n <= (stages ? 100000 : 1000000); n *= 10) {
+            const char *unit = stages ? " | true" : " w";
+            len = strlen(strcpy(script, stages ? "true" : "echo"));
+            for (long i = 1; i < n; ++i) {
+                if (len + 8 > cap) script = realloc(script, cap *= 2);
+                memcpy(script + len, unit, strlen(unit));
+                len += strlen(unit);
+            }
+            best = 1e9;
+            for (int r = 0; r < reps; ++r) {
+                double t0 = now_s();
+                struct cmd_list *list = parse_line(script, len);
+                double t = now_s() - t0;
+                if (!list) { fprintf(stderr, "parse failed\n"); return 1; }
+                arena_reset();
+                if (t < best) best = t;
+            }
+            printf("%-9s %7ld %-6s %8.1f MB/s  %10.1f ns/%s\n", "one line,", n, stages ? "stages" : "words",
+                   len / best / 1e6, best * 1e9 / n, stages ? "stage" : "word");
+        }
+    }
+
+    free(script);
+    return 0;
+}
@@ -0,0 +1,86 @@
+// pipe_bench.c  -- pipeline throughput across pipe buffer sizes
+//
+// Build:  gcc -O2 bench/pipe_bench.c -o pipe_bench -pthread
+// Run:    ./pipe_bench [mb] [reps] [size...]     (sizes default to 64k 256k 1M)
+//
+// For every pipe size two pipelines move an mb-sized file into wc -c:
+//   processes  /bin/cat file | /bin/cat | wc -c    three processes, two pipes
+//   copy       < file | wc -c                      the shell splices the file
+// Each is run reps times in-process through execute_line() with
+// PIPESIZE=size in front, and the p50 rate is reported.
+#define MYSHELL_NO_MAIN
+#include "../CP_1.c"
+
+#include <time.h>
+
+static double now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/* p50 time of reps runs of line, in microseconds */
+static double run(const char *line, int reps, double *samples) {
+    char buf[4096];
+    for (int i = -1; i < reps; ++i) {       // one warm-up run
+        snprintf(buf, sizeof(buf), "%s", line);
+        double t0 = now_us();
+        execute_line(buf);
+        if (i >= 0) samples[i] = now_us() - t0;
+    }
+    qsort(samples, reps, sizeof(double), cmp_double);
+    return samples[reps / 2];
+}
+
+int main(int argc, char **argv) {
+    int mb = argc > 1 ? atoi(argv[1]) : 256;
+    int reps = argc > 2 ? atoi(argv[2]) : 5;
+    char *default_sizes[] = { "64k", "256k", "1M" };
+    char **sizes = argc > 3 ? argv + 3 : default_sizes;
+    int nsizes = argc > 3 ? argc - 3 : 3;
+    if (mb < 1) mb = 1;
+    if (reps < 1) reps = 1;
+
+    char path[] = "/tmp/pipe_benchXXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0) { perror("mkstemp"); return 1; }
+    char chunk[1 << 16];
+    for (size_t i = 0; i < sizeof(chunk); ++i) chunk[i] = 'a' + i % 26;
+    for (int i = 0; i < mb * 16; ++i) {
+        if (write(fd, chunk, sizeof(chunk)) != (ssize_t)sizeof(chunk)) { perror("write"); return 1; }
+    }
+    close(fd);
+
+    history_enabled = 0;
+    job_init();
+    double *samples = malloc(sizeof(double) * reps);
+    int devnull = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    int saved_out = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 3);
+    FILE *report = fdopen(saved_out, "w");
+    fprintf(report, "%d MB, p50 of %d runs (fs.pipe-max-size caps the size for non-root)\n", mb, reps);
+    fprintf(report, "%-8s %14s %14s\n", "pipesize", "processes", "copy");
+
+    for (int s = 0; s < nsizes; ++s) {
+        char line[4096];
+        double t[2];
+        dup2(devnull, STDOUT_FILENO);
+        snprintf(line, sizeof(line), "PIPESIZE=%s /bin/cat %s | /bin/cat | wc -c", sizes[s], path);
+        t[0] = run(line, reps, samples);
+        snprintf(line, sizeof(line), "PIPESIZE=%s < %s | wc -c", sizes[s], path);
+        t[1] = run(line, reps, samples);
+        fflush(stdout);
+        fprintf(report, "%-8s %9.0f MB/s %9.0f MB/s\n", sizes[s], mb / (t[0] / 1e6), mb / (t[1] / 1e6));
+        fflush(report);
+    }
+
+    unlink(path);
+    free(samples);
+    fclose(report);
+    close(devnull);
+    return 0;
+}
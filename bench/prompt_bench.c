@@ -0,0 +1,85 @@
+// prompt_bench.c  -- how long the prompt takes to appear, and its git segment
+//
+// Build:  gcc -O2 bench/prompt_bench.c -o prompt_bench -pthread
+// Run:    ./prompt_bench [reps] [dir]     (defaults: 50 prompts, the current directory)
+//
+// Draws PS1='\w \? \j \D [\g]> ' reps times in dir through prompt_render()
+// and prompt_request(), the way print_prompt() does, and reports p50/p99 of the time until the prompt is there, then of the
+// time until the git segment comes in from the prompt thread, next to a
+// plain getcwd() and a synchronous git status run the way the thread runs
+// it. Only the first number is what a user waits for at every prompt.
+#define MYSHELL_NO_MAIN
+#include "../CP_1.c"
+
+static double now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static void report(const char *name, double *samples, int n) {
+    qsort(samples, n, sizeof(double), cmp_double);
+    printf("%-18s p50 %9.1f us   p99 %9.1f us\n", name, samples[n / 2], samples[(n * 99) / 100]);
+}
+
+int main(int argc, char **argv) {
+    int reps = argc > 1 ? atoi(argv[1]) : 50;
+    if (reps < 1) reps = 1;
+    if (argc > 2 && chdir(argv[2]) < 0) { perror(argv[2]); return 1; }
+
+    history_enabled = 0;
+    job_init();
+    var_set("PS1", "\\w \\? \\j \\D [\\g]> ", 0);
+    double *drawn = malloc(sizeof(double) * reps), *git = malloc(sizeof(double) * reps);
+    int answered = 0;
+    for (int i = 0; i < reps; ++i) {
+        // a different directory string every time, so the segment is redrawn
+        cwd_update();
+        char *dir = shell_cwd;
+        shell_cwd = malloc(strlen(dir) + 2);
+        sprintf(shell_cwd, "%s%s", dir, i % 2 ? "/" : "");
+        free(dir);
+
+        double t0 = now_us();
+        unsigned mask = prompt_render();
+        drawn[i] = now_us() - t0;
+        prompt_request(mask);
+        struct pollfd pfd = { prompt_wake_fd(), POLLIN, 0 };
+        int r;
+        do r = poll(&pfd, 1, 5000); while (r < 0 && errno == EINTR);   // git's SIGCHLD
+        if (r > 0) {
+            git[answered++] = now_us() - t0;
+            prompt_render();
+        }
+    }
+    printf("%s\n", prompt_buf);
+    report("prompt drawn", drawn, reps);
+    if (answered) report("git segment in", git, answered);
+
+    for (int i = 0; i < reps; ++i) {
+        double t0 = now_us();
+        char *cwd = getcwd(NULL, 0);
+        drawn[i] = now_us() - t0;
+        free(cwd);
+    }
+    report("getcwd", drawn, reps);
+
+    struct prompt_req rq = { shell_cwd, (char *)hash_lookup("git"), var_envp(), 0 };
+    struct strbuf out = { NULL, 0, 0 };
+    for (int i = 0; i < reps; ++i) {
+        out.len = 0;
+        double t0 = now_us();
+        seg_git(&rq, &out);
+        drawn[i] = now_us() - t0;
+    }
+    report("git status, sync", drawn, reps);
+    free(out.s);
+    free(drawn);
+    free(git);
+    return 0;
+}
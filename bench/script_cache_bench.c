@@ -0,0 +1,99 @@
+// script_cache_bench.c  -- start-up of a long script with and without its cached image
+//
+// Build:  gcc -O2 bench/script_cache_bench.c -o script_cache_bench -pthread
+// Run:    ./script_cache_bench [lines] [reps] [shell]     (defaults: 10000 lines, 20 runs, ./myshell)
+//
+// Generates a script of the given number of lines that is cheap to run
+// but not to parse (assignments guarding pipelines that never start,
+// quoting, redirections, a here-document every 500 lines), then times
+// whole runs of the shell on it, reported as p50/p99:
+//   no cache   MYSHELL_CACHE empty: every line is parsed as it is read
+//   cold       the image is removed first: parse, save, run the image
+//   warm       the image is mapped and run without any parsing
+#define MYSHELL_NO_MAIN
+#include "../CP_1.c"
+
+static double now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static double report(const char *name, double *samples, int n) {
+    qsort(samples, n, sizeof(double), cmp_double);
+    printf("%-10s p50 %9.1f us   p99 %9.1f us\n", name, samples[n / 2], samples[(int)(n * 0.99)]);
+    fflush(stdout);
+    return samples[n / 2];
+}
+
+static double time_launch(char **args, int out_fd) {
+    double t0 = now_us();
+    pid_t pid = spawn_command(args, -1, out_fd, 0);
+    if (pid > 0) waitpid(pid, NULL, 0);
+    return now_us() - t0;
+}
+
+int main(int argc, char **argv) {
+    int lines = argc > 1 ? atoi(argv[1]) : 10000;
+    int reps = argc > 2 ? atoi(argv[2]) : 20;
+    char *shell = argc > 3 ? argv[3] : "./myshell";
+    if (lines < 1) lines = 1;
+    if (reps < 1) reps = 1;
+    if (access(shell, X_OK) != 0) { fprintf(stderr, "%s: %s\n", shell, strerror(errno)); return 1; }
+
+    char dir[] = "/tmp/script_cache_benchXXXXXX";
+    if (!mkdtemp(dir)) { perror("mkdtemp"); return 1; }
+    char script[4096], cache[4096], image[4200];
+    snprintf(script, sizeof(script), "%s/script", dir);
+    snprintf(cache, sizeof(cache), "%s/cache", dir);
+    FILE *f = fopen(script, "w");
+    if (!f) { perror(script); return 1; }
+    for (int i = 0; i < lines; ++i) {
+        switch (i % 4) {
+        case 0: fprintf(f, "V%d=value_%d || echo \"line %d never runs\" | tr a-z A-Z >> /dev/null\n", i % 64, i, i); break;
+        case 1: fprintf(f, "V%d='single %d' && V%d=\"$V%d-x\" || cat < /dev/null | grep -v x | wc -l > /dev/null\n", i % 64, i, i % 64, (i + 1) % 64); break;
+        case 2: fprintf(f, "echo line %d \"$V%d\" 'and more words' to skip > /dev/null; V%d=b\n", i, i % 64, i % 64); break;
+        case 3:
+            if (i % 500 == 3) fprintf(f, "cat <<EOF > /dev/null\nbody of %d $V1\nsecond line\nEOF\n", i);
+            else fprintf(f, "V%d=x || echo unreached 2> /dev/null; V%d=\"${V%d}y\"\n", i % 64, i % 64, i % 64);
+            break;
+        }
+    }
+    fclose(f);
+    struct stat st;
+    stat(script, &st);
+    snprintf(image, sizeof(image), "%s/%016llx.img", cache, (unsigned long long)script_hash(script, strlen(script)));
+
+    int devnull = open("/dev/null", O_RDWR | O_CLOEXEC);
+    double *samples = malloc(sizeof(double) * reps);
+    char *args[] = { shell, script, NULL };
+    printf("%s: %d-line script (%lld bytes), p50 of %d runs\n", shell, lines, (long long)st.st_size, reps);
+
+    var_set("MYSHELL_CACHE", "", 1);
+    for (int i = 0; i < reps; ++i) samples[i] = time_launch(args, devnull);
+    double none = report("no cache", samples, reps);
+
+    var_set("MYSHELL_CACHE", cache, 1);
+    for (int i = 0; i < reps; ++i) {
+        unlink(image);
+        samples[i] = time_launch(args, devnull);
+    }
+    report("cold", samples, reps);
+
+    for (int i = 0; i < reps; ++i) samples[i] = time_launch(args, devnull);
+    double warm = report("warm", samples, reps);
+    if (stat(image, &st) == 0) printf("image %lld bytes, warm start %.1fx faster\n", (long long)st.st_size, none / warm);
+
+    unlink(image);
+    rmdir(cache);
+    unlink(script);
+    rmdir(dir);
+    free(samples);
+    close(devnull);
+    return 0;
+}
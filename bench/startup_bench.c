@@ -0,0 +1,84 @@
+// startup_bench.c  -- cold start latency of the shell in its non-interactive modes
+//
+// Build:  gcc -O2 bench/startup_bench.c -o startup_bench -pthread
+// Run:    ./startup_bench [iterations] [shell]      (shell defaults to ./myshell)
+//
+// Each sample launches the shell, has it run one builtin and waits for it
+// to exit, so it measures exec + startup + teardown. /bin/sh -c is timed
+// the same way as a reference point.
+#define MYSHELL_NO_MAIN
+#include "../CP_1.c"
+
+#include <time.h>
+
+static double now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static void report(const char *name, double *samples, int n) {
+    qsort(samples, n, sizeof(double), cmp_double);
+    double sum = 0;
+    for (int i = 0; i < n; ++i) sum += samples[i];
+    printf("%-14s mean %8.1f us   p50 %8.1f us   p99 %8.1f us\n",
+           name, sum / n, samples[n / 2], samples[(int)(n * 0.99)]);
+}
+
+/* Launch args with stdin from in_fd, wait, return the elapsed time */
+static double time_launch(char **args, int in_fd, int out_fd) {
+    double t0 = now_us();
+    pid_t pid = spawn_command(args, in_fd, out_fd, 0);
+    if (pid > 0) waitpid(pid, NULL, 0);
+    return now_us() - t0;
+}
+
+int main(int argc, char **argv) {
+    int iterations = argc > 1 ? atoi(argv[1]) : 200;
+    char *shell = argc > 2 ? argv[2] : "./myshell";
+    if (iterations < 1) iterations = 1;
+    if (access(shell, X_OK) != 0) { fprintf(stderr, "%s: %s\n", shell, strerror(errno)); return 1; }
+
+    int devnull = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    char script[] = "/tmp/startup_benchXXXXXX";
+    int sfd = mkstemp(script);
+    if (sfd < 0 || write(sfd, "echo\n", 5) != 5) { perror("script"); return 1; }
+    close(sfd);
+    double *samples = malloc(sizeof(double) * iterations);
+
+    printf("starting %s %d times per mode\n", shell, iterations);
+
+    char *dash_c[] = { shell, "-c", "echo", NULL };
+    for (int i = 0; i < iterations; ++i) samples[i] = time_launch(dash_c, -1, devnull);
+    report("-c", samples, iterations);
+
+    char *file[] = { shell, script, NULL };
+    for (int i = 0; i < iterations; ++i) samples[i] = time_launch(file, -1, devnull);
+    report("script", samples, iterations);
+
+    // commands on a pipe, the way test_commands.sh drives the shell
+    char *piped[] = { shell, NULL };
+    for (int i = 0; i < iterations; ++i) {
+        int p[2];
+        if (pipe2(p, O_CLOEXEC) < 0) { perror("pipe"); return 1; }
+        if (write(p[1], "echo\n", 5) != 5) { perror("write"); return 1; }
+        close(p[1]);
+        samples[i] = time_launch(piped, p[0], devnull);
+        close(p[0]);
+    }
+    report("stdin pipe", samples, iterations);
+
+    char *sh[] = { "/bin/sh", "-c", "echo", NULL };
+    for (int i = 0; i < iterations; ++i) samples[i] = time_launch(sh, -1, devnull);
+    report("/bin/sh -c", samples, iterations);
+
+    unlink(script);
+    free(samples);
+    close(devnull);
+    return 0;
+}
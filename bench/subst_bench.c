@@ -0,0 +1,81 @@
+// subst_bench.c  -- command substitution capture rate across output sizes
+//
+// Build:  gcc -O2 bench/subst_bench.c -o subst_bench -pthread
+// Run:    ./subst_bench [reps] [mb...]     (sizes default to 1 8 32)
+//
+// For every size an mb-sized file is captured through command_subst(),
+// once with the builtin cat (no process at all) and once with /bin/cat,
+// and the captured words are split into an argv. The p50 rate is
+// reported; it should stay flat as the size grows, since the capture
+// buffer doubles instead of being copied on every read.
+#define MYSHELL_NO_MAIN
+#include "../CP_1.c"
+
+static double now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/* p50 time of reps expansions of word, in microseconds; *words gets the
+   argv length */
+static double run(const char *word, int reps, double *samples, int *words) {
+    for (int i = -1; i < reps; ++i) {       // one warm-up run
+        struct command cmd = { .argc = 1, .argv = (char *[]){ (char *)word, NULL } };
+        double t0 = now_us();
+        char **argv = expand_argv(&cmd);
+        if (i >= 0) samples[i] = now_us() - t0;
+        for (*words = 0; argv[*words]; ++*words) ;
+        arena_reset();
+    }
+    qsort(samples, reps, sizeof(double), cmp_double);
+    return samples[reps / 2];
+}
+
+int main(int argc, char **argv) {
+    int reps = argc > 1 ? atoi(argv[1]) : 5;
+    char *default_sizes[] = { "1", "8", "32" };
+    char **sizes = argc > 2 ? argv + 2 : default_sizes;
+    int nsizes = argc > 2 ? argc - 2 : 3;
+    if (reps < 1) reps = 1;
+
+    char path[] = "/tmp/subst_benchXXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0) { perror("mkstemp"); return 1; }
+    close(fd);
+    char chunk[1 << 16];
+    for (size_t i = 0; i < sizeof(chunk); ++i) chunk[i] = (i % 8 == 7) ? ' ' : 'a' + i % 26;
+
+    history_enabled = 0;
+    job_init();
+    double *samples = malloc(sizeof(double) * reps);
+    printf("p50 of %d runs\n", reps);
+    printf("%-6s %10s %14s %14s\n", "MB", "words", "builtin cat", "/bin/cat");
+    for (int s = 0; s < nsizes; ++s) {
+        int mb = atoi(sizes[s]);
+        if (mb < 1) mb = 1;
+        FILE *f = fopen(path, "w");
+        if (!f) { perror(path); return 1; }
+        for (int i = 0; i < mb * 16; ++i) fwrite(chunk, 1, sizeof(chunk), f);
+        fclose(f);
+
+        char word[128];
+        int words;
+        double t[2];
+        snprintf(word, sizeof(word), "$(cat %s)", path);
+        t[0] = run(word, reps, samples, &words);
+        snprintf(word, sizeof(word), "$(/bin/cat %s)", path);
+        t[1] = run(word, reps, samples, &words);
+        printf("%-6d %10d %9.0f MB/s %9.0f MB/s\n", mb, words, mb / (t[0] / 1e6), mb / (t[1] / 1e6));
+        fflush(stdout);
+    }
+
+    unlink(path);
+    free(samples);
+    return 0;
+}
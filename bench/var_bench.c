@@ -0,0 +1,78 @@
+// var_bench.c  -- cost of $NAME expansion and of the envp a launch gets
+//
+// Build:  gcc -O2 bench/var_bench.c -o var_bench -pthread
+// Run:    ./var_bench [vars] [millions]     (defaults: 64 variables, 1M expansions)
+//
+// Sets vars variables (half of them exported), then expands a command of
+// 32 "$NAME"/"${NAME}x" words the given number of millions of times
+// through expand_argv() and reports nanoseconds per word. It then times
+// var_envp() with no change (what every launch pays), after an
+// assignment to an exported variable that fits its string, and after
+// unsetting and exporting one again, which rebuilds the array.
+#define MYSHELL_NO_MAIN
+#include "../CP_1.c"
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+int main(int argc, char **argv) {
+    int nvars = argc > 1 ? atoi(argv[1]) : 64;
+    long reps = (argc > 2 ? atol(argv[2]) : 1) * 1000000L;
+    if (nvars < 1) nvars = 1;
+    if (reps < 1) reps = 1000000;
+
+    char name[32], value[64];
+    for (int i = 0; i < nvars; ++i) {
+        snprintf(name, sizeof(name), "WRAP_VAR_%d", i);
+        snprintf(value, sizeof(value), "/opt/wrapper/value/%d", i);
+        var_set(name, value, i % 2);
+    }
+
+    char *words[33];
+    for (int i = 0; i < 32; ++i) {
+        snprintf(name, sizeof(name), i % 2 ? "${WRAP_VAR_%d}x" : "$WRAP_VAR_%d", (i * 7) % nvars);
+        words[i] = strdup(name);
+    }
+    words[32] = NULL;
+    struct command cmd = { .argc = 32, .argv = words };
+
+    long iters = reps / 32 > 0 ? reps / 32 : 1;
+    double t0 = now_ns();
+    for (long i = 0; i < iters; ++i) {
+        char **args = expand_argv(&cmd);
+        __asm__ volatile("" :: "r"(args) : "memory");
+        arena_reset();
+    }
+    printf("%d variables\n", nvars);
+    printf("expand      %7.1f ns/word\n", (now_ns() - t0) / (iters * 32));
+
+    var_envp();
+    t0 = now_ns();
+    for (int i = 0; i < 100000; ++i) {
+        char **env = var_envp();
+        __asm__ volatile("" :: "r"(env) : "memory");
+    }
+    printf("envp, clean %7.1f ns/launch\n", (now_ns() - t0) / 100000);
+
+    t0 = now_ns();
+    for (int i = 0; i < 100000; ++i) {
+        snprintf(value, sizeof(value), "%d", i);
+        var_set("WRAP_VAR_0", value, 1);
+        char **env = var_envp();
+        __asm__ volatile("" :: "r"(env) : "memory");
+    }
+    printf("envp, set   %7.1f ns/launch\n", (now_ns() - t0) / 100000);
+
+    t0 = now_ns();
+    for (int i = 0; i < 100000; ++i) {
+        var_unset("WRAP_VAR_0");
+        var_set("WRAP_VAR_0", "again", 1);
+        char **env = var_envp();
+        __asm__ volatile("" :: "r"(env) : "memory");
+    }
+    printf("envp, new   %7.1f ns/launch\n", (now_ns() - t0) / 100000);
+    return 0;
+}
@@ -20,11 +20,8 @@ run_test() {
 
     echo "[$name]" >> "$REPORT_FILE"
     echo "Command(s): $cmd" >> "$REPORT_FILE"
-    local start=$(date +%s%3N)
 
     echo "$cmd" | $SHELL_BIN > "$outfile" 2>&1
-    local end=$(date +%s%3N)
-    local elapsed=$((end - start))
 
     if grep -Eq "$pattern" "$outfile"; then
         echo "✅ PASS — Pattern matched: $pattern" >> "$REPORT_FILE"
@@ -34,7 +31,6 @@ run_test() {
         head -n 5 "$outfile" >> "$REPORT_FILE"
     fi
 
-    echo "⏱️  Time: ${elapsed}ms" >> "$REPORT_FILE"
     echo "-----------------------------------------------" >> "$REPORT_FILE"
 }
 
@@ -43,13 +39,15 @@ run_test() {
 run_test "Echo" "echo hello world" "hello world"
 run_test "PWD" "pwd" "/app"
 run_test "CD" "cd /; pwd" "^/$"
+run_test "Cwd_Cache" "cd /tmp; echo sub=\$(cd /; pwd) now=\$(pwd)" "sub=/ now=/tmp$"
+run_test "Prompt_Hash" "echo 'PS1=\"\\g> \"' > pin; echo hash >> pin; echo exit >> pin; script -qec './myshell --child' /dev/null < pin" "hash table empty"
 
 # ============ REDIRECTION ============
 
 echo "redirect me" > redir_in.txt
 run_test "Input_Redirection" "cat < redir_in.txt" "redirect me"
 run_test "Output_Redirection" "echo test123 > out.txt; cat out.txt" "test123"
-run_test "Append_Redirection" "echo line1 > file.txt; echo line2 >> file.txt; cat file.txt" "line1.*line2"
+run_test "Append_Redirection" "echo line1 > file.txt; echo line2 >> file.txt; cat file.txt | tr '\\n' ' '" "line1 line2"
 
 # ============ PIPES ============
 
@@ -60,7 +58,10 @@ run_test "Pipe_With_Sort" "echo -e 'z\ny\nx' | sort" "x"
 
 # ============ BACKGROUND PROCESSES ============
 
-run_test "Background_Job" "sleep 1 &" "(&|PID|myshell)"
+run_test "Background_Job" "sleep 1 &
+jobs -l" "[0-9]+ Running +sleep 1 &"
+run_test "Jobs" "sleep 2 &
+jobs" "Running +sleep 2 &"
 
 # ============ ERROR HANDLING ============
 
@@ -71,12 +72,53 @@ run_test "Permission_Error" "cat /root/secretfile" "(Permission|denied)"
 
 run_test "History" "ls; pwd; history" "history"
 run_test "Chaining" "cd /tmp; pwd" "/tmp"
+run_test "And_Or" "false && echo no || echo yes" "yes"
+run_test "Quoting" "echo \"a|b\" 'c;d'" "a\|b c;d"
+run_test "History_Search" "echo alpha
+echo beta
+history -s alph" "[0-9]+ echo alpha"
+run_test "Memstats" "echo warm
+memstats" "arena chunks: +1 "
+run_test "Hash" "ls > /dev/null
+hash" "[0-9]+.*/ls"
+run_test "Builtin_Pipe" "ls > /dev/null
+hash | grep -c /ls" "^1[[:space:]]*$"
+run_test "Builtin_Pipe_State" "ls > /dev/null; hash -r | cat; hash" "[0-9]+.*/ls"
 
 # ============ STRESS / EDGE ============
 
+run_test "Pipe_Size" "set -o pipesize=256k; PIPESIZE=128k seq 3 | wc -l; set -o" "pipesize.262144"
+run_test "Pipe_Size_Range" "set -o pipesize=99999999999g || set -o pipesize=99999999999999999999 || echo both-rejected" "^both-rejected$"
+run_test "Time" "time seq 100 | wc -l" "^ +2 +0 +[0-9.]+s .* wc -l$"
+run_test "Pipe_Status" "false | sh -c 'exit 3' | true; echo status \${PIPESTATUS[@]} \$?" "status 1 3 0 0"
+run_test "Variables" "A='x  y'; export B=\"\$A\"; C=c sh -c 'echo \"[\$B]\$C\"'; echo \$C-" "^\\[x  y\\]c$"
+run_test "Command_Subst" "echo [\$(echo a b | wc -w)] \"\$(echo 'x  y')\" \`echo bq\`" "^\\[2\\] x  y bq$"
+run_test "Subst_Scope" "A=1; echo \$(A=2; echo in=\$A) out=\$A" "^in=2 out=1$"
+run_test "Subst_Export" "echo \$(export Z=9; set -o pipesize=64k); sh -c 'echo z=[\$Z]'; set -o" "^z=\\[\\]$"
+run_test "Glob" "mkdir -p gd/s; touch gd/b.c gd/a.c gd/s/c.c gd/h; echo gd/*.c '*' gd/**/*.c gd/?" "^gd/a.c gd/b.c \\* gd/a.c gd/b.c gd/s/c.c gd/h gd/s$"
+run_test "Glob_Long" "echo $(printf 'a/%.0s' {1..500000})* | wc -c" "^ *1000002$"
+run_test "Heredoc" "A=x; cat <<< \"[\$A  y]\" | tr -d '\\n'; cat <<EOF | tr -d '\\n'; cat <<'E'
+1 \$A,
+EOF
+2 \$A
+E" "^\\[x  y\\]1 x,2 \\\$A$"
+run_test "Completion" "mkdir -p cq/sub; touch cq/file1 cq/cqtool; chmod +x cq/cqtool; PATH=cq:\$PATH; echo \$(compgen -c cqt) \$(compgen -c memst) \$(compgen -f cq/)" "^cqtool memstats cq/cqtool cq/file1 cq/sub/$"
+run_test "Trace" "set -o trace; ls > /dev/null; stats" "^exec +ls +1 "
+run_test "Launcher" "set -o launcher; sh -c 'exit 3' || /bin/echo via-launcher | tr a-z A-Z" "^VIA-LAUNCHER"
+run_test "Cat_Cp" "echo data > src.txt; cp src.txt dst.txt; cat dst.txt src.txt - < src.txt | wc -l" "^3"
+run_test "Copy_Stage" "echo copied > c.txt; < c.txt | cat | tr a-z A-Z" "^COPIED"
+run_test "Cat_Terminal" "sh -c '(echo \"cat | wc -l\"; sleep 0.5; printf \"one\\ntwo\\n\"; sleep 0.3; printf \"\\004\"; sleep 0.3; echo exit) | script -qec \"./myshell --child\" /dev/null'" "^2.?$"
+run_test "Stop_Builtin_Stage" "sh -c '(echo \"sleep 100 | cat\"; sleep 0.5; printf \"\\032\"; sleep 0.3; echo \"echo alive \\\$?\"; sleep 0.3; echo exit) | script -qec \"./myshell --child\" /dev/null'" "^alive 148"
+run_test "Parallel" "parallel -j 2 -k echo item-{} ::: a b c | tr '\\n' ' '" "item-a item-b item-c"
+run_test "Parallel_Launcher" "set -o launcher; X=v; parallel -k 'echo \$X-{} | tr a-z A-Z' ::: p q | tr '\\n' ' '" "^V-P V-Q $"
+run_test "Command_String" "./myshell -c 'echo one; exit 3' || echo exit-status-kept" "exit-status-kept"
+run_test "Script_No_Shebang" "echo 'echo plain-\$1' > ns.sh; chmod +x ns.sh; A=\$(./ns.sh sh); chmod -x ns.sh; ./ns.sh; echo \$A status \$?" "^plain-sh status 126$"
+run_test "Script_Cache" "echo 'A=img; echo run-\$A' > sc.sh; echo \$(MYSHELL_CACHE=scc ./myshell sc.sh) \$(MYSHELL_CACHE=scc ./myshell sc.sh) \$(ls scc)" "^run-img run-img [0-9a-f]{16}\\.img$"
+run_test "Script_Cache_Damage" "echo 'A=img; echo run-\$A' > sd.sh; MYSHELL_CACHE=sdc ./myshell sd.sh; head -c 32 /dev/zero | tr '\\000' '\\377' | dd of=\$(echo sdc/*.img) bs=1 seek=40 conv=notrunc; echo damaged \$(MYSHELL_CACHE=sdc ./myshell sd.sh)" "^damaged run-img$"
 run_test "Long_Command" "$(printf 'echo x%.0s' {1..1000})" "x"
+run_test "Long_Line" "/bin/echo$(printf ' w%.0s' {1..20000})$(printf ' | cat%.0s' {1..100}) | wc -w" "^ *20000$"
 run_test "Multiple_Pipes_Long" "seq 1 100 | grep 5 | grep 0 | wc -l" "[1-9]"
-run_test "Multiple_Redirections" "echo hi >a.txt; echo bye >>a.txt; cat a.txt" "hi.*bye"
+run_test "Multiple_Redirections" "echo hi >a.txt; echo bye >>a.txt; cat a.txt | tr '\\n' ' '" "hi bye"
 
 echo "===============================================" >> "$REPORT_FILE"
 echo "All extended tests completed." >> "$REPORT_FILE"